@@ -1,24 +1,47 @@
 // This is a utility to convert ASF/AMC files, which are largely unsupported, to
-// BVH files, which are in common use. It has no nonstandard dependencies, and
-// should compile on both Unix-based systems and Windows.
+// BVH files, which are in common use. Its only nonstandard dependency is zlib,
+// for compressed inputs and packs, which can be left out by building with ZLIB=0.
+// It should compile on both Unix-based systems and Windows.
 
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
 #include <errno.h>
+#include <time.h>
+#include <stdarg.h>
 #include "amc2bvh.h"
 
 // parse command line arguments and perform the conversion
+#ifndef AMC2BVH_NO_MAIN
 int main(int argc, char **argv) {
     char *input_1 = NULL,
          *input_2 = NULL,
          *asf_filename,
-         *amc_filename,
-         *output_filename = "out.bvh",
-         *err_str;
-    int fps = 120,
-        max_children = 6;
-    bool verbose = false;
+         *amc_filename = NULL,
+         *output_filename = NULL,
+         *manifest_filename = NULL,
+         *trace_filename = NULL,
+         *listen_address = NULL,
+         *err_str,
+         *err_other;
+    int fps = 120;
+    float follow_timeout = 10;
+    bool verbose = false,
+         follow = false,
+         scan = false,
+         perf_counters = false;
+    struct output_options options = { .raw = false, .quaternions = false, .storage = STORAGE_FLOAT32, .joints = NULL, .exclude_joints = NULL,
+                                      .scale = 1, .up_axis = NULL, .forward_axis = NULL, .stats = false, .retarget = NULL };
+    struct watch_options watch = { .directory = NULL, .output_directory = NULL, .jobs = 4, .settle_ms = 1000 };
+    char *inputs[argc];
+    unsigned input_count = 0,
+             io_depth = 16,
+             jobs = 0,
+             first_frame = 0,
+             end_frame = -1,
+             listen_port = 0;
+    bool has_frames = false,
+         listen_udp = false;
 
     // parse arguments
     if (argc == 1) goto print_usage;
@@ -28,17 +51,100 @@ int main(int argc, char **argv) {
 
         if (streq(tok, "--help")) {
             printf("Usage: %s FILE.asf FILE.amc [OPTIONS]\n", argv[0]);
+            printf("   or: %s FILE.asf FILE.amc... [OPTIONS]\n", argv[0]);
+            printf("   or: %s --watch DIR [OPTIONS]\n", argv[0]);
+            printf("   or: %s --scan DIR... [OPTIONS]\n", argv[0]);
+            printf("   or: %s FILE.asf... FILE.amc... -o FILE.amcpack [OPTIONS]\n", argv[0]);
+            printf("   or: %s FILE.amcpack [TAKE] [OPTIONS]\n", argv[0]);
+            printf("   or: %s FILE.zip [-o DIR] [OPTIONS]\n", argv[0]);
+            printf("   or: %s FILE.asf --listen [tcp:|udp:]PORT [OPTIONS]\n", argv[0]);
             printf("Convert an ASF/AMC file pair to a BVH file.\n"
                    "\n"
                    "The ASF (Acclaim Skeleton Format) and AMC (Acclaim Motion Capture) input files are detected\n"
                    "by file extension when possible. Otherwise, the first non-argument value is assumed to be the\n"
                    "ASF file and the second is assumed to be the AMC file.\n"
-                   "  -c, --children COUNT       set the maximum number of children of any bone (default 6)\n"
+                   "\n"
+                   "If the output file ends in .npy, the motion is instead written as a NumPy float32 array of\n"
+                   "shape (frames, channels), with a .json sidecar naming the joint and channel of each column.\n"
+                   "If it ends in .glb, the skeleton and motion are written as a binary glTF animation.\n"
+                   "\n"
+                   "Given several AMC files and one ASF file, each AMC file is converted to a BVH file of the same\n"
+                   "name in the output directory.\n"
+                   "\n"
+                   "With --watch, AMC files dropped into DIR are converted to BVH files in the output directory\n"
+                   "(-o, default DIR) once they stop changing. Each is paired with the ASF file of the same name,\n"
+                   "or else the one named by the part before the first underscore (01.asf for 01_02.amc).\n"
+                   "\n"
+                   "If the output file ends in .amcpack, the ASF and AMC files are packed into one compressed file,\n"
+                   "from which any take can be converted later. Each AMC file is paired with an ASF file as with\n"
+                   "--watch. Given a pack and the name of a take in it (its AMC file's name, without .amc), the take\n"
+                   "is converted; given just a pack, its takes are listed.\n"
+                   "\n"
+                   "Inputs may be gzipped (FILE.amc.gz) or in a zip archive (ARCHIVE.zip:MEMBER), and are then\n"
+                   "decompressed as they're read. Given just a zip archive, every AMC file in it is converted to a\n"
+                   "BVH file of the same name in the output directory, paired with an ASF file as with --watch.\n"
+                   "\n"
+                   "With --listen, AMC frames sent to PORT on the loopback interface are converted and sent back as\n"
+                   "BVH motion lines as soon as each is complete, after the BVH hierarchy. Each TCP connection, or\n"
+                   "new UDP sender, gets the hierarchy again. The latency of each frame is reported at the end.\n"
+                   "\n"
+                   "With --scan, every AMC file in the given directories is summarized (frames, duration, joints,\n"
+                   "units, size, and any error) in one JSON line per file, or as CSV if the output ends in .csv.\n"
+                   "  -c, --children COUNT       ignored; bones may have any number of children\n"
+                   "      --follow               keep reading the AMC file as it grows, appending each frame to\n"
+                   "                               the BVH file as soon as it's complete (BVH output only)\n"
+                   "      --follow-timeout SECS  with --follow, stop once the AMC file hasn't grown for this\n"
+                   "                               long (default 10)\n"
+                   "      --exclude-joints LIST  leave out the comma-separated bones and everything attached below\n"
+                   "                               them, e.g. lfingers,rfingers\n"
+                   "      --forward-axis AXIS    the output's forward axis, as x, y, z, -x, -y or -z; ASF files are\n"
+                   "                               taken to be Z forward (default z, or -y with Z up and y with\n"
+                   "                               -Z up)\n"
+                   "      --frames FIRST:END     with a motion pack, convert only frames FIRST up to but not including\n"
+                   "                               END, counting from 0; either may be left out\n"
                    "  -f, --fps FPS              set the output frames per second; this changes the playback\n"
                    "                               rate, not the underlying motion data (default 120)\n"
-                   "  -o FILE                    the output file (default out.bvh)\n"
+                   "      --io-depth COUNT       with several AMC files, the most reads and writes to have in\n"
+                   "                               flight at once, or 0 for blocking I/O (default 16)\n"
+                   "  -j, --jobs COUNT           with --watch, --scan or several AMC files, the number of threads\n"
+                   "                               (default 4 with --watch, otherwise the number of cores)\n"
+                   "      --joints LIST          keep only the comma-separated bones and the bones connecting them\n"
+                   "                               to the root, or a preset: body (no fingers or toes), core (no\n"
+                   "                               hands, fingers or toes), or root (the root trajectory only)\n"
+                   "      --listen ADDRESS       stream frames received on [tcp:|udp:]PORT, on 127.0.0.1 (TCP by\n"
+                   "                               default), until interrupted\n"
+                   "      --manifest FILE        skip the conversion if the output is up to date according to the\n"
+                   "                               build manifest FILE, and record it there otherwise\n"
+                   "  -o FILE                    the output file (default out.bvh), or directory with --watch or\n"
+                   "                               several AMC files (default DIR or the current directory)\n"
+                   "      --perf-counters        report wall time, cycles, instructions, IPC, branch and cache misses\n"
+                   "                               and page faults for each phase of a single conversion\n"
+                   "  -q, --quaternions          write each joint's rotation as a quaternion (W X Y Z) instead of\n"
+                   "                               Euler angles; this is not standard BVH (.bvh and .npy output)\n"
+                   "      --raw                  write the AMC channels as parsed (in radians) rather than the\n"
+                   "                               converted BVH channels (.npy output only)\n"
+                   "      --retarget FILE        retarget the motion onto the rig described by FILE, which maps bones\n"
+                   "                               to target joints and gives their rest offsets and rotations\n"
+                   "      --scale FACTOR         multiply every offset and translation by FACTOR, e.g. 0.0254 to\n"
+                   "                               convert inches to meters (default 1)\n"
+                   "      --scan                 summarize the AMC files in the given directories instead of\n"
+                   "                               converting anything, writing to -o FILE or standard output\n"
+                   "      --settle MS            with --watch, wait until a file hasn't changed for this long\n"
+                   "                               before converting it (default 1000)\n"
+                   "      --stats                also write the minimum, maximum, mean and variance of every channel,\n"
+                   "                               and each joint's slowest and fastest rotation, to a .stats.json\n"
+                   "                               file beside the output (.bvh and .npy output)\n"
+                   "      --storage TYPE         keep the parsed motion in memory as float32 (the default), float16,\n"
+                   "                               or int16, which stores rotations in steps of 0.0055 degrees\n"
+                   "                               and translations as float16; this uses less memory, and the\n"
+                   "                               largest error it causes is reported\n"
+                   "      --trace FILE           write a Chrome trace of the conversion to FILE, for viewing in\n"
+                   "                               Perfetto or chrome://tracing\n"
                    "      --verbose              show parsing information and warnings\n"
+                   "      --up-axis AXIS         the output's up axis, as x, y, z, -x, -y or -z; ASF files are\n"
+                   "                               taken to be Y up (default y)\n"
                    "  -v, --version              print version information\n"
+                   "      --watch DIR            convert AMC files as they appear in DIR, until interrupted\n"
                );
             return 0;
         } else if (streq(tok, "-h")) {
@@ -48,40 +154,311 @@ int main(int argc, char **argv) {
             return 0;
         } else if (streq(tok, "--verbose")) {
             verbose = true;
+        } else if (streq(tok, "--scan")) {
+            scan = true;
+        } else if (streq(tok, "--perf-counters")) {
+            perf_counters = true;
+        } else if (streq(tok, "--follow")) {
+            follow = true;
+        } else if (streq(tok, "--follow-timeout")) {
+            if (i+1 >= argc || starts_with(argv[i+1], "-")) goto val_required;
+            else follow_timeout = fabs(atof(argv[++i]));
+        } else if (streq(tok, "--trace")) {
+            if (i+1 >= argc || starts_with(argv[i+1], "-")) goto val_required;
+            else trace_filename = argv[++i];
+        } else if (streq(tok, "--listen")) {
+            if (i+1 >= argc || starts_with(argv[i+1], "-")) goto val_required;
+            else if (!parse_listen_address(argv[++i], &listen_udp, &listen_port)) {
+                err_str = argv[i];
+                goto opt_unknown;
+            }
+            listen_address = argv[i];
+        } else if (streq(tok, "--manifest")) {
+            if (i+1 >= argc || starts_with(argv[i+1], "-")) goto val_required;
+            else manifest_filename = argv[++i];
+        } else if (streq(tok, "--io-depth")) {
+            if (i+1 >= argc || starts_with(argv[i+1], "-")) goto val_required;
+            else io_depth = abs(atoi(argv[++i]));
+        } else if (streq(tok, "--watch")) {
+            if (i+1 >= argc || starts_with(argv[i+1], "-")) goto val_required;
+            else watch.directory = argv[++i];
+        } else if (streq(tok, "--jobs") || streq(tok, "-j")) {
+            if (i+1 >= argc || starts_with(argv[i+1], "-")) goto val_required;
+            else jobs = abs(atoi(argv[++i]));
+            if (jobs == 0) jobs = 1;
+        } else if (streq(tok, "--frames")) {
+            char *sep;
+            if (i+1 >= argc || starts_with(argv[i+1], "-")) goto val_required;
+            else if (!(sep = strchr(argv[++i], ':'))) {
+                err_str = argv[i];
+                goto opt_unknown;
+            }
+            first_frame = abs(atoi(argv[i]));
+            if (sep[1]) end_frame = abs(atoi(sep+1));
+            has_frames = true;
+        } else if (streq(tok, "--settle")) {
+            if (i+1 >= argc || starts_with(argv[i+1], "-")) goto val_required;
+            else watch.settle_ms = abs(atoi(argv[++i]));
+        } else if (streq(tok, "--storage")) {
+            if (i+1 >= argc || starts_with(argv[i+1], "-")) goto val_required;
+            else if (!parse_sample_storage(argv[++i], &options.storage)) {
+                err_str = argv[i];
+                goto opt_unknown;
+            }
+        } else if (streq(tok, "--joints")) {
+            if (i+1 >= argc || starts_with(argv[i+1], "-")) goto val_required;
+            else options.joints = argv[++i];
+        } else if (streq(tok, "--exclude-joints")) {
+            if (i+1 >= argc || starts_with(argv[i+1], "-")) goto val_required;
+            else options.exclude_joints = argv[++i];
+        } else if (streq(tok, "--scale")) {
+            if (i+1 >= argc || starts_with(argv[i+1], "-")) goto val_required;
+            else options.scale = fabs(atof(argv[++i]));
+            if (options.scale == 0) options.scale = 1;
+        } else if (streq(tok, "--up-axis") || streq(tok, "--forward-axis")) {
+            // axes may be negative, so the value can start with a -
+            struct vec3 axis;
+            if (i+1 >= argc) goto val_required;
+            else if (!parse_axis(argv[++i], &axis)) {
+                err_str = argv[i];
+                goto opt_unknown;
+            }
+            if (streq(tok, "--up-axis")) options.up_axis = argv[i];
+            else options.forward_axis = argv[i];
+        } else if (streq(tok, "--retarget")) {
+            if (i+1 >= argc || starts_with(argv[i+1], "-")) goto val_required;
+            else options.retarget = argv[++i];
+        } else if (streq(tok, "--raw")) {
+            options.raw = true;
+        } else if (streq(tok, "--stats")) {
+            options.stats = true;
+        } else if (streq(tok, "--quaternions") || streq(tok, "-q")) {
+            options.quaternions = true;
         } else if (streq(tok, "--fps") || streq(tok, "-f")) {
             if (i+1 >= argc || starts_with(argv[i+1], "-")) goto val_required;
             else fps = abs(atoi(argv[++i]));
         } else if (streq(tok, "--children") || streq(tok, "-c")) {
+            // kept for compatibility, there is no longer a limit
             if (i+1 >= argc || starts_with(argv[i+1], "-")) goto val_required;
-            else max_children = abs(atoi(argv[++i]));
+            else i++;
         } else if (streq(tok, "-o")) {
             if (i+1 >= argc || starts_with(argv[i+1], "-")) goto val_required;
             else output_filename = argv[++i];
         } else if (starts_with(tok, "-")) {
             goto opt_unknown;
         } else {
-            if (!input_1) input_1 = tok;
-            else if (!input_2) input_2 = tok;
-            else goto opt_unknown;
+            inputs[input_count++] = tok;
         }
     }
 
-    if (!input_1 || !input_2) {
+    const char *invalid = validate_convention(&options);
+    if (invalid) {
+        fprintf(stderr, "%s: %s\n", argv[0], invalid);
+        return 1;
+    }
+
+    // the counters only follow this thread, so only a single conversion is measured
+    if (perf_counters) {
+        bool is_pack = (input_count > 0 && (ends_with(inputs[0], ".amcpack") || ends_with(inputs[0], ".AMCPACK"))) ||
+                       (output_filename && (ends_with(output_filename, ".amcpack") || ends_with(output_filename, ".AMCPACK")));
+        if (listen_address || scan || watch.directory || follow || is_pack || input_count > 2 ||
+            (input_count > 0 && (ends_with(inputs[0], ".zip") || ends_with(inputs[0], ".ZIP")))) {
+            err_str = listen_address ? "--listen" : scan ? "--scan" : watch.directory ? "--watch" : follow ? "--follow" :
+                      is_pack ? "a motion pack" : input_count > 2 ? "several AMC files" : inputs[0];
+            err_other = "--perf-counters";
+            goto opt_incompatible;
+        }
+        perf_open();
+    }
+
+    if (trace_filename && !trace_open(trace_filename)) {
+        err_str = trace_filename;
+        goto fopen_error;
+    }
+
+    // stream frames between a socket and a live client
+    if (listen_address) {
+        if (scan || watch.directory || follow || manifest_filename || options.stats || has_frames || output_filename) {
+            err_str = scan ? "--scan" : watch.directory ? "--watch" : follow ? "--follow" : manifest_filename ? "--manifest" :
+                      options.stats ? "--stats" : has_frames ? "--frames" : "-o";
+            err_other = "--listen";
+            goto opt_incompatible;
+        } else if (input_count == 0) {
+            err_str = "an ASF file";
+            goto opt_required;
+        } else if (input_count > 1) {
+            err_str = inputs[1];
+            goto opt_unknown;
+        }
+        FILE *asf;
+        if (!(asf=open_input(inputs[0]))) {
+            err_str = inputs[0];
+            goto fopen_error;
+        }
+        struct amc_skeleton *skeleton = parse_asf_skeleton(asf, verbose);
+        fclose(asf);
+        amc_skeleton_apply_options(skeleton, &options, verbose);
+        int status = stream_amc_motion(listen_udp, listen_port, skeleton, fps, &options, verbose);
+        amc_skeleton_free(skeleton);
+        if (trace_close()) fprintf(stderr, "%s: unable to write '%s': %s\n", argv[0], trace_filename, strerror(errno));
+        return status;
+    }
+
+    if (scan) {
+        if (watch.directory || follow || manifest_filename) {
+            err_str = "--scan";
+            err_other = watch.directory ? "--watch" : follow ? "--follow" : "--manifest";
+            goto opt_incompatible;
+        } else if (input_count == 0) {
+            err_str = "a directory to scan";
+            goto opt_required;
+        }
+        return scan_library(inputs, input_count, output_filename, jobs, fps, verbose);
+    }
+
+    if (watch.directory) {
+        if (jobs) watch.jobs = jobs;
+        if (input_count > 0) {
+            err_str = inputs[0];
+            goto opt_unknown;
+        } else if (follow || manifest_filename || options.stats) {
+            err_str = follow ? "--follow" : manifest_filename ? "--manifest" : "--stats";
+            err_other = "--watch";
+            goto opt_incompatible;
+        }
+        watch.output_directory = output_filename ? output_filename : watch.directory;
+        int status = watch_directory(&watch, fps, &options, verbose);
+        if (trace_close()) fprintf(stderr, "%s: unable to write '%s': %s\n", argv[0], trace_filename, strerror(errno));
+        return status;
+    }
+
+    // convert every take in a zip archive, opening it only once
+    if (input_count > 0 && (ends_with(inputs[0], ".zip") || ends_with(inputs[0], ".ZIP"))) {
+        if (follow || manifest_filename || options.stats || has_frames) {
+            err_str = follow ? "--follow" : manifest_filename ? "--manifest" : options.stats ? "--stats" : "--frames";
+            err_other = inputs[0];
+            goto opt_incompatible;
+        } else if (input_count > 1) {
+            err_str = inputs[1];
+            goto opt_unknown;
+        }
+        int status = convert_zip_archive(inputs[0], output_filename ? output_filename : ".", fps, &options, verbose);
+        if (trace_close()) fprintf(stderr, "%s: unable to write '%s': %s\n", argv[0], trace_filename, strerror(errno));
+        return status;
+    }
+
+    // pack every take into one file
+    if (output_filename && (ends_with(output_filename, ".amcpack") || ends_with(output_filename, ".AMCPACK"))) {
+        if (follow || manifest_filename || options.stats || has_frames || options.retarget) {
+            err_str = follow ? "--follow" : manifest_filename ? "--manifest" : options.stats ? "--stats" : has_frames ? "--frames" : "--retarget";
+            err_other = output_filename;
+            goto opt_incompatible;
+        } else if (input_count < 2) {
+            err_str = "an ASF file and AMC files";
+            goto opt_required;
+        }
+        int status = write_pack(output_filename, inputs, input_count, &options, verbose);
+        if (trace_close()) fprintf(stderr, "%s: unable to write '%s': %s\n", argv[0], trace_filename, strerror(errno));
+        return status;
+    }
+
+    // or list or convert a take from a pack
+    enum output_format format = OUTPUT_BVH;
+    if (input_count > 0 && (ends_with(inputs[0], ".amcpack") || ends_with(inputs[0], ".AMCPACK"))) {
+        // the skeleton options were applied when packing
+        if (follow || manifest_filename || options.joints || options.exclude_joints || options.scale != 1 || options.up_axis || options.forward_axis || options.retarget) {
+            err_str = follow ? "--follow" : manifest_filename ? "--manifest" : options.joints ? "--joints" : options.exclude_joints ? "--exclude-joints" :
+                      options.scale != 1 ? "--scale" : options.up_axis ? "--up-axis" : options.forward_axis ? "--forward-axis" : "--retarget";
+            err_other = inputs[0];
+            goto opt_incompatible;
+        } else if (input_count > 2) {
+            err_str = inputs[2];
+            goto opt_unknown;
+        }
+        if (!output_filename) output_filename = "out.bvh";
+        format = output_format_from_filename(output_filename);
+        if (options.stats && format == OUTPUT_GLB) {
+            err_str = "--stats";
+            err_other = "glTF output";
+            goto opt_incompatible;
+        }
+
+        struct motion_pack *pack = pack_open(inputs[0]);
+        if (!pack) {
+            err_str = inputs[0];
+            goto fopen_error;
+        }
+        if (input_count == 1) {
+            pack_list(pack, stdout);
+            pack_close(pack);
+            return 0;
+        }
+        int clip = pack_find_clip(pack, inputs[1]);
+        if (clip < 0) {
+            fprintf(stderr, "%s: no take named '%s' in '%s'\n", argv[0], inputs[1], inputs[0]);
+            pack_close(pack);
+            return 1;
+        }
+        struct amc_skeleton *skeleton = pack_read_skeleton(pack, clip);
+        struct amc_motion *motion = pack_read_motion(pack, clip, skeleton, first_frame, end_frame);
+        pack_close(pack);
+        if (verbose) printf("Read %u frames of %s from %s\n", motion->sample_count, inputs[1], inputs[0]);
+        int status = write_motion_file(skeleton, motion, output_filename, format, fps, &options, verbose, &err_str);
+        amc_motion_free(motion);
+        amc_skeleton_free(skeleton);
+        if (status) goto fopen_error;
+        if (trace_close()) fprintf(stderr, "%s: unable to write '%s': %s\n", argv[0], trace_filename, strerror(errno));
+        return 0;
+    } else if (has_frames) {
+        err_str = "--frames";
+        err_other = "AMC input";
+        goto opt_incompatible;
+    }
+
+    // with several AMC files, convert them all into the output directory
+    bool batch = input_count > 2;
+    if (batch) {
+        unsigned amc_count = 0;
+        asf_filename = NULL;
+        err_str = "exactly one ASF file";
+        for (unsigned i = 0; i < input_count; i++) {
+            if (is_input_type(inputs[i], ".asf")) {
+                if (asf_filename) goto opt_required;
+                asf_filename = inputs[i];
+            } else {
+                inputs[amc_count++] = inputs[i]; // the rest are AMC files
+            }
+        }
+        if (!asf_filename) goto opt_required;
+        input_count = amc_count;
+        if (follow) {
+            err_str = "--follow";
+            err_other = "several AMC files";
+            goto opt_incompatible;
+        }
+        if (!output_filename) output_filename = ".";
+        goto parse_skeleton;
+    }
+    if (!output_filename) output_filename = "out.bvh";
+
+    if (input_count < 2) {
         err_str = "both an ASF and AMC file";
         goto opt_required;
     }
+    input_1 = inputs[0];
+    input_2 = inputs[1];
 
     // attempt to detect ASF and AMC files by extension
-    if (ends_with(input_1, ".asf") || ends_with(input_1, ".ASF")) {
+    if (is_input_type(input_1, ".asf")) {
         asf_filename = input_1;
         amc_filename = input_2;
-    } else if (ends_with(input_2, ".asf") || ends_with(input_2, ".ASF")) {
+    } else if (is_input_type(input_2, ".asf")) {
         asf_filename = input_2;
         amc_filename = input_1;
-    } else if (ends_with(input_1, ".amc") || ends_with(input_1, ".AMC")) {
+    } else if (is_input_type(input_1, ".amc")) {
         amc_filename = input_1;
         asf_filename = input_2;
-    } else if (ends_with(input_2, ".amc") || ends_with(input_2, ".AMC")) {
+    } else if (is_input_type(input_2, ".amc")) {
         asf_filename = input_1;
         amc_filename = input_2;
     } else {
@@ -90,38 +467,109 @@ int main(int argc, char **argv) {
         amc_filename = input_2;
     }
 
-    FILE *asf, *amc, *bvh;
-    if (!(asf=fopen(asf_filename, "r"))) {
+    format = output_format_from_filename(output_filename);
+    if (follow && format != OUTPUT_BVH) {
+        err_str = "--follow";
+        goto opt_unsupported;
+    }
+    if (follow && (manifest_filename || options.stats || is_compressed_input(amc_filename))) {
+        err_str = manifest_filename ? "--manifest" : options.stats ? "--stats" : amc_filename;
+        err_other = "--follow";
+        goto opt_incompatible;
+    }
+    if (options.stats && format == OUTPUT_GLB) {
+        err_str = "--stats";
+        err_other = "glTF output";
+        goto opt_incompatible;
+    }
+
+parse_skeleton:;
+    // skip the work entirely if nothing has changed since the last conversion
+    struct manifest *manifest = NULL;
+    struct manifest_input asf_input, amc_input;
+    char stamp[BUFFSIZE];
+    int status = 0;
+    if (manifest_filename) {
+        manifest = manifest_load(manifest_filename);
+        manifest_stamp(stamp, sizeof(stamp), fps, &options);
+        if (!batch && manifest_is_up_to_date(manifest, output_filename, stamp, asf_filename, amc_filename)) {
+            printf("'%s' is up to date\n", output_filename);
+            // the manifest may have noted new modification times
+            manifest_save(manifest, manifest_filename);
+            manifest_free(manifest);
+            trace_close();
+            return 0;
+        }
+        // the inputs as they are now, not after an edit during the conversion
+        manifest_snapshot(asf_filename, &asf_input);
+        if (!batch) manifest_snapshot(amc_filename, &amc_input);
+    }
+
+    // do the work
+    FILE *asf;
+    if (!(asf=open_input(asf_filename))) {
         err_str = asf_filename;
         goto fopen_error;
-    } else if (!(amc=fopen(amc_filename, "r"))) {
-        err_str = amc_filename;
-        fclose(asf);
-        goto fopen_error;
-    } else if (!(bvh=fopen(output_filename, "w"))) {
-        err_str = output_filename;
-        fclose(asf);
+    }
+    TRACE_BEGIN(asf_span);
+    PERF_BEGIN(asf_sample);
+    struct amc_skeleton *skeleton = parse_asf_skeleton(asf, verbose);
+    PERF_END(asf_sample, PERF_ASF_PARSE, 0, perf_file_bytes(asf));
+    TRACE_END(asf_span, "parse_asf_skeleton", -1, -1);
+    fclose(asf);
+    amc_skeleton_apply_options(skeleton, &options, verbose);
+    if (verbose) printf("Successfully parsed ASF skeleton from %s\n", asf_filename);
+
+    if (batch) {
+        struct batch_options batch_options = {
+            .asf_filename = asf_filename,
+            .output_directory = output_filename,
+            .io_depth = io_depth,
+            .manifest = manifest,
+            .stamp = stamp,
+            .asf_input = &asf_input,
+            .jobs = jobs
+        };
+        status = convert_amc_batch(skeleton, inputs, input_count, &batch_options, fps, &options, verbose);
+    } else if (follow) {
+        FILE *amc, *out;
+        if (!(amc=fopen(amc_filename, "r"))) {
+            err_str = amc_filename;
+            amc_skeleton_free(skeleton);
+            goto fopen_error;
+        } else if (!(out=fopen(output_filename, "w"))) {
+            err_str = output_filename;
+            fclose(amc);
+            amc_skeleton_free(skeleton);
+            goto fopen_error;
+        }
+        follow_amc_motion(amc, out, skeleton, fps, &options, follow_timeout, verbose);
         fclose(amc);
+        fclose(out);
+    } else if (convert_amc_file(skeleton, amc_filename, output_filename, format, fps, &options, verbose, &err_str)) {
+        amc_skeleton_free(skeleton);
+        if (manifest) manifest_free(manifest);
         goto fopen_error;
     }
 
-    // do the work
-    struct amc_skeleton *skeleton = parse_asf_skeleton(asf, max_children, verbose);
-    if (verbose) printf("Successfully parsed ASF skeleton from %s\n", asf_filename);
-    struct amc_motion *motion = parse_amc_motion(amc, skeleton, verbose);
-    if (verbose) printf("Successfully parsed AMC motion from %s\n", amc_filename);
-    write_bvh_skeleton(bvh, skeleton);
-    write_bvh_motion(bvh, motion, skeleton, fps);
-    if (verbose) printf("Successfully wrote BVH motion to %s\n", output_filename);
+    if (manifest) {
+        if (!batch) manifest_record(manifest, output_filename, stamp, &asf_input, &amc_input);
+        if (manifest_save(manifest, manifest_filename)) {
+            fprintf(stderr, "%s: unable to update '%s': %s\n", argv[0], manifest_filename, strerror(errno));
+        }
+        manifest_free(manifest);
+    }
+
+    if (perf_enabled) {
+        perf_report(stdout);
+        perf_close();
+    }
 
     // clean up
-    fclose(asf);
-    fclose(amc);
-    fclose(bvh);
     amc_skeleton_free(skeleton);
-    amc_motion_free(motion);
+    if (trace_close()) fprintf(stderr, "%s: unable to write '%s': %s\n", argv[0], trace_filename, strerror(errno));
 
-    return 0;
+    return status;
 
 val_required:
     fprintf(stderr, "%s: missing value after '%s'\n", argv[0], err_str);
@@ -131,6 +579,14 @@ opt_unknown:
     fprintf(stderr, "%s: unknown option '%s'\n", argv[0], err_str);
     return 1;
 
+opt_unsupported:
+    fprintf(stderr, "%s: '%s' is only supported with BVH output\n", argv[0], err_str);
+    return 1;
+
+opt_incompatible:
+    fprintf(stderr, "%s: '%s' cannot be used with '%s'\n", argv[0], err_str, err_other);
+    return 1;
+
 opt_required:
     fprintf(stderr, "%s: %s required\n", argv[0], err_str);
     return 1;
@@ -144,23 +600,135 @@ print_usage:
     fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
     return 1;
 }
+#endif
 
-enum parsing_mode {
-    MODE_NONE,  // default
-    MODE_UNIT,  // parse unit declarations in ASF files
-    MODE_DOC,   // parse documentation section in ASF files
-    MODE_ROOT,  // parse the root bone section in ASF files
-    MODE_BONES, // parse bone date in ASF files
-    MODE_BONE,  // parse a single bone's data in ASF files
-    MODE_TREE,  // parse the bone hierarchy information in ASF files
-    MODE_MOTION // parse a frame in AMC files
-};
+enum output_format output_format_from_filename(char *filename) {
+    if (ends_with(filename, ".npy") || ends_with(filename, ".NPY")) return OUTPUT_NPY;
+    if (ends_with(filename, ".glb") || ends_with(filename, ".GLB")) return OUTPUT_GLB;
+    return OUTPUT_BVH;
+}
+
+int convert_amc_file(struct amc_skeleton *skeleton,
+                     char *amc_filename,
+                     char *output_filename,
+                     enum output_format format,
+                     float fps,
+                     struct output_options *options,
+                     bool verbose,
+                     char **err_filename) {
+    // Converts a single AMC file using an already-parsed skeleton. Returns
+    // nonzero if a file can't be opened, with `err_filename` set and errno
+    // describing why.
+    FILE *amc;
+    if (!(amc=open_input(amc_filename))) {
+        *err_filename = amc_filename;
+        return 1;
+    }
+    PERF_BEGIN(amc_sample);
+    struct amc_motion *motion = parse_amc_motion(amc, skeleton, options->storage, verbose);
+    PERF_END(amc_sample, PERF_AMC_PARSE, motion->sample_count, perf_file_bytes(amc));
+    fclose(amc);
+    if (verbose) printf("Successfully parsed AMC motion from %s\n", amc_filename);
+
+    int status = write_motion_file(skeleton, motion, output_filename, format, fps, options, verbose, err_filename);
+    amc_motion_free(motion);
+    return status;
+}
+
+int write_motion_file(struct amc_skeleton *skeleton,
+                      struct amc_motion *motion,
+                      char *output_filename,
+                      enum output_format format,
+                      float fps,
+                      struct output_options *options,
+                      bool verbose,
+                      char **err_filename) {
+    // Writes parsed motion in the given format, along with any sidecars.
+    // Returns nonzero if a file can't be opened, as convert_amc_file() does.
+    char *sidecar_filename = NULL;
+    if (format == OUTPUT_NPY) {
+        size_t base_len = strlen(output_filename)-4;
+        sidecar_filename = xmalloc(base_len+6);
+        memcpy(sidecar_filename, output_filename, base_len);
+        strcpy(sidecar_filename+base_len, ".json");
+    }
+    char *stats_json_filename = options->stats ? stats_filename(output_filename) : NULL;
+
+    FILE *out, *sidecar = NULL, *stats_json = NULL;
+    int err;
+    if (!(out=fopen(output_filename, format == OUTPUT_BVH ? "w" : "wb"))) {
+        err = errno;
+        *err_filename = output_filename;
+        free(sidecar_filename);
+        free(stats_json_filename);
+        errno = err;
+        return 1;
+    } else if ((sidecar_filename && !(sidecar=fopen(sidecar_filename, "w"))) ||
+               (stats_json_filename && !(stats_json=fopen(stats_json_filename, "w")))) {
+        // the name is needed after this returns, so copy it somewhere that lasts
+        static _Thread_local char failed_sidecar[BUFFSIZE];
+        err = errno;
+        snprintf(failed_sidecar, sizeof(failed_sidecar), "%s", sidecar_filename && !sidecar ? sidecar_filename : stats_json_filename);
+        *err_filename = failed_sidecar;
+        fclose(out);
+        if (sidecar) fclose(sidecar);
+        free(sidecar_filename);
+        free(stats_json_filename);
+        errno = err;
+        return 1;
+    }
 
-struct amc_skeleton *parse_asf_skeleton(FILE *asf, unsigned char max_child_count, bool verbose) {
-    struct amc_skeleton *skeleton = amc_skeleton_new(max_child_count);
-    struct amc_joint *current_joint = NULL;
+    if (motion->storage != STORAGE_FLOAT32) {
+        printf("Stored motion as %s, max error %.4g degrees of rotation, %.4g units of translation\n",
+               sample_storage_name(motion->storage), motion->max_rotation_error*180/M_PI, motion->max_translation_error*skeleton->unit_scale);
+    }
+    struct motion_stats *stats = NULL;
+    if (stats_json) {
+        unsigned channels = options->raw ? amc_channel_count(skeleton) : bvh_channel_count(skeleton, options);
+        stats = motion_stats_new(channels, skeleton->joint_count);
+    }
+    if (format == OUTPUT_NPY) {
+        write_npy_motion(out, motion, skeleton, options, stats);
+        write_npy_columns(sidecar, motion, skeleton, fps, options);
+        if (verbose) printf("Successfully wrote NumPy motion to %s (columns in %s)\n", output_filename, sidecar_filename);
+    } else if (format == OUTPUT_GLB) {
+        write_glb(out, motion, skeleton, fps);
+        if (verbose) printf("Successfully wrote glTF animation to %s\n", output_filename);
+    } else {
+        PERF_BEGIN(header_sample);
+        write_bvh_skeleton(out, skeleton, options);
+        PERF_END(header_sample, PERF_WRITE, 0, 0);
+        write_bvh_motion(out, motion, skeleton, fps, options, stats);
+        if (verbose) printf("Successfully wrote BVH motion to %s\n", output_filename);
+    }
+    if (stats) {
+        write_motion_stats(stats_json, stats, skeleton, fps, options);
+        if (verbose) printf("Successfully wrote channel statistics to %s\n", stats_json_filename);
+        motion_stats_free(stats);
+    }
+
+    // what's still buffered is written out on closing
+    PERF_BEGIN(flush_sample);
+    uint64_t written = perf_enabled ? perf_file_bytes(out) : 0;
+    fclose(out);
+    PERF_END(flush_sample, PERF_WRITE, 0, written);
+    if (sidecar) fclose(sidecar);
+    if (stats_json) fclose(stats_json);
+    free(sidecar_filename);
+    free(stats_json_filename);
+    return 0;
+}
+
+struct amc_skeleton *parse_asf_skeleton(FILE *asf, bool verbose) {
+    struct amc_skeleton *skeleton = amc_skeleton_new();
+    unsigned current_joint = AMC_NO_JOINT;
     bool unit_degrees = true;
 
+    // parent-child pairs from the hierarchy section, in order of appearance
+    unsigned *edges = NULL,
+             edge_count = 0,
+             edge_capacity = 0;
+
     // parsing data
     char *buffer = xmalloc(BUFFSIZE);
     int line_num = 0, modes_encountered = 0;
@@ -192,7 +760,7 @@ struct amc_skeleton *parse_asf_skeleton(FILE *asf, unsigned char max_child_count
                 // of subsections, one for every bone in the rig, so the real work is done in the
                 // MODE_BONE mode.
                 if (streq(trimmed, "begin")) {
-                    current_joint = amc_joint_new(max_child_count);
+                    current_joint = amc_skeleton_add_joint(skeleton, NULL);
                     mode = MODE_BONE;
                 }
                 else FAIL("Unexpected token %s on line %i\n", trimmed, line_num);
@@ -202,26 +770,30 @@ struct amc_skeleton *parse_asf_skeleton(FILE *asf, unsigned char max_child_count
                 char *prop = trimmed,
                      *val = bifurcate(prop, ' ');
 
-                assert(current_joint); // shouldn't happen, but this prevents warnings
+                assert(current_joint != AMC_NO_JOINT); // shouldn't happen, but this prevents warnings
                 if (streq(prop, "name")) {
-                    current_joint->name = xmalloc(strlen(val)+1);
-                    strcpy(current_joint->name, val);
+                    free(skeleton->names[current_joint]);
+                    skeleton->names[current_joint] = xmalloc(strlen(val)+1);
+                    strcpy(skeleton->names[current_joint], val);
                 } else if (streq(prop, "direction")) {
-                    current_joint->direction = parse_vec3(val, line_num);
+                    skeleton->directions[current_joint] = parse_vec3(val, line_num);
                 } else if (streq(prop, "length")) {
-                    sscanf(val, "%f", &current_joint->length);
+                    sscanf(val, "%f", &skeleton->lengths[current_joint]);
                 } else if (streq(prop, "axis")) {
-                    current_joint->rotation = parse_joint_rotation(val, unit_degrees, current_joint, line_num);
+                    skeleton->rotations[current_joint] = parse_joint_rotation(val, unit_degrees, line_num);
                 } else if (streq(prop, "dof")) {
-                    parse_channel_order(current_joint->channels, val, verbose, line_num);
+                    parse_channel_order(skeleton->channels[current_joint], val, verbose, line_num);
                 } else if (streq(prop, "end")) {
+                    char *name = skeleton->names[current_joint];
                     mode = MODE_BONES;
-                    if (current_joint->name) {
-                        jointmap_set(skeleton->map, current_joint);
-                        if (verbose) printf("Initialized bone `%s'\n", current_joint->name);
-                        current_joint = NULL;
-                    } else {
+                    if (!name) {
                         FAIL("Bone ending on line %i is missing a name\n", line_num);
+                    } else if (jointmap_get(skeleton->map, name)) {
+                        FAIL("Bone `%s' ending on line %i is defined more than once\n", name, line_num);
+                    } else {
+                        jointmap_set(skeleton->map, name, current_joint);
+                        if (verbose) printf("Initialized bone `%s'\n", name);
+                        current_joint = AMC_NO_JOINT;
                     }
                 } else if (streq(prop, "id") || streq(prop, "axis") || streq(prop, "limits") || starts_with(prop, "(")) {
                     continue; // ignore id, axis, constraint, and constraint details
@@ -238,21 +810,24 @@ struct amc_skeleton *parse_asf_skeleton(FILE *asf, unsigned char max_child_count
                 } else {
                     char *parent_name = trimmed,
                          *children = bifurcate(parent_name, ' ');
-                    struct amc_joint *parent = jointmap_get(skeleton->map, parent_name);
+                    struct jointmap_entry *parent = jointmap_get(skeleton->map, parent_name);
                     if (!parent) FAIL("Unrecognized bone `%s' referenced on line %i\n", parent_name, line_num);
 
                     while (children) {
                         char *child_name = children;
                         children = bifurcate(children, ' ');
+                        if (strlen(child_name) == 0) continue; // repeated separator
 
-                        struct amc_joint *child = jointmap_get(skeleton->map, child_name);
+                        struct jointmap_entry *child = jointmap_get(skeleton->map, child_name);
                         if (!child) FAIL("Unrecognized bone `%s' referenced on line %i\n", child_name, line_num);
 
-                        parent->children[parent->child_count++] = child;
-
-                        if (parent->child_count > max_child_count) {
-                            FAIL("Bone `%s' has %i children, max permitted is %i\n", parent_name, parent->child_count, max_child_count);
+                        if (edge_count == edge_capacity) {
+                            edge_capacity = edge_capacity ? 2*edge_capacity : 32;
+                            edges = xrealloc(edges, 2*sizeof(*edges)*edge_capacity);
                         }
+                        edges[2*edge_count] = parent->index;
+                        edges[2*edge_count+1] = child->index;
+                        edge_count++;
                     }
                 }
             } else if (mode == MODE_ROOT) {
@@ -262,7 +837,7 @@ struct amc_skeleton *parse_asf_skeleton(FILE *asf, unsigned char max_child_count
                      *val = bifurcate(prop, ' ');
 
                 if (streq(prop, "order")) {
-                    parse_channel_order(skeleton->root->channels, val, verbose, line_num);
+                    parse_channel_order(skeleton->channels[0], val, verbose, line_num); // the root is always joint 0
                 } else if (streq(prop, "position")) {
                     skeleton->root_position = parse_vec3(val, line_num);
                 }
@@ -282,191 +857,494 @@ struct amc_skeleton *parse_asf_skeleton(FILE *asf, unsigned char max_child_count
         }
     }
 
+    if (ferror(asf)) FAIL("Unable to read ASF data: %s\n", strerror(errno));
     if (!(modes_encountered & (1 << MODE_ROOT))) FAIL("Missing root bone data\n");
     if (!(modes_encountered & (1 << MODE_BONES))) FAIL("Missing bone data\n");
     if (!(modes_encountered & (1 << MODE_TREE))) FAIL("Missing bone hierarchy data\n");
+    amc_skeleton_build_tree(skeleton, edges, edge_count, verbose);
     if (verbose) printf("Finished constructing skeleton\n");
 
+    free(edges);
     free(buffer);
 
     return skeleton;
 }
 
-struct amc_motion *parse_amc_motion(FILE *amc, struct amc_skeleton *skeleton, bool verbose) {
-    unsigned total_channels = compute_amc_joint_indices(skeleton->root, 0);
-    if (verbose) printf("Computed joint motion indices\n");
+static void trace_amc_parsing(double *chunk_start, struct amc_parser *parser, bool finished) {
+    // records a span for every CONVERT_CHUNK_FRAMES frames parsed, numbered
+    // from the parser's first frame in the file
+    if (!trace_enabled) return;
+    unsigned sample_count = parser->motion->sample_count;
+    long first = parser->first_frame;
+    if (finished) {
+        if (sample_count > 0) {
+            trace_event("parse_amc", *chunk_start, first + (sample_count-1)/CONVERT_CHUNK_FRAMES*CONVERT_CHUNK_FRAMES, first + sample_count-1);
+        }
+    } else if (sample_count > 1 && (sample_count-1) % CONVERT_CHUNK_FRAMES == 0) {
+        trace_event("parse_amc", *chunk_start, first + sample_count-1-CONVERT_CHUNK_FRAMES, first + sample_count-2);
+        *chunk_start = trace_now();
+    }
+}
 
-    struct amc_motion *motion = amc_motion_new(total_channels);
-    struct amc_sample *current_sample = NULL;
-    bool unit_degrees = true,
-         is_fully_specified = false;
-
-    // parsing data
-    char *buffer = xmalloc(BUFFSIZE);
-    int line_num = 0;
-    enum parsing_mode mode = MODE_NONE;
+struct amc_motion *parse_amc_motion(FILE *amc, struct amc_skeleton *skeleton, enum sample_storage storage, bool verbose) {
+    struct amc_parser parser;
+    amc_parser_init(&parser, skeleton, storage, verbose);
 
+    TRACE_BEGIN(chunk);
+    char *buffer = xcalloc(BUFFSIZE+AMC_TOKEN_PADDING, 1);
     while (readline(buffer, BUFFSIZE, amc)) {
-        char *trimmed = trim(buffer);
-        line_num++;
-
-        if (starts_with(trimmed, "#")) continue; // comment
-        else if (strlen(trimmed) == 0) continue; // blank line
-
-        if (mode == MODE_NONE) {
-            if (starts_with(trimmed, ":")) { // various flags
-                if (streq(trimmed, ":RADIANS")) {
-                    unit_degrees = false;
-                    if (verbose) printf("AMC uses radians\n");
-                } else if (streq(trimmed, ":DEGREES")) {
-                    unit_degrees = true;
-                    if (verbose) printf("AMC uses degrees\n");
-                } else if (streq(trimmed, ":FULLY-SPECIFIED")) {
-                    is_fully_specified = true;
-                } else if (verbose) {
-                    printf("Warning: unrecognized AMC flag `%s'\n", trimmed);
-                }
-            } else if (isdigit(trimmed[0])) {
-                // switch to parsing a frame (aka sample)
-                mode = MODE_MOTION;
-                motion->sample_count++;
-                motion->samples = amc_sample_new(total_channels);
-                current_sample = motion->samples;
-                if (verbose) printf("Starting to parse frames\n");
-            } else {
-                bifurcate(trimmed, ' ');
-                FAIL("Unexpected token `%s' on line %i\n", trimmed, line_num);
-            }
-        } else if (mode == MODE_MOTION) {
-            if (isdigit(trimmed[0])) {
-                // get ready to parse a new frame
-                motion->sample_count++;
-                current_sample->next = amc_sample_new(total_channels);
-                current_sample = current_sample->next;
-            } else {
-                // parse a frame of animation for a single bone
-                char *joint_name = trimmed,
-                     *channel_data = bifurcate(trimmed, ' ');
-                struct amc_joint *joint = jointmap_get(skeleton->map, joint_name);
-                if (!joint) FAIL("Unrecognized bone `%s' referenced on line %i\n", joint_name, line_num);
-                parse_amc_joint_animation_channels(joint, current_sample, unit_degrees, channel_data, line_num);
-            }
-        }
+        if (amc_parse_line(&parser, buffer)) trace_amc_parsing(&chunk, &parser, false);
     }
+    trace_amc_parsing(&chunk, &parser, true);
+    // e.g. a damaged archive
+    if (ferror(amc)) FAIL("Unable to read AMC data: %s\n", strerror(errno));
 
     if (verbose) {
-        printf("Parsed %i frames\n", motion->sample_count);
-        if (!is_fully_specified) printf("Warning: this file may not be fully-specified (alternative formats may be unsupported)\n");
+        printf("Parsed %i frames\n", parser.motion->sample_count);
+        if (!parser.is_fully_specified) printf("Warning: this file may not be fully-specified (alternative formats may be unsupported)\n");
     }
     free(buffer);
 
-    return motion;
+    return parser.motion;
+}
+
+struct amc_motion *parse_amc_buffer(char *data, size_t len, struct amc_skeleton *skeleton, enum sample_storage storage, bool verbose) {
+    // Parses AMC data that has already been read into memory, which must be
+    // NUL-terminated and padded with AMC_TOKEN_PADDING more bytes. The data is
+    // modified.
+    struct amc_parser parser;
+    amc_parser_init(&parser, skeleton, storage, verbose);
+    amc_parse_lines(&parser, data, len);
+
+    if (verbose) {
+        printf("Parsed %i frames\n", parser.motion->sample_count);
+        if (!parser.is_fully_specified) printf("Warning: this file may not be fully-specified (alternative formats may be unsupported)\n");
+    }
+
+    return parser.motion;
 }
 
-void write_bvh_skeleton(FILE *bvh, struct amc_skeleton *skeleton) {
+void amc_parse_lines(struct amc_parser *parser, char *data, size_t len) {
+    // parses each line of the NUL-terminated data, which is modified (and
+    // padded, see AMC_TOKEN_PADDING)
+    TRACE_BEGIN(chunk);
+    char *line = data, *end = data+len;
+    while (line < end) {
+        char *next = memchr(line, '\n', end-line);
+        if (next) *next++ = '\0';
+        else next = end;
+        if (amc_parse_line(parser, line)) trace_amc_parsing(&chunk, parser, false);
+        line = next;
+    }
+    trace_amc_parsing(&chunk, parser, true);
+}
+
+void amc_parser_init(struct amc_parser *parser, struct amc_skeleton *skeleton, enum sample_storage storage, bool verbose) {
+    // the skeleton is only read here, so it can be shared between threads
+    parser->skeleton = skeleton;
+    parser->motion = amc_motion_new(skeleton->total_channels, storage);
+    parser->current_sample = NULL;
+    parser->mode = MODE_NONE;
+    parser->unit_degrees = true;
+    parser->is_fully_specified = false;
+    parser->verbose = verbose;
+    parser->line_num = 0;
+    parser->first_frame = 0;
+    parser->last_joint = AMC_NO_JOINT;
+    const char *tokenizer;
+    parser->tokenize = amc_select_tokenizer(&tokenizer);
+    if (verbose) printf("Splitting frame lines with the %s tokenizer\n", tokenizer);
+}
+
+bool amc_parse_line(struct amc_parser *parser, char *line) {
+    // Parses a single line of an AMC file, returning true if it begins a new
+    // frame. The line may be modified.
+    struct amc_skeleton *skeleton = parser->skeleton;
+    struct amc_motion *motion = parser->motion;
+    parser->line_num++;
+    parser->last_joint = AMC_NO_JOINT;
+
+    if (parser->mode == MODE_NONE) {
+        char *trimmed = trim(line);
+        if (starts_with(trimmed, "#")) return false; // comment
+        else if (strlen(trimmed) == 0) return false; // blank line
+
+        if (starts_with(trimmed, ":")) { // various flags
+            if (streq(trimmed, ":RADIANS")) {
+                parser->unit_degrees = false;
+                if (parser->verbose) printf("AMC uses radians\n");
+            } else if (streq(trimmed, ":DEGREES")) {
+                parser->unit_degrees = true;
+                if (parser->verbose) printf("AMC uses degrees\n");
+            } else if (streq(trimmed, ":FULLY-SPECIFIED")) {
+                parser->is_fully_specified = true;
+            } else if (parser->verbose) {
+                printf("Warning: unrecognized AMC flag `%s'\n", trimmed);
+            }
+        } else if (isdigit(trimmed[0])) {
+            // switch to parsing a frame (aka sample)
+            parser->mode = MODE_MOTION;
+            motion->sample_count++;
+            motion->samples = amc_sample_new(motion->total_channels, motion->storage);
+            parser->current_sample = motion->samples;
+            if (parser->verbose) printf("Starting to parse frames\n");
+            return true;
+        } else {
+            bifurcate(trimmed, ' ');
+            FAIL("Unexpected token `%s' on line %i\n", trimmed, parser->line_num);
+        }
+    } else if (parser->mode == MODE_MOTION) {
+        // nearly every line is a frame line, so they're split in one pass, see tokenize.c
+        struct amc_tokens tokens;
+        if (parser->tokenize(line, &tokens) == 0) return false; // blank line
+        else if (tokens.words[0][0] == '#') return false; // comment
+
+        if (isdigit(tokens.words[0][0])) {
+            // get ready to parse a new frame
+            struct amc_sample *sample = amc_sample_new(motion->total_channels, motion->storage);
+            motion->sample_count++;
+            if (motion->samples) parser->current_sample->next = sample;
+            else motion->samples = sample; // the caller may have consumed earlier frames
+            parser->current_sample = sample;
+            return true;
+        } else {
+            // parse a frame of animation for a single bone
+            char *joint_name = tokens.words[0];
+            struct jointmap_entry *joint = jointmap_get(skeleton->map, joint_name);
+            if (!joint) FAIL("Unrecognized bone `%s' referenced on line %i\n", joint_name, parser->line_num);
+            if (joint->index == AMC_NO_JOINT) return false; // not part of the hierarchy
+            parse_amc_joint_animation_channels(skeleton, motion, joint->index, parser->current_sample, parser->unit_degrees, &tokens, parser->line_num);
+            parser->last_joint = joint->index;
+        }
+    }
+
+    return false;
+}
+
+void write_bvh_skeleton(FILE *bvh, struct amc_skeleton *skeleton, struct output_options *options) {
     fprintf(bvh, "HIERARCHY\n");
-    write_bvh_joint(bvh, skeleton, skeleton->root, skeleton->root_position, 0);
+
+    // Joints are stored in depth-first order, so the hierarchy can be written
+    // in a single pass by closing the braces of every joint that isn't an
+    // ancestor of the next one.
+    int *depths = xmalloc(sizeof(*depths)*skeleton->joint_count),
+        open_depth = 0;
+    for (unsigned i = 0; i < skeleton->joint_count; i++) {
+        unsigned parent = skeleton->parents[i];
+        depths[i] = parent == AMC_NO_JOINT ? 0 : depths[parent]+1;
+
+        while (open_depth > depths[i]) {
+            open_depth--;
+            fprintf_indent(open_depth, bvh, "}\n");
+        }
+        write_bvh_joint(bvh, skeleton, i, amc_joint_offset(skeleton, i), depths[i], options);
+        open_depth = depths[i]+1;
+    }
+    while (open_depth > 0) {
+        open_depth--;
+        fprintf_indent(open_depth, bvh, "}\n");
+    }
+
+    free(depths);
 }
 
 void write_bvh_joint(FILE *bvh,
                      struct amc_skeleton *skeleton,
-                     struct amc_joint *joint,
+                     unsigned joint,
                      struct vec3 offset,
-                     int depth) {
-    fprintf_indent(depth, bvh, "%s %s\n", depth ? "JOINT" : "ROOT", joint->name);
+                     int depth,
+                     struct output_options *options) {
+    // writes everything except the closing brace, which follows the children
+    fprintf_indent(depth, bvh, "%s %s\n", depth ? "JOINT" : "ROOT", skeleton->names[joint]);
     fprintf_indent(depth, bvh, "{\n");
     fprintf_indent(depth+1, bvh, "OFFSET\t%f\t%f\t%f\n", offset.x, offset.y, offset.z);
 
-    // It doesn't seem to be an official part of the BVH spec, but the Blender
-    // BVH parser expects translation and rotation channels to be either all or
-    // none present, and rotations to be always present.
-    bool has_translations = amc_joint_has_translation(joint);
-    fprintf_indent(depth+1, bvh, "CHANNELS %i", has_translations ? 6 : 3);
-    if (has_translations) fprintf(bvh, " Xposition Yposition Zposition");
-
-    // although the rotations are to be applied in XYZ order, they are written
-    // in the reverse order.
-    fprintf(bvh, " Zrotation Yrotation Xrotation\n");
+    const char *channels[7];
+    unsigned channel_count = bvh_joint_channels(channels, skeleton, joint, options);
+    fprintf_indent(depth+1, bvh, "CHANNELS %u", channel_count);
+    for (unsigned i = 0; i < channel_count; i++) fprintf(bvh, " %s", channels[i]);
+    fprintf(bvh, "\n");
 
-    struct vec3 child_offset = vec3_scale(vec3_normalize(joint->direction), joint->length);
-    if (joint->child_count > 0) {
-        for (unsigned i = 0; i < joint->child_count; i++) {
-            write_bvh_joint(bvh, skeleton, joint->children[i], child_offset, depth+1);
-        }
-    } else {
+    if (skeleton->child_counts[joint] == 0) {
+        struct vec3 end_offset = amc_joint_end_offset(skeleton, joint);
         fprintf_indent(depth+1, bvh, "End Site\n");
         fprintf_indent(depth+1, bvh, "{\n");
-        fprintf_indent(depth+2, bvh, "OFFSET\t%f\t%f\t%f\n", child_offset.x, child_offset.y, child_offset.z);
+        fprintf_indent(depth+2, bvh, "OFFSET\t%f\t%f\t%f\n", end_offset.x, end_offset.y, end_offset.z);
         fprintf_indent(depth+1, bvh, "}\n");
     }
-
-    fprintf_indent(depth, bvh, "}\n");
 }
 
-void write_bvh_motion(FILE *bvh, struct amc_motion *motion, struct amc_skeleton *skeleton, float fps) {
+void write_bvh_motion(FILE *bvh, struct amc_motion *motion, struct amc_skeleton *skeleton, float fps, struct output_options *options, struct motion_stats *stats) {
     fprintf(bvh, "MOTION\n");
     fprintf(bvh, "Frames:\t%u\n", motion->sample_count);
     fprintf(bvh, "Frame Time:\t%f\n", 1/fps);
+
+    // convert a chunk of frames at a time, then write them out
+    unsigned channels = bvh_channel_count(skeleton, options),
+             first = 0;
+    float *rows = xmalloc(sizeof(*rows)*CONVERT_CHUNK_FRAMES*(channels ? channels : 1));
+    struct quat *rotations = stats ? xmalloc(sizeof(*rotations)*CONVERT_CHUNK_FRAMES*(skeleton->joint_count ? skeleton->joint_count : 1)) : NULL;
     struct amc_sample *sample = motion->samples;
     while (sample) {
-        write_bvh_joint_sample(bvh, skeleton->root, sample);
-        fprintf(bvh, "\n");
-        sample = sample->next;
-    }
-}
-
-void write_bvh_joint_sample(FILE *bvh, struct amc_joint *joint, struct amc_sample *sample) {
-    if (amc_joint_has_translation(joint)) {
-        // read the translation data
-        float tx = 0, ty = 0, tz = 0;
-        for (int i = 0; i < CHANNEL_COUNT; i++) {
-            enum channel channel = joint->channels[i];
-            float val = sample->data[joint->motion_index+i];
-
-            if (channel == CHANNEL_TX) {
-                tx = val;
-            } else if (channel == CHANNEL_TY) {
-                ty = val;
-            } else if (channel == CHANNEL_TZ) {
-                tz = val;
+        TRACE_BEGIN(convert);
+        PERF_BEGIN(convert_sample);
+        unsigned frames = 0;
+        for (; sample && frames < CONVERT_CHUNK_FRAMES; sample = sample->next, frames++) {
+            float *row = rows + frames*channels;
+            struct quat *rotation = rotations ? rotations + frames*skeleton->joint_count : NULL;
+            for (unsigned j = 0; j < skeleton->joint_count; j++) {
+                row += compute_bvh_joint_sample(row, skeleton, j, sample, options, rotation ? rotation+j : NULL);
             }
         }
+        if (stats) motion_stats_add(stats, rows, rotations, frames);
+        PERF_END(convert_sample, PERF_CONVERT, frames, 0);
+        TRACE_END(convert, "convert_bvh", first, first+frames-1);
+
+        TRACE_BEGIN(write);
+        PERF_BEGIN(write_sample);
+        for (unsigned f = 0; f < frames; f++) {
+            float *row = rows + f*channels;
+            for (unsigned c = 0; c < channels; c++) fprintf(bvh, "\t%f", row[c]);
+            fprintf(bvh, "\n");
+        }
+        PERF_END(write_sample, PERF_WRITE, frames, 0);
+        TRACE_END(write, "write_bvh", first, first+frames-1);
+        first += frames;
+    }
+    free(rows);
+    free(rotations);
+}
 
-        fprintf(bvh, "\t%f\t%f\t%f", tx, ty, tz);
+void write_bvh_sample(FILE *bvh, struct amc_skeleton *skeleton, struct amc_sample *sample, struct output_options *options) {
+    // BVH channels are in depth-first order, the same as the joints
+    for (unsigned i = 0; i < skeleton->joint_count; i++) {
+        write_bvh_joint_sample(bvh, skeleton, i, sample, options);
     }
+}
 
-    // read the rotation data
-    struct euler_triple sample_rotation;
-    for (int i = 0, j = 0; i < CHANNEL_COUNT; i++) {
-        enum channel channel = joint->channels[i];
+void write_bvh_joint_sample(FILE *bvh, struct amc_skeleton *skeleton, unsigned joint, struct amc_sample *sample, struct output_options *options) {
+    float values[7];
+    unsigned count = compute_bvh_joint_sample(values, skeleton, joint, sample, options, NULL);
+    for (unsigned i = 0; i < count; i++) {
+        fprintf(bvh, "\t%f", values[i]);
+    }
+}
 
-        if (IS_ROTATION_CHANNEL(channel)) {
-            sample_rotation.angles[j] = sample->data[joint->motion_index+i];
-            sample_rotation.order[j++] = channel;
-        }
+unsigned compute_bvh_joint_sample(float *out, struct amc_skeleton *skeleton, unsigned joint, struct amc_sample *sample, struct output_options *options, struct quat *rotation_out) {
+    // Fills in the joint's BVH channels, in the order given by
+    // bvh_joint_channels, and its rotation if `rotation_out` isn't NULL.
+    unsigned count = 0;
+    if (amc_joint_has_translation(skeleton, joint)) {
+        struct vec3 translation = compute_joint_translation(skeleton, joint, sample);
+        out[count++] = translation.x;
+        out[count++] = translation.y;
+        out[count++] = translation.z;
     }
 
-    // apply the joint space to the animation rotation
-    struct quat local = joint->rotation,
-                local_inv = quat_inv(joint->rotation),
-                motion = euler_to_quat(sample_rotation);
-    struct euler_triple combined_rotation = quat_to_euler_xyz(quat_mul(local, quat_mul(motion, local_inv)));
+    struct quat rotation = compute_joint_rotation(skeleton, joint, sample);
+    if (rotation_out) *rotation_out = rotation;
+    if (options->quaternions) {
+        // q and -q are the same rotation, pick the one with a positive W
+        float sign = rotation.w < 0 ? -1 : 1;
+        out[count++] = sign*rotation.w;
+        out[count++] = sign*rotation.x;
+        out[count++] = sign*rotation.y;
+        out[count++] = sign*rotation.z;
+        return count;
+    }
 
+    struct euler_triple combined_rotation = quat_to_euler_xyz(rotation);
     float rad2deg = 180/M_PI;
-    fprintf(bvh, "\t%f\t%f\t%f", combined_rotation.angles[2]*rad2deg,
-                                 combined_rotation.angles[1]*rad2deg,
-                                 combined_rotation.angles[0]*rad2deg);
+    out[count++] = combined_rotation.angles[2]*rad2deg;
+    out[count++] = combined_rotation.angles[1]*rad2deg;
+    out[count++] = combined_rotation.angles[0]*rad2deg;
+    return count;
+}
+
+struct vec3 compute_joint_translation(struct amc_skeleton *skeleton, unsigned joint, struct amc_sample *sample) {
+    enum channel *channels = skeleton->channels[joint];
+    float data[CHANNEL_COUNT];
+    amc_sample_get_channels(data, skeleton, joint, sample);
+    struct vec3 translation = { .x=0, .y=0, .z=0 };
+
+    for (int i = 0; i < CHANNEL_COUNT; i++) {
+        enum channel channel = channels[i];
+        float val = data[i];
+
+        if (channel == CHANNEL_TX) {
+            translation.x = val;
+        } else if (channel == CHANNEL_TY) {
+            translation.y = val;
+        } else if (channel == CHANNEL_TZ) {
+            translation.z = val;
+        }
+    }
+
+    if (skeleton->has_convention) {
+        translation = vec3_scale(quat_rotate(skeleton->basis, translation), skeleton->unit_scale);
+    }
+    return translation;
+}
+
+struct quat compute_joint_rotation(struct amc_skeleton *skeleton, unsigned joint, struct amc_sample *sample) {
+    float data[CHANNEL_COUNT];
+    amc_sample_get_channels(data, skeleton, joint, sample);
+    struct rotation_kernel *kernel = &skeleton->rotation_kernels[joint];
+
+    // apply the joint space to the animation rotation, which when retargeting
+    // also takes it from the source's rest pose to the target's
+    struct quat motion = kernel->convert(data, kernel);
+    if (skeleton->rest_rotations) {
+        return quat_mul(skeleton->rest_rotations[joint][0], quat_mul(motion, skeleton->rest_rotations[joint][1]));
+    }
+    struct quat local = skeleton->rotations[joint],
+                local_inv = quat_inv(skeleton->rotations[joint]);
+    return quat_mul(local, quat_mul(motion, local_inv));
+}
+
+unsigned bvh_joint_channels(const char **names, struct amc_skeleton *skeleton, unsigned joint, struct output_options *options) {
+    // It doesn't seem to be an official part of the BVH spec, but the Blender
+    // BVH parser expects translation and rotation channels to be either all or
+    // none present, and rotations to be always present.
+    static const char *translations[] = { "Xposition", "Yposition", "Zposition" },
+                      *quaternions[] = { "Wquaternion", "Xquaternion", "Yquaternion", "Zquaternion" },
+                      // although the rotations are to be applied in XYZ order, they are
+                      // written in the reverse order.
+                      *eulers[] = { "Zrotation", "Yrotation", "Xrotation" };
+    unsigned count = 0;
+    if (amc_joint_has_translation(skeleton, joint)) {
+        for (int i = 0; i < 3; i++) names[count++] = translations[i];
+    }
+    if (options->quaternions) {
+        for (int i = 0; i < 4; i++) names[count++] = quaternions[i];
+    } else {
+        for (int i = 0; i < 3; i++) names[count++] = eulers[i];
+    }
+    return count;
+}
+
+const char *rotation_units(struct output_options *options) {
+    // what the rotation columns of .npy output and statistics are in
+    if (options->raw) return "radians";
+    return options->quaternions ? "quaternion" : "degrees";
+}
+
+unsigned bvh_channel_count(struct amc_skeleton *skeleton, struct output_options *options) {
+    const char *names[7];
+    unsigned count = 0;
+    for (unsigned i = 0; i < skeleton->joint_count; i++) {
+        count += bvh_joint_channels(names, skeleton, i, options);
+    }
+    return count;
+}
 
-    for (unsigned i = 0; i < joint->child_count; i++) {
-        write_bvh_joint_sample(bvh, joint->children[i], sample);
+void write_npy_motion(FILE *npy, struct amc_motion *motion, struct amc_skeleton *skeleton, struct output_options *options, struct motion_stats *stats) {
+    // See https://numpy.org/doc/stable/reference/generated/numpy.lib.format.html.
+    // The data is a C-order float32 array of shape (frames, channels).
+    unsigned channels = options->raw ? amc_channel_count(skeleton) : bvh_channel_count(skeleton, options);
+    char header[128];
+    int header_len = snprintf(header, sizeof(header),
+                              "{'descr': '<f4', 'fortran_order': False, 'shape': (%u, %u), }",
+                              motion->sample_count, channels);
+
+    // pad with spaces so that the data starts on a 64-byte boundary
+    int padded_len = (10 + header_len + 1 + 63)/64*64 - 10;
+    fwrite("\x93NUMPY\x01\x00", 1, 8, npy);
+    fputc(padded_len & 0xff, npy);
+    fputc(padded_len >> 8, npy);
+    fwrite(header, 1, header_len, npy);
+    for (int i = header_len; i < padded_len-1; i++) fputc(' ', npy);
+    fputc('\n', npy);
+
+    // convert a chunk of rows at a time, then write them out
+    TRACE_BEGIN(span);
+    float *rows = xmalloc(sizeof(*rows)*CONVERT_CHUNK_FRAMES*(channels ? channels : 1));
+    struct quat *rotations = stats ? xmalloc(sizeof(*rotations)*CONVERT_CHUNK_FRAMES*(skeleton->joint_count ? skeleton->joint_count : 1)) : NULL;
+    struct amc_sample *sample = motion->samples;
+    while (sample) {
+        PERF_BEGIN(convert_sample);
+        unsigned frames = 0;
+        for (; sample && frames < CONVERT_CHUNK_FRAMES; sample = sample->next, frames++) {
+            compute_motion_row(rows + frames*channels, skeleton, sample, options, rotations ? rotations + frames*skeleton->joint_count : NULL);
+        }
+        if (stats) motion_stats_add(stats, rows, rotations, frames);
+        PERF_END(convert_sample, PERF_CONVERT, frames, 0);
+
+        PERF_BEGIN(write_sample);
+        fwrite_le_f32(npy, rows, (size_t) frames*channels);
+        PERF_END(write_sample, PERF_WRITE, frames, 0);
     }
+    TRACE_END(span, "write_npy", 0, (long) motion->sample_count-1);
+
+    free(rows);
+    free(rotations);
+}
+
+unsigned compute_motion_row(float *row, struct amc_skeleton *skeleton, struct amc_sample *sample, struct output_options *options, struct quat *rotations) {
+    // Fills in a row of .npy output (the BVH channels, or the AMC channels if
+    // `options->raw`), returning the number of values. Each joint's rotation
+    // is also stored in `rotations`, unless it's NULL.
+    unsigned count = 0;
+    for (unsigned j = 0; j < skeleton->joint_count; j++) {
+        if (options->raw) {
+            float data[CHANNEL_COUNT];
+            amc_sample_get_channels(data, skeleton, j, sample);
+            for (int c = 0; c < CHANNEL_COUNT && skeleton->channels[j][c] != CHANNEL_EMPTY; c++) {
+                row[count++] = data[c];
+            }
+            if (rotations) rotations[j] = compute_joint_rotation(skeleton, j, sample);
+        } else {
+            count += compute_bvh_joint_sample(row+count, skeleton, j, sample, options, rotations ? rotations+j : NULL);
+        }
+    }
+    return count;
+}
+
+unsigned motion_row_channels(const char **names, struct amc_skeleton *skeleton, unsigned joint, struct output_options *options) {
+    // names the joint's columns in a row from compute_motion_row()
+    if (!options->raw) return bvh_joint_channels(names, skeleton, joint, options);
+    unsigned count = 0;
+    while (count < CHANNEL_COUNT && skeleton->channels[joint][count] != CHANNEL_EMPTY) {
+        names[count] = amc_channel_name(skeleton->channels[joint][count]);
+        count++;
+    }
+    return count;
+}
+
+const char *amc_channel_name(enum channel channel) {
+    static const char *names[] = { "tx", "ty", "tz", "rx", "ry", "rz", "l" };
+    return names[channel];
+}
+
+void write_npy_columns(FILE *json, struct amc_motion *motion, struct amc_skeleton *skeleton, float fps, struct output_options *options) {
+    // a sidecar describing which joint and channel each column of the .npy holds
+    bool first = true;
+
+    fprintf(json, "{\n");
+    fprintf(json, "  \"frames\": %u,\n", motion->sample_count);
+    fprintf(json, "  \"frame_time\": %f,\n", 1/fps);
+    fprintf(json, "  \"channels\": %u,\n", options->raw ? amc_channel_count(skeleton) : bvh_channel_count(skeleton, options));
+    fprintf(json, "  \"units\": \"%s\",\n", rotation_units(options));
+    fprintf(json, "  \"columns\": [");
+    for (unsigned j = 0; j < skeleton->joint_count; j++) {
+        const char *names[CHANNEL_COUNT];
+        unsigned count = motion_row_channels(names, skeleton, j, options);
+
+        for (unsigned c = 0; c < count; c++) {
+            fprintf(json, "%s\n    { \"joint\": ", first ? "" : ",");
+            fprint_json_string(json, skeleton->names[j]);
+            fprintf(json, ", \"channel\": \"%s\" }", names[c]);
+            first = false;
+        }
+    }
+    fprintf(json, "\n  ]\n}\n");
 }
 
 /*
   HELPER METHODS
 */
 
-struct quat parse_joint_rotation(char *str, bool degrees, struct amc_joint *joint, int line_num) {
+struct quat parse_joint_rotation(char *str, bool degrees, int line_num) {
     struct euler_triple e;
     char order[4];
     if (sscanf(str, "%f %f %f %3s", e.angles, e.angles+1, e.angles+2, order) != 4) {
@@ -489,30 +1367,27 @@ struct quat parse_joint_rotation(char *str, bool degrees, struct amc_joint *join
     return euler_to_quat(e);
 }
 
-void parse_amc_joint_animation_channels(struct amc_joint *joint, struct amc_sample *sample, bool degrees, char *str, int line_num) {
-    for (int i = 0; i < CHANNEL_COUNT; i++) {
-        enum channel channel = joint->channels[i];
+void parse_amc_joint_animation_channels(struct amc_skeleton *skeleton, struct amc_motion *motion, unsigned joint, struct amc_sample *sample, bool degrees, struct amc_tokens *tokens, int line_num) {
+    // the channel values are the words after the bone's name
+    enum channel *channels = skeleton->channels[joint];
+    float data[CHANNEL_COUNT];
 
-        if (channel == CHANNEL_EMPTY || !str) {
-            if (str || channel != CHANNEL_EMPTY) {
-                int exp = 0;
-                while (exp < CHANNEL_COUNT && joint->channels[exp] != CHANNEL_EMPTY) exp++;
-                FAIL("Bone `%s' given an incorrect number of animation channels on line %i (expected %i)\n", joint->name, line_num, exp);
-            } else {
-                break; // finished parsing bone channels
-            }
-        } else {
-            // parse an animation channel
-            char *val = str;
-            str = bifurcate(str, ' ');
-            sample->data[joint->motion_index+i] = (float) atof(val);
-
-            // convert to radians if necessary
-            if (IS_ROTATION_CHANNEL(joint->channels[i]) && degrees) {
-                sample->data[joint->motion_index+i] *= M_PI/180;
-            }
+    unsigned exp = 0;
+    while (exp < CHANNEL_COUNT && channels[exp] != CHANNEL_EMPTY) exp++;
+    if (tokens->count != exp+1) {
+        FAIL("Bone `%s' given an incorrect number of animation channels on line %i (expected %i)\n", skeleton->names[joint], line_num, exp);
+    }
+
+    for (unsigned i = 0; i < exp; i++) {
+        data[i] = (float) parse_amc_number(tokens->words[i+1], tokens->lengths[i+1], tokens->numeric >> (i+1) & 1);
+
+        // convert to radians if necessary
+        if (IS_ROTATION_CHANNEL(channels[i]) && degrees) {
+            data[i] *= M_PI/180;
         }
     }
+
+    amc_sample_set_channels(motion, skeleton, joint, sample, data);
 }
 
 void parse_channel_order(enum channel *channels, char *str, bool verbose, int line_num) {
@@ -539,58 +1414,392 @@ struct vec3 parse_vec3(char *str, int line_num) {
     return vec;
 }
 
-struct amc_skeleton *amc_skeleton_new(unsigned char max_child_count) {
+struct amc_skeleton *amc_skeleton_new(void) {
     struct amc_skeleton *skeleton = xmalloc(sizeof(*skeleton));
-    skeleton->root = amc_joint_new(max_child_count);
-    skeleton->root->name = xmalloc(5);
-    strcpy(skeleton->root->name, "root");
     skeleton->map = jointmap_new();
-    jointmap_set(skeleton->map, skeleton->root);
+    skeleton->joint_count = 0;
+    skeleton->joint_capacity = 0;
+    skeleton->names = NULL;
+    skeleton->parents = NULL;
+    skeleton->child_offsets = NULL;
+    skeleton->child_counts = NULL;
+    skeleton->children = NULL;
+    skeleton->motion_indices = NULL;
+    skeleton->total_channels = 0;
+    skeleton->rotation_kernels = NULL;
+    skeleton->directions = NULL;
+    skeleton->rotations = NULL;
+    skeleton->lengths = NULL;
+    skeleton->channels = NULL;
     skeleton->root_position = (struct vec3){ .x=0, .y=0, .z=0 };
+    skeleton->translation_scale = 1;
+    skeleton->has_convention = false;
+    skeleton->rest_rotations = NULL;
+    skeleton->offsets = NULL;
+    skeleton->end_offsets = NULL;
+    skeleton->basis = (struct quat){ .w=1, .x=0, .y=0, .z=0 };
+    skeleton->unit_scale = 1;
+
+    char *root_name = xmalloc(5);
+    strcpy(root_name, "root");
+    jointmap_set(skeleton->map, root_name, amc_skeleton_add_joint(skeleton, root_name));
     return skeleton;
 }
 
 void amc_skeleton_free(struct amc_skeleton *skeleton) {
-    // amc_joint_free(skeleton->root, true);
-    hashmap_free(skeleton->map);
+    hashmap_free(skeleton->map); // also frees the joint names
+    free(skeleton->names);
+    free(skeleton->parents);
+    free(skeleton->child_offsets);
+    free(skeleton->child_counts);
+    free(skeleton->children);
+    free(skeleton->motion_indices);
+    free(skeleton->rotation_kernels);
+    free(skeleton->directions);
+    free(skeleton->rotations);
+    free(skeleton->lengths);
+    free(skeleton->channels);
+    free(skeleton->rest_rotations);
+    free(skeleton->offsets);
+    free(skeleton->end_offsets);
     free(skeleton);
 }
 
-struct amc_joint *amc_joint_new(unsigned char max_child_count) {
-    struct amc_joint *joint = xmalloc(sizeof(*joint));
-    joint->name = NULL;
-    joint->direction = (struct vec3) { .x=0, .y=0, .z=0 };
-    joint->rotation = (struct quat) { .w=1, .x=0, .y=0, .z=0 };
-    joint->children = xmalloc(sizeof(*joint->children)*max_child_count);
-    joint->child_count = 0;
-    joint->length = 0;
-    joint->motion_index = 0;
+unsigned amc_skeleton_add_joint(struct amc_skeleton *skeleton, char *name) {
+    // Joints are added in the order they're declared, and only reordered into
+    // a tree by amc_skeleton_build_tree().
+    if (skeleton->joint_count == skeleton->joint_capacity) {
+        unsigned cap = skeleton->joint_capacity ? 2*skeleton->joint_capacity : 32;
+        skeleton->names = xrealloc(skeleton->names, sizeof(*skeleton->names)*cap);
+        skeleton->directions = xrealloc(skeleton->directions, sizeof(*skeleton->directions)*cap);
+        skeleton->rotations = xrealloc(skeleton->rotations, sizeof(*skeleton->rotations)*cap);
+        skeleton->lengths = xrealloc(skeleton->lengths, sizeof(*skeleton->lengths)*cap);
+        skeleton->channels = xrealloc(skeleton->channels, sizeof(*skeleton->channels)*cap);
+        skeleton->joint_capacity = cap;
+    }
+
+    unsigned joint = skeleton->joint_count++;
+    skeleton->names[joint] = name;
+    skeleton->directions[joint] = (struct vec3) { .x=0, .y=0, .z=0 };
+    skeleton->rotations[joint] = (struct quat) { .w=1, .x=0, .y=0, .z=0 };
+    skeleton->lengths[joint] = 0;
     for (int i = 0; i < CHANNEL_COUNT; i++) {
-        joint->channels[i] = CHANNEL_EMPTY;
+        skeleton->channels[joint][i] = CHANNEL_EMPTY;
     }
     return joint;
 }
 
-bool amc_joint_has_translation(struct amc_joint *joint) {
-    for (int i = 0; i < CHANNEL_COUNT && joint->channels[i] != CHANNEL_EMPTY; i++) {
-        if (IS_TRANSLATION_CHANNEL(joint->channels[i])) {
-            return true;
+#define PERMUTE_JOINT_ARRAY(arr, order, count) do {                            \
+    void *permuted = xmalloc(sizeof(*(arr))*((count) ? (count) : 1));          \
+    for (unsigned p = 0; p < (count); p++) {                                   \
+        memcpy((char *) permuted + p*sizeof(*(arr)), &(arr)[(order)[p]], sizeof(*(arr))); \
+    }                                                                          \
+    free(arr);                                                                 \
+    (arr) = permuted;                                                          \
+} while(0)
+
+void amc_skeleton_build_tree(struct amc_skeleton *skeleton, unsigned *edges, unsigned edge_count, bool verbose) {
+    // `edges` holds (parent, child) pairs of joint indices in declaration order.
+    unsigned declared = skeleton->joint_count,
+             *parents = xmalloc(sizeof(*parents)*declared),
+             *counts = xcalloc(declared+1, sizeof(*counts)),
+             *children = xmalloc(sizeof(*children)*(edge_count+1)),
+             *order = xmalloc(sizeof(*order)*declared),
+             *new_index = xmalloc(sizeof(*new_index)*declared),
+             *stack = xmalloc(sizeof(*stack)*declared);
+
+    for (unsigned i = 0; i < declared; i++) parents[i] = AMC_NO_JOINT;
+    for (unsigned e = 0; e < edge_count; e++) {
+        unsigned parent = edges[2*e], child = edges[2*e+1];
+        if (child == 0 || parents[child] != AMC_NO_JOINT) {
+            FAIL("Bone `%s' has more than one parent\n", skeleton->names[child]);
         }
+        parents[child] = parent;
+        counts[parent+1]++;
     }
-    return false;
+
+    // group the children by parent, preserving their order (counting sort)
+    for (unsigned i = 0; i < declared; i++) counts[i+1] += counts[i];
+    for (unsigned e = 0; e < edge_count; e++) {
+        children[counts[edges[2*e]]++] = edges[2*e+1];
+    }
+    // counts[i] is now the end of joint i's children, and counts[i-1] its start
+
+    // order the joints depth-first, starting from the root
+    unsigned count = 0, top = 0;
+    for (unsigned i = 0; i < declared; i++) new_index[i] = AMC_NO_JOINT;
+    stack[top++] = 0;
+    while (top > 0) {
+        unsigned joint = stack[--top],
+                 start = joint ? counts[joint-1] : 0;
+        new_index[joint] = count;
+        order[count++] = joint;
+        // push in reverse so that the first child is visited first
+        for (unsigned c = counts[joint]; c > start; c--) {
+            stack[top++] = children[c-1];
+        }
+    }
+
+    // Joints that can't be reached from the root never appear in the output,
+    // but they stay in the map so that their motion data can be skipped.
+    for (unsigned i = 0; i < declared; i++) {
+        struct jointmap_entry *entry = jointmap_get(skeleton->map, skeleton->names[i]);
+        entry->index = new_index[i];
+        if (new_index[i] == AMC_NO_JOINT && verbose) {
+            printf("Warning: bone `%s' is not part of the hierarchy, ignoring it\n", skeleton->names[i]);
+        }
+    }
+
+    PERMUTE_JOINT_ARRAY(skeleton->names, order, count);
+    PERMUTE_JOINT_ARRAY(skeleton->directions, order, count);
+    PERMUTE_JOINT_ARRAY(skeleton->rotations, order, count);
+    PERMUTE_JOINT_ARRAY(skeleton->lengths, order, count);
+    PERMUTE_JOINT_ARRAY(skeleton->channels, order, count);
+    skeleton->joint_count = count;
+    skeleton->joint_capacity = count;
+
+    // rebuild the topology in terms of the new indices
+    free(skeleton->parents);
+    free(skeleton->child_offsets);
+    free(skeleton->child_counts);
+    free(skeleton->children);
+    skeleton->parents = xmalloc(sizeof(*skeleton->parents)*count);
+    skeleton->child_offsets = xmalloc(sizeof(*skeleton->child_offsets)*count);
+    skeleton->child_counts = xmalloc(sizeof(*skeleton->child_counts)*count);
+    skeleton->children = xmalloc(sizeof(*skeleton->children)*(count ? count : 1));
+    for (unsigned i = 0, offset = 0; i < count; i++) {
+        unsigned joint = order[i],
+                 start = joint ? counts[joint-1] : 0;
+        skeleton->parents[i] = parents[joint] == AMC_NO_JOINT ? AMC_NO_JOINT : new_index[parents[joint]];
+        skeleton->child_offsets[i] = offset;
+        skeleton->child_counts[i] = counts[joint] - start;
+        for (unsigned c = start; c < counts[joint]; c++) {
+            skeleton->children[offset++] = new_index[children[c]];
+        }
+    }
+
+    skeleton->total_channels = compute_amc_joint_indices(skeleton);
+    compute_rotation_kernels(skeleton);
+    if (verbose) printf("Computed joint motion indices\n");
+
+    // Translations are usually on the scale of the skeleton, so scaling by
+    // the longest bone keeps them well within the range of 16-bit floats. A
+    // power of two loses no precision.
+    float longest = vec3_length(skeleton->root_position);
+    for (unsigned i = 0; i < count; i++) {
+        if (skeleton->lengths[i] > longest) longest = skeleton->lengths[i];
+    }
+    int exp = 0;
+    if (longest > 0 && isfinite(longest)) frexpf(longest, &exp);
+    skeleton->translation_scale = ldexpf(1, -exp);
+
+    free(parents);
+    free(counts);
+    free(children);
+    free(order);
+    free(new_index);
+    free(stack);
+}
+
+// Named joint selections for the CMU skeleton, usable in place of a list with
+// --joints. Joints that a skeleton doesn't have are ignored.
+struct joint_preset {
+    const char *name;
+    const char *joints;         // joints to keep, with their ancestors, or NULL for all
+    const char *exclude_joints; // joints to drop, with their descendants, or NULL
+};
+
+static const struct joint_preset joint_presets[] = {
+    { "body", NULL, "lfingers,lthumb,rfingers,rthumb,ltoes,rtoes" },
+    { "core", "head,lwrist,rwrist,lfoot,rfoot", NULL },
+    { "root", "root", NULL }
+};
+
+static void mark_joints(struct amc_skeleton *skeleton, bool *keep, const char *list, bool value, bool strict) {
+    // Sets `keep` for each joint in a comma-separated list. Kept joints also
+    // keep their ancestors, so that the hierarchy stays connected. Unknown
+    // joints are an error if `strict`.
+    char *names = xstrdup(list), *rest = names;
+    while (rest) {
+        char *name = rest + strspn(rest, " ");
+        rest = bifurcate(rest, ',');
+        name[strcspn(name, " ")] = '\0';
+        if (strlen(name) == 0) continue;
+
+        struct jointmap_entry *entry = jointmap_get(skeleton->map, name);
+        if (!entry || entry->index == AMC_NO_JOINT) {
+            if (!strict) continue;
+            FAIL("Unrecognized bone `%s' in joint selection\n", name);
+        }
+        if (value) {
+            for (unsigned j = entry->index; j != AMC_NO_JOINT; j = skeleton->parents[j]) keep[j] = true;
+        } else {
+            keep[entry->index] = false;
+        }
+    }
+    free(names);
+}
+
+void amc_skeleton_select_joints(struct amc_skeleton *skeleton, char *joints, char *exclude_joints, bool verbose) {
+    // Removes joints from the skeleton. `joints` lists the joints to keep, or
+    // names a preset, and `exclude_joints` lists joints to drop along with
+    // their descendants; either may be NULL. Removed joints stay in the map,
+    // so that their motion data is skipped without being parsed.
+    if (!joints && !exclude_joints) return;
+
+    const struct joint_preset *preset = NULL;
+    for (size_t i = 0; joints && i < sizeof(joint_presets)/sizeof(*joint_presets); i++) {
+        if (strcmp(joints, joint_presets[i].name) == 0) preset = &joint_presets[i];
+    }
+    const char *keep_list = preset ? preset->joints : joints;
+
+    unsigned count = skeleton->joint_count;
+    bool *keep = xmalloc(sizeof(*keep)*(count ? count : 1));
+    for (unsigned i = 0; i < count; i++) keep[i] = !keep_list;
+    if (keep_list) mark_joints(skeleton, keep, keep_list, true, !preset);
+    if (preset && preset->exclude_joints) mark_joints(skeleton, keep, preset->exclude_joints, false, false);
+    if (exclude_joints) mark_joints(skeleton, keep, exclude_joints, false, true);
+    if (count > 0 && !keep[0]) FAIL("The root bone can't be excluded\n");
+
+    // Rebuild the tree from the edges between kept joints. A parent precedes
+    // its children, so dropping a joint drops its descendants, and the
+    // children of each joint stay in the same order.
+    unsigned *edges = xmalloc(2*sizeof(*edges)*(count ? count : 1)),
+             edge_count = 0;
+    for (unsigned i = 1; i < count; i++) {
+        if (!keep[skeleton->parents[i]]) keep[i] = false;
+        if (keep[i]) {
+            edges[2*edge_count] = skeleton->parents[i];
+            edges[2*edge_count+1] = i;
+            edge_count++;
+        } else if (verbose) {
+            printf("Excluding bone `%s'\n", skeleton->names[i]);
+        }
+    }
+    // quietly, since the excluded joints would be reported as unreachable
+    if (edge_count+1 < count) amc_skeleton_build_tree(skeleton, edges, edge_count, false);
+    if (verbose) printf("Selected %u of %u bones\n", skeleton->joint_count, count);
+
+    free(edges);
+    free(keep);
 }
 
-void amc_joint_free(struct amc_joint *joint) {
-    free(joint->children);
-    free(joint->name);
-    free(joint);
+void amc_skeleton_set_convention(struct amc_skeleton *skeleton, float scale, struct vec3 up, struct vec3 forward) {
+    // Converts the skeleton to another unit scale and axis convention, where
+    // ASF files are taken to be Y up and Z forward. Bone offsets are converted
+    // here, once, and the rotation between the two conventions is folded into
+    // each joint's local rotation, so that converting a sample costs nothing
+    // extra besides the root translation.
+    struct quat basis = basis_to_quat(vec3_cross(up, forward), up, forward);
+    skeleton->root_position = vec3_scale(quat_rotate(basis, skeleton->root_position), scale);
+    for (unsigned i = 0; i < skeleton->joint_count; i++) {
+        skeleton->directions[i] = quat_rotate(basis, skeleton->directions[i]);
+        skeleton->lengths[i] *= scale;
+        skeleton->rotations[i] = quat_mul(basis, skeleton->rotations[i]);
+    }
+    skeleton->has_convention = true;
+    skeleton->basis = basis;
+    skeleton->unit_scale = scale;
 }
 
-struct amc_motion *amc_motion_new(unsigned total_channels) {
+static void convention_axes(struct output_options *options, struct vec3 *up, struct vec3 *forward) {
+    // The output's up and forward axes. Without a forward axis, it's Z unless
+    // that's the up axis, in which case it's where the quarter turn about X
+    // that takes Y up to Z takes Z: -Y for Z up (as in Blender), Y for -Z up.
+    *up = (struct vec3) { 0, 1, 0 };
+    *forward = (struct vec3) { 0, 0, 1 };
+    if (options->up_axis) parse_axis(options->up_axis, up);
+    if (options->forward_axis) parse_axis(options->forward_axis, forward);
+    else if (up->z != 0) *forward = (struct vec3) { 0, -up->z, 0 };
+}
+
+const char *validate_convention(struct output_options *options) {
+    // Checks that the skeleton and output options can be used together,
+    // returning why not, or NULL if they can. The command line and the Python
+    // module both check options here, so they accept the same combinations.
+    struct vec3 up, forward;
+    if ((options->up_axis && !parse_axis(options->up_axis, &up)) || (options->forward_axis && !parse_axis(options->forward_axis, &forward))) {
+        return "axes must be x, y, z, -x, -y or -z";
+    }
+    convention_axes(options, &up, &forward);
+    if (up.x*forward.x + up.y*forward.y + up.z*forward.z != 0) {
+        return "the up and forward axes must be perpendicular";
+    } else if (options->retarget && (options->joints || options->exclude_joints)) {
+        return "the target rig selects the joints, so they can't also be chosen when retargeting";
+    } else if (options->retarget && options->raw) {
+        return "raw AMC channels can't be retargeted";
+    }
+    return NULL;
+}
+
+void amc_skeleton_apply_options(struct amc_skeleton *skeleton, struct output_options *options, bool verbose) {
+    // prepares a freshly parsed skeleton for output, with joints selected
+    // before the translation scale used for storage is fixed by the new units,
+    // and retargeting last, since the target rig is in the output units
+    struct target_rig *rig = options->retarget ? target_rig_load(options->retarget) : NULL;
+    if (rig) {
+        target_rig_check(rig, skeleton);
+        amc_skeleton_select_joints(skeleton, target_rig_sources(rig), NULL, verbose);
+    } else amc_skeleton_select_joints(skeleton, options->joints, options->exclude_joints, verbose);
+
+    struct vec3 up, forward;
+    convention_axes(options, &up, &forward);
+    if (options->scale != 1 || up.y != 1 || forward.z != 1) {
+        amc_skeleton_set_convention(skeleton, options->scale, up, forward);
+        if (verbose) {
+            printf("Converted skeleton to scale %g, %s up and %s forward\n", options->scale,
+                   options->up_axis ? options->up_axis : "y", options->forward_axis ? options->forward_axis : forward.y < 0 ? "-y" : forward.y > 0 ? "y" : "z");
+        }
+    }
+
+    if (rig) {
+        amc_skeleton_retarget(skeleton, rig, verbose);
+        target_rig_free(rig);
+    }
+}
+
+struct vec3 amc_joint_offset(struct amc_skeleton *skeleton, unsigned joint) {
+    // the joint's offset from its parent, as in the BVH hierarchy
+    if (skeleton->offsets) return skeleton->offsets[joint];
+    unsigned parent = skeleton->parents[joint];
+    if (parent == AMC_NO_JOINT) return skeleton->root_position;
+    return vec3_scale(vec3_normalize(skeleton->directions[parent]), skeleton->lengths[parent]);
+}
+
+struct vec3 amc_joint_end_offset(struct amc_skeleton *skeleton, unsigned joint) {
+    // where the joint's bone ends, relative to the joint
+    if (skeleton->end_offsets) return skeleton->end_offsets[joint];
+    return vec3_scale(vec3_normalize(skeleton->directions[joint]), skeleton->lengths[joint]);
+}
+
+bool parse_axis(char *str, struct vec3 *axis) {
+    // x, y or z, optionally preceded by a sign
+    float sign = 1;
+    if (*str == '+' || *str == '-') sign = *str++ == '-' ? -1 : 1;
+    char c = tolower(*str);
+    if ((c != 'x' && c != 'y' && c != 'z') || str[1] != '\0') return false;
+    *axis = (struct vec3){ c == 'x' ? sign : 0, c == 'y' ? sign : 0, c == 'z' ? sign : 0 };
+    return true;
+}
+
+bool amc_joint_has_translation(struct amc_skeleton *skeleton, unsigned joint) {
+    enum channel *channels = skeleton->channels[joint];
+    for (int i = 0; i < CHANNEL_COUNT && channels[i] != CHANNEL_EMPTY; i++) {
+        if (IS_TRANSLATION_CHANNEL(channels[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+struct amc_motion *amc_motion_new(unsigned total_channels, enum sample_storage storage) {
     struct amc_motion *motion = xmalloc(sizeof(*motion));
     motion->total_channels = total_channels;
     motion->sample_count = 0;
     motion->samples = NULL;
+    motion->storage = storage;
+    motion->max_rotation_error = 0;
+    motion->max_translation_error = 0;
     return motion;
 }
 
@@ -598,30 +1807,265 @@ void amc_motion_free(struct amc_motion *motion) {
     struct amc_sample *sample = motion->samples;
     while (sample) {
         struct amc_sample *next = sample->next;
-        free(sample->data);
         free(sample);
         sample = next;
     }
     free(motion);
 }
 
-struct amc_sample *amc_sample_new(unsigned total_channels) {
-    struct amc_sample *sample = xmalloc(sizeof(*sample));
-    sample->data = xcalloc(total_channels, sizeof(*sample->data));
+struct amc_sample *amc_sample_new(unsigned total_channels, enum sample_storage storage) {
+    // the values are stored inline, so a sample is a single allocation
+    size_t value_size = storage == STORAGE_FLOAT32 ? sizeof(float) : sizeof(uint16_t);
+    struct amc_sample *sample = xcalloc(1, sizeof(*sample) + value_size*total_channels);
     sample->next = NULL;
+    sample->storage = storage;
     return sample;
 }
 
-unsigned compute_amc_joint_indices(struct amc_joint *joint, unsigned offset) {
-    // recursively assign an array index based on position in the tree
-    joint->motion_index = offset;
-    offset += CHANNEL_COUNT;
-    for (unsigned i = 0; i < joint->child_count; i++) {
-        offset = compute_amc_joint_indices(joint->children[i], offset);
+// 16-bit rotations cover [-π, π] with this step
+#define INT16_ROTATION_STEP ((float) M_PI/32767)
+
+void amc_sample_get_channels(float *vals, struct amc_skeleton *skeleton, unsigned joint, struct amc_sample *sample) {
+    // Reads a joint's channel values into `vals`, which must have room for
+    // CHANNEL_COUNT values. Missing channels are zero.
+    enum channel *channels = skeleton->channels[joint];
+    unsigned index = skeleton->motion_indices[joint];
+    int i = 0;
+
+    if (sample->storage == STORAGE_FLOAT32) {
+        const float *data = (const float *) sample->data + index;
+        for (; i < CHANNEL_COUNT && channels[i] != CHANNEL_EMPTY; i++) vals[i] = data[i];
+    } else {
+        const uint16_t *data = (const uint16_t *) sample->data + index;
+        for (; i < CHANNEL_COUNT && channels[i] != CHANNEL_EMPTY; i++) {
+            if (IS_TRANSLATION_CHANNEL(channels[i])) {
+                vals[i] = half_to_float(data[i]) / skeleton->translation_scale;
+            } else if (sample->storage == STORAGE_INT16) {
+                vals[i] = (int16_t) data[i] * INT16_ROTATION_STEP;
+            } else {
+                vals[i] = half_to_float(data[i]);
+            }
+        }
+    }
+    for (; i < CHANNEL_COUNT; i++) vals[i] = 0;
+}
+
+void amc_sample_set_channels(struct amc_motion *motion, struct amc_skeleton *skeleton, unsigned joint, struct amc_sample *sample, const float *vals) {
+    // Stores a joint's channel values, keeping track of the largest error
+    // this introduces.
+    enum channel *channels = skeleton->channels[joint];
+    unsigned index = skeleton->motion_indices[joint];
+
+    if (sample->storage == STORAGE_FLOAT32) {
+        float *data = (float *) sample->data + index;
+        for (int i = 0; i < CHANNEL_COUNT && channels[i] != CHANNEL_EMPTY; i++) data[i] = vals[i];
+        return;
+    }
+
+    uint16_t *data = (uint16_t *) sample->data + index;
+    for (int i = 0; i < CHANNEL_COUNT && channels[i] != CHANNEL_EMPTY; i++) {
+        float stored, error;
+        if (IS_TRANSLATION_CHANNEL(channels[i])) {
+            data[i] = float_to_half(vals[i] * skeleton->translation_scale);
+            stored = half_to_float(data[i]) / skeleton->translation_scale;
+            error = fabsf(stored - vals[i]);
+            if (error > motion->max_translation_error) motion->max_translation_error = error;
+            continue;
+        } else if (sample->storage == STORAGE_INT16) {
+            // angles that differ by a full turn are the same rotation
+            float wrapped = remainderf(vals[i], 2*M_PI);
+            long q = lrintf(wrapped / INT16_ROTATION_STEP);
+            if (q > 32767) q = 32767;
+            if (q < -32767) q = -32767;
+            data[i] = (uint16_t) (int16_t) q;
+            stored = q * INT16_ROTATION_STEP;
+            error = fabsf(stored - wrapped);
+        } else {
+            data[i] = float_to_half(vals[i]);
+            stored = half_to_float(data[i]);
+            error = fabsf(stored - vals[i]);
+        }
+        if (error > motion->max_rotation_error) motion->max_rotation_error = error;
+    }
+}
+
+bool parse_sample_storage(char *str, enum sample_storage *storage) {
+    if (streq(str, "float32")) *storage = STORAGE_FLOAT32;
+    else if (streq(str, "float16")) *storage = STORAGE_FLOAT16;
+    else if (streq(str, "int16")) *storage = STORAGE_INT16;
+    else return false;
+    return true;
+}
+
+const char *sample_storage_name(enum sample_storage storage) {
+    static const char *names[] = { "float32", "float16", "int16" };
+    return names[storage];
+}
+
+unsigned amc_channel_count(struct amc_skeleton *skeleton) {
+    // the number of channels actually present in the AMC file
+    unsigned count = 0;
+    for (unsigned i = 0; i < skeleton->joint_count; i++) {
+        for (int c = 0; c < CHANNEL_COUNT && skeleton->channels[i][c] != CHANNEL_EMPTY; c++) {
+            count++;
+        }
+    }
+    return count;
+}
+
+unsigned compute_amc_joint_indices(struct amc_skeleton *skeleton) {
+    // assign an array index based on position in the tree, with room for
+    // only the channels each joint actually has
+    free(skeleton->motion_indices);
+    skeleton->motion_indices = xmalloc(sizeof(*skeleton->motion_indices)*(skeleton->joint_count ? skeleton->joint_count : 1));
+    unsigned offset = 0;
+    for (unsigned i = 0; i < skeleton->joint_count; i++) {
+        skeleton->motion_indices[i] = offset;
+        for (int c = 0; c < CHANNEL_COUNT && skeleton->channels[i][c] != CHANNEL_EMPTY; c++) offset++;
     }
     return offset;
 }
 
+// Rotation kernels compute q = q3 * q2 * q1 as euler_to_quat() does, but in
+// closed form for each channel order. The products are the same as
+// quat_mul()'s with the terms that are always zero dropped.
+
+static inline struct quat premul_x(struct quat q, float c, float s) {
+    return (struct quat) { .w=c*q.w - s*q.x, .x=c*q.x + s*q.w, .y=c*q.y - s*q.z, .z=c*q.z + s*q.y };
+}
+
+static inline struct quat premul_y(struct quat q, float c, float s) {
+    return (struct quat) { .w=c*q.w - s*q.y, .x=c*q.x + s*q.z, .y=c*q.y + s*q.w, .z=c*q.z - s*q.x };
+}
+
+static inline struct quat premul_z(struct quat q, float c, float s) {
+    return (struct quat) { .w=c*q.w - s*q.z, .x=c*q.x - s*q.y, .y=c*q.y + s*q.x, .z=c*q.z + s*q.w };
+}
+
+#define HALF_ANGLE(c, s, n) float c = cos(vals[kernel->indices[n]]/2), s = sin(vals[kernel->indices[n]]/2)
+
+// one axis, I
+#define AXIS_KERNEL(name, I)                                                    \
+static struct quat name(const float *vals, const struct rotation_kernel *kernel) { \
+    HALF_ANGLE(c, s, 0);                                                        \
+    struct quat q = { .w=c, .x=0, .y=0, .z=0 };                                 \
+    q.I = s;                                                                    \
+    return q;                                                                   \
+}
+
+// I then J, where K is the remaining axis and SIGN the sign of J × I along it
+#define PAIR_PRODUCT(q, I, J, K, SIGN)                                          \
+    HALF_ANGLE(ci, si, 0);                                                      \
+    HALF_ANGLE(cj, sj, 1);                                                      \
+    struct quat q;                                                              \
+    q.w = cj*ci;                                                                \
+    q.I = cj*si;                                                                \
+    q.J = sj*ci;                                                                \
+    q.K = SIGN(sj*si)
+
+#define PAIR_KERNEL(name, I, J, K, SIGN)                                        \
+static struct quat name(const float *vals, const struct rotation_kernel *kernel) { \
+    PAIR_PRODUCT(q, I, J, K, SIGN);                                             \
+    return q;                                                                   \
+}
+
+// I then J then K
+#define TRIPLE_KERNEL(name, I, J, K, SIGN)                                      \
+static struct quat name(const float *vals, const struct rotation_kernel *kernel) { \
+    PAIR_PRODUCT(q, I, J, K, SIGN);                                             \
+    HALF_ANGLE(ck, sk, 2);                                                      \
+    return premul_##K(q, ck, sk);                                               \
+}
+
+AXIS_KERNEL(rotate_x, x)
+AXIS_KERNEL(rotate_y, y)
+AXIS_KERNEL(rotate_z, z)
+PAIR_KERNEL(rotate_xy, x, y, z, -)
+PAIR_KERNEL(rotate_xz, x, z, y, +)
+PAIR_KERNEL(rotate_yx, y, x, z, +)
+PAIR_KERNEL(rotate_yz, y, z, x, -)
+PAIR_KERNEL(rotate_zx, z, x, y, -)
+PAIR_KERNEL(rotate_zy, z, y, x, +)
+TRIPLE_KERNEL(rotate_xyz, x, y, z, -)
+TRIPLE_KERNEL(rotate_xzy, x, z, y, +)
+TRIPLE_KERNEL(rotate_yxz, y, x, z, +)
+TRIPLE_KERNEL(rotate_yzx, y, z, x, -)
+TRIPLE_KERNEL(rotate_zxy, z, x, y, -)
+TRIPLE_KERNEL(rotate_zyx, z, y, x, +)
+
+static struct quat rotate_none(const float *vals, const struct rotation_kernel *kernel) {
+    return (struct quat) { .w=1, .x=0, .y=0, .z=0 };
+}
+
+static struct quat rotate_euler(const float *vals, const struct rotation_kernel *kernel) {
+    // any other order, which must repeat an axis
+    struct euler_triple e = {
+        .angles = { 0, 0, 0 },
+        .order = { CHANNEL_RX, CHANNEL_RY, CHANNEL_RZ }
+    };
+    for (int i = 0; i < kernel->count; i++) {
+        e.angles[i] = vals[kernel->indices[i]];
+        e.order[i] = kernel->order[i];
+    }
+    return euler_to_quat(e);
+}
+
+typedef struct quat (*rotation_fn)(const float *vals, const struct rotation_kernel *kernel);
+
+void compute_rotation_kernels(struct amc_skeleton *skeleton) {
+    // pick each joint's kernel by its rotation channels, indexed by axis
+    static const rotation_fn axis_kernels[3] = { rotate_x, rotate_y, rotate_z },
+                             pair_kernels[3][3] = {
+                                 [0][1]=rotate_xy, [0][2]=rotate_xz, [1][0]=rotate_yx,
+                                 [1][2]=rotate_yz, [2][0]=rotate_zx, [2][1]=rotate_zy
+                             },
+                             triple_kernels[3][3][3] = {
+                                 [0][1][2]=rotate_xyz, [0][2][1]=rotate_xzy, [1][0][2]=rotate_yxz,
+                                 [1][2][0]=rotate_yzx, [2][0][1]=rotate_zxy, [2][1][0]=rotate_zyx
+                             };
+    free(skeleton->rotation_kernels);
+    skeleton->rotation_kernels = xmalloc(sizeof(*skeleton->rotation_kernels)*(skeleton->joint_count ? skeleton->joint_count : 1));
+    for (unsigned i = 0; i < skeleton->joint_count; i++) {
+        struct rotation_kernel *kernel = &skeleton->rotation_kernels[i];
+        int axes[3] = { 0, 0, 0 };
+        kernel->count = 0;
+        for (int c = 0; c < CHANNEL_COUNT && skeleton->channels[i][c] != CHANNEL_EMPTY; c++) {
+            enum channel channel = skeleton->channels[i][c];
+            if (IS_ROTATION_CHANNEL(channel) && kernel->count < 3) {
+                axes[kernel->count] = channel - CHANNEL_RX;
+                kernel->indices[kernel->count] = c;
+                kernel->order[kernel->count++] = channel;
+            }
+        }
+
+        if (kernel->count == 0) kernel->convert = rotate_none;
+        else if (kernel->count == 1) kernel->convert = axis_kernels[axes[0]];
+        else if (kernel->count == 2) kernel->convert = pair_kernels[axes[0]][axes[1]];
+        else kernel->convert = triple_kernels[axes[0]][axes[1]][axes[2]];
+        if (!kernel->convert) kernel->convert = rotate_euler;
+    }
+}
+
+_Thread_local jmp_buf *fail_handler = NULL;
+_Thread_local char fail_message[BUFFSIZE];
+
+_Noreturn void fail(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    if (fail_handler) {
+        vsnprintf(fail_message, sizeof(fail_message), fmt, args);
+        va_end(args);
+        // drop the trailing newline, the handler decides how to report it
+        size_t len = strlen(fail_message);
+        if (len > 0 && fail_message[len-1] == '\n') fail_message[len-1] = '\0';
+        longjmp(*fail_handler, 1);
+    }
+    fprintf(stderr, "Error: ");
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    exit(1);
+}
+
 void *xmalloc(size_t size) {
     void *mem = malloc(size);
     if (mem) return mem;
@@ -640,6 +2084,12 @@ void *xrealloc(void *mem, size_t size) {
     FAIL("Unable to allocate sufficient memory\n");
 }
 
+char *xstrdup(const char *str) {
+    char *copy = xmalloc(strlen(str)+1);
+    strcpy(copy, str);
+    return copy;
+}
+
 char *readline(char *str, int n, FILE *f) {
     char *res = fgets(str, n, f);
 
@@ -668,6 +2118,96 @@ char *bifurcate(char *str, char delim) {
     return NULL;
 }
 
+double now_ms(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec*1e3 + ts.tv_nsec/1e6;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double da = *(const double *) a,
+           db = *(const double *) b;
+    return (da > db) - (da < db);
+}
+
+double percentile(double *vals, size_t count, double p) {
+    // sorts `vals` in place
+    if (count == 0) return 0;
+    qsort(vals, count, sizeof(*vals), compare_doubles);
+    size_t i = (size_t) (p*count);
+    return vals[i < count ? i : count-1];
+}
+
+uint16_t float_to_half(float val) {
+    // rounds to the nearest IEEE half, clamping to the largest finite one
+    uint32_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    bits &= 0x7fffffff;
+
+    if (bits >= 0x477ff000) {
+        return sign | 0x7bff; // too large (or NaN)
+    } else if (bits < 0x38800000) {
+        // a subnormal half, in steps of 2^-24
+        return sign | (uint16_t) lrintf(fabsf(val) * 16777216.0f);
+    }
+    // rebias the exponent and round the mantissa to nearest even
+    bits += 0xfff + ((bits >> 13) & 1);
+    return sign | (uint16_t) ((bits - 0x38000000) >> 13);
+}
+
+float half_to_float(uint16_t half) {
+    uint32_t sign = (uint32_t) (half & 0x8000) << 16,
+             exp = (half >> 10) & 0x1f,
+             mantissa = half & 0x3ff,
+             bits;
+    if (exp == 0) {
+        float val = mantissa / 16777216.0f;
+        return sign ? -val : val;
+    } else if (exp == 31) {
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    } else {
+        bits = sign | ((exp + 112) << 23) | (mantissa << 13);
+    }
+    float val;
+    memcpy(&val, &bits, sizeof(val));
+    return val;
+}
+
+void fwrite_le_u32(FILE *f, uint32_t val) {
+    unsigned char bytes[4] = { val & 0xff, (val >> 8) & 0xff, (val >> 16) & 0xff, val >> 24 };
+    fwrite(bytes, 1, 4, f);
+}
+
+void fwrite_le_f32(FILE *f, const float *vals, size_t count) {
+    // binary formats are little-endian, regardless of the host
+    unsigned char bytes[4*256];
+    while (count > 0) {
+        size_t chunk = count < 256 ? count : 256;
+        for (size_t i = 0; i < chunk; i++) {
+            uint32_t bits;
+            memcpy(&bits, vals+i, sizeof(bits));
+            bytes[4*i] = bits & 0xff;
+            bytes[4*i+1] = (bits >> 8) & 0xff;
+            bytes[4*i+2] = (bits >> 16) & 0xff;
+            bytes[4*i+3] = bits >> 24;
+        }
+        fwrite(bytes, 4, chunk, f);
+        vals += chunk;
+        count -= chunk;
+    }
+}
+
+void fprint_json_string(FILE *f, const char *str) {
+    fputc('"', f);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') fprintf(f, "\\%c", *str);
+        else if ((unsigned char) *str < 0x20) fprintf(f, "\\u%04x", *str);
+        else fputc(*str, f);
+    }
+    fputc('"', f);
+}
+
 bool streq(char *str, char *str2) {
     return strcmp(str, str2) == 0;
 }
@@ -683,9 +2223,55 @@ bool ends_with(char *str, char *suff) {
     return suff_len <= str_len && strcmp(str+str_len-suff_len, suff) == 0;
 }
 
+char *file_stem(const char *filename) {
+    // the name without its directory or extension (or .amc.gz), which the
+    // caller must free
+    const char *base = filename, *sep;
+    while ((sep = strpbrk(base, "/\\"))) base = sep+1;
+    size_t len = strlen(base);
+    if (len > 3 && (ends_with((char *) base, ".gz") || ends_with((char *) base, ".GZ"))) len -= 3;
+    for (size_t i = len; i > 0; i--) {
+        if (base[i-1] == '.') {
+            len = i-1;
+            break;
+        }
+    }
+    char *stem = xmalloc(len+1);
+    memcpy(stem, base, len);
+    stem[len] = '\0';
+    return stem;
+}
+
+char *asf_stem_for_amc(const char *amc_stem, unsigned choice) {
+    // An AMC file goes with the ASF file of the same name, or failing that,
+    // the one named by the part before the first underscore (01.asf for
+    // 01_02.amc). Returns the ASF stem to try for each choice, counting from
+    // 0, or NULL once there are no more. The caller frees it.
+    if (choice == 0) return xstrdup(amc_stem);
+    size_t prefix = strcspn(amc_stem, "_");
+    if (choice > 1 || !amc_stem[prefix]) return NULL;
+    char *stem = xmalloc(prefix+1);
+    memcpy(stem, amc_stem, prefix);
+    stem[prefix] = '\0';
+    return stem;
+}
+
+bool is_input_type(char *filename, char *ext) {
+    // whether the file has the given lowercase extension, in either case,
+    // and possibly gzipped: is_input_type("01.ASF.gz", ".asf")
+    int len = strlen(filename),
+        ext_len = strlen(ext);
+    if (ends_with(filename, ".gz") || ends_with(filename, ".GZ")) len -= 3;
+    if (ext_len > len) return false;
+    for (int i = 0; i < ext_len; i++) {
+        if (tolower(filename[len-ext_len+i]) != ext[i]) return false;
+    }
+    return true;
+}
+
 struct hashmap *jointmap_new(void) {
      return hashmap_new_with_allocator(xmalloc, xrealloc, free,
-                                      sizeof(struct amc_joint*), 16,
+                                      sizeof(struct jointmap_entry), 16,
                                       0, 0,
                                       jointmap_hash,
                                       jointmap_cmp,
@@ -698,29 +2284,28 @@ void jointmap_free(struct hashmap *map) {
 }
 
 void jointmap_free_item(void *item) {
-    struct amc_joint **joint = item;
-    amc_joint_free(*joint);
+    struct jointmap_entry *entry = item;
+    free(entry->name);
 }
 
-struct amc_joint *jointmap_get(struct hashmap *map, char *name) {
-    struct amc_joint *search = &(struct amc_joint) { .name = name },
-                     **result = hashmap_get(map, &search);
-    return result ? *result : NULL;
+struct jointmap_entry *jointmap_get(struct hashmap *map, char *name) {
+    struct jointmap_entry search = { .name = name };
+    return hashmap_get(map, &search);
 }
 
-void jointmap_set(struct hashmap *map, struct amc_joint *joint) {
-    hashmap_set(map, &joint);
+void jointmap_set(struct hashmap *map, char *name, unsigned index) {
+    struct jointmap_entry entry = { .name = name, .index = index };
+    hashmap_set(map, &entry);
 }
 
 int jointmap_cmp(const void *a, const void *b, void *data) {
-    struct amc_joint * const *ja = a;
-    struct amc_joint * const *jb = b;
-    return strcmp((*ja)->name, (*jb)->name);
+    const struct jointmap_entry *ea = a, *eb = b;
+    return strcmp(ea->name, eb->name);
 }
 
 uint64_t jointmap_hash(const void *item, uint64_t seed0, uint64_t seed1) {
-    struct amc_joint * const *joint = item;
-    return hashmap_sip((*joint)->name, strlen((*joint)->name), seed0, seed1);
+    const struct jointmap_entry *entry = item;
+    return hashmap_fnv1a(entry->name, strlen(entry->name), seed0, seed1);
 }
 
 /*
@@ -741,6 +2326,10 @@ float vec3_length(struct vec3 v) {
     return sqrt(v.x*v.x + v.y*v.y + v.z*v.z);
 }
 
+struct vec3 vec3_cross(struct vec3 a, struct vec3 b) {
+    return (struct vec3){ a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x };
+}
+
 struct quat angle_axis_to_quat(float angle, struct vec3 axis) {
     float s = sin(angle/2),
           c = cos(angle/2);
@@ -765,6 +2354,29 @@ struct quat quat_inv(struct quat q) {
     return (struct quat) { .w=q.w/len, .x=-q.x/len, .y=-q.y/len, .z=-q.z/len };
 }
 
+struct vec3 quat_rotate(struct quat q, struct vec3 v) {
+    struct quat p = quat_mul(q, quat_mul((struct quat) { .w=0, .x=v.x, .y=v.y, .z=v.z }, quat_conj(q)));
+    return (struct vec3){ p.x, p.y, p.z };
+}
+
+struct quat basis_to_quat(struct vec3 x, struct vec3 y, struct vec3 z) {
+    // the rotation taking the X, Y and Z axes to the given orthonormal axes
+    float trace = x.x + y.y + z.z, s;
+    if (trace > 0) {
+        s = 2*sqrt(trace+1);
+        return (struct quat) { .w=s/4, .x=(y.z-z.y)/s, .y=(z.x-x.z)/s, .z=(x.y-y.x)/s };
+    } else if (x.x > y.y && x.x > z.z) {
+        s = 2*sqrt(1+x.x-y.y-z.z);
+        return (struct quat) { .w=(y.z-z.y)/s, .x=s/4, .y=(y.x+x.y)/s, .z=(z.x+x.z)/s };
+    } else if (y.y > z.z) {
+        s = 2*sqrt(1+y.y-x.x-z.z);
+        return (struct quat) { .w=(z.x-x.z)/s, .x=(y.x+x.y)/s, .y=s/4, .z=(z.y+y.z)/s };
+    } else {
+        s = 2*sqrt(1+z.z-x.x-y.y);
+        return (struct quat) { .w=(x.y-y.x)/s, .x=(z.x+x.z)/s, .y=(z.y+y.z)/s, .z=s/4 };
+    }
+}
+
 struct quat euler_to_quat(struct euler_triple e) {
     struct quat q = { .w=1, .x=0, .y=0, .z=0 }; // identity
 
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <math.h>
+#include <setjmp.h>
 #include "hashmap.h"
 
 #ifndef M_PI
@@ -40,67 +41,385 @@ struct euler_triple {
     enum channel order[3];
 };
 
-struct amc_joint {
-    char *name;     // a unique name (from the ASF file)
-    struct amc_joint **children;    // the children of the joint in the tree
-    unsigned child_count;   // the number of children in the tree
-    unsigned motion_index;  // where motion data for this joint should be stored in a sample (arguably doesn't belong here, but simplifies things)
-    struct vec3 direction;  // the direction of the joint (from the ASF file)
-    struct quat rotation;   // the local rotation transform of the joint (from the ASF file)
-    enum channel channels[CHANNEL_COUNT]; // the animation channels (from the ASF file)
-    float length; // the length of the joint (from the ASF file)
+// Converts a joint's rotation channels, read from `vals` at the kernel's
+// indices, to a quaternion. Chosen per joint by compute_rotation_kernels(), so
+// that each channel order gets its own closed-form product.
+struct rotation_kernel {
+    struct quat (*convert)(const float *vals, const struct rotation_kernel *kernel);
+    unsigned char indices[3];   // where each rotation channel is in the joint's channels
+    enum channel order[3];      // the rotation channels, in the order they're applied
+    int count;                  // the number of rotation channels, at most 3
 };
 
+#define AMC_NO_JOINT ((unsigned) -1)
+
+// The skeleton is stored as a set of parallel arrays indexed by joint, with
+// joints in depth-first (pre-order) order, so a parent always precedes its
+// children. The children of each joint are listed in compressed sparse row
+// form: `children[child_offsets[i]]` through
+// `children[child_offsets[i]+child_counts[i]-1]`.
 struct amc_skeleton {
-    struct hashmap *map;    // maps joint names to joints
-    struct amc_joint *root; // the root of the joint tree
+    struct hashmap *map;        // maps joint names to joint indices
+    unsigned joint_count;       // the number of joints in the skeleton
+    unsigned joint_capacity;    // the allocated length of the per-joint arrays
+    char **names;               // unique joint names (from the ASF file, owned by the map)
+    unsigned *parents;          // the parent of each joint, AMC_NO_JOINT for the root
+    unsigned *child_offsets;    // where each joint's children start in `children`
+    unsigned *child_counts;     // the number of children of each joint
+    unsigned *children;         // joint indices, grouped by parent
+    unsigned *motion_indices;   // where motion data for each joint is stored in a sample
+    unsigned total_channels;    // the number of values in a sample
+    struct rotation_kernel *rotation_kernels; // how each joint's rotation channels become a quaternion
+    struct vec3 *directions;    // the direction of each joint (from the ASF file)
+    struct quat *rotations;     // the local rotation transform of each joint (from the ASF file)
+    float *lengths;             // the length of each joint (from the ASF file)
+    enum channel (*channels)[CHANNEL_COUNT]; // the animation channels of each joint (from the ASF file)
     struct vec3 root_position;  // the position of the root (from the ASF file)
+    float translation_scale;    // a power of two that brings translations to around 1, for 16-bit storage
+    bool has_convention;        // whether translations are converted by `basis` and `unit_scale`
+    struct quat basis;          // the rotation into the output axis convention
+    float unit_scale;           // the scale into output units
+    struct quat (*rest_rotations)[2]; // when retargeted, what each joint's motion is multiplied by before and after, otherwise NULL
+    struct vec3 *offsets;       // when retargeted, each joint's offset from its parent on the target rig, otherwise NULL
+    struct vec3 *end_offsets;   // when retargeted, the end site of each joint on the target rig, otherwise NULL
+};
+
+enum sample_storage {
+    STORAGE_FLOAT32,    // every channel as a 32-bit float
+    STORAGE_FLOAT16,    // every channel as a 16-bit float
+    STORAGE_INT16       // rotations as 16-bit integers over ±π, translations as 16-bit floats
 };
 
 struct amc_sample {
     struct amc_sample *next;
-    float *data;
+    enum sample_storage storage;
+    unsigned char data[];       // the channel values, stored according to `storage`
 };
 
 struct amc_motion {
     unsigned total_channels;
     unsigned sample_count;
     struct amc_sample *samples;
+    enum sample_storage storage;
+    float max_rotation_error;   // the largest change to a rotation channel by storing it, in radians
+    float max_translation_error; // the largest change to a translation channel by storing it
+};
+
+enum parsing_mode {
+    MODE_NONE,  // default
+    MODE_UNIT,  // parse unit declarations in ASF files
+    MODE_DOC,   // parse documentation section in ASF files
+    MODE_ROOT,  // parse the root bone section in ASF files
+    MODE_BONES, // parse bone date in ASF files
+    MODE_BONE,  // parse a single bone's data in ASF files
+    MODE_TREE,  // parse the bone hierarchy information in ASF files
+    MODE_MOTION // parse a frame in AMC files
+};
+
+// the words of a line, see amc_select_tokenizer()
+#define AMC_MAX_TOKENS (CHANNEL_COUNT+1)
+struct amc_tokens {
+    unsigned count;                     // may be more than AMC_MAX_TOKENS, only the first are kept
+    char *words[AMC_MAX_TOKENS];        // each NUL-terminated in place
+    unsigned lengths[AMC_MAX_TOKENS];
+    uint32_t numeric;                   // bit i is set if word i has only digits, signs and decimal points
+};
+typedef unsigned (*tokenize_fn)(char *line, struct amc_tokens *tokens);
+
+// Tokenizers read a line 32 bytes at a time, so they may read up to this many
+// bytes past the NUL or newline that ends it. Every buffer of AMC lines given
+// to amc_parse_line() or amc_parse_lines() must have this much more allocated
+// after its terminating NUL, and it's zeroed so that nothing uninitialized is
+// read.
+#define AMC_TOKEN_PADDING 32
+
+// incremental AMC parsing state, see amc_parse_line()
+struct amc_parser {
+    struct amc_skeleton *skeleton;
+    struct amc_motion *motion;
+    struct amc_sample *current_sample;  // the frame currently being parsed
+    enum parsing_mode mode;
+    bool unit_degrees;
+    bool is_fully_specified;
+    bool verbose;
+    int line_num;
+    unsigned first_frame;   // the number of frames in the file before the first this parses, for tracing
+    unsigned last_joint;    // the joint given data by the last line, or AMC_NO_JOINT
+    tokenize_fn tokenize;   // splits frame lines into words
+};
+
+// frames assembled from AMC lines as they arrive, see live_frames_add_line()
+struct live_frames {
+    struct amc_parser parser;
+    unsigned animated_joints;   // joints with channels, which complete a frame once all are given data
+    unsigned frame;             // the number of frames begun
+    unsigned seen_count;        // joints given data in the pending frame
+    unsigned *seen;             // the last frame each joint was given data in
+    struct amc_sample *pending; // the frame being parsed
+    bool pending_done;          // whether the pending frame has been completed
+    double pending_started;     // when the pending frame began, in ms
+};
+
+enum output_format {
+    OUTPUT_BVH,
+    OUTPUT_NPY,
+    OUTPUT_GLB
+};
+
+struct watch_options {
+    char *directory;        // where AMC and ASF files are dropped
+    char *output_directory; // where BVH files are written
+    unsigned jobs;          // number of worker threads
+    unsigned settle_ms;     // how long a file must be unchanged before it's converted
+};
+
+struct batch_options {
+    char *asf_filename;
+    char *output_directory; // where BVH files are written
+    unsigned io_depth;      // the most I/O requests in flight at once, 0 for blocking I/O
+    struct manifest *manifest; // for skipping outputs that are up to date, or NULL
+    char *stamp;            // the manifest stamp of the conversion options
+    struct manifest_input *asf_input; // the ASF file's manifest snapshot
+    unsigned jobs;          // the number of threads converting, 0 for one per core
+};
+
+struct output_options {
+    bool raw;           // write the AMC channels as parsed (.npy only)
+    bool quaternions;   // write rotations as W X Y Z quaternions rather than Euler angles
+    enum sample_storage storage; // how parsed motion is kept in memory
+    char *joints;       // comma-separated joints to keep, or a preset name, NULL for all
+    char *exclude_joints; // comma-separated joints to drop, NULL for none
+    float scale;        // multiplies offsets and translations
+    char *up_axis;      // the output up axis (see parse_axis()), NULL for Y
+    char *forward_axis; // the output forward axis, NULL for Z
+    bool stats;         // also write per-channel statistics to a .stats.json sidecar
+    char *retarget;     // a target rig file to retarget the skeleton onto, NULL for none
 };
 
 // essentially the maximum line length
 #define BUFFSIZE 2048
 
-struct amc_skeleton *parse_asf_skeleton(FILE *asf, unsigned char max_child_count, bool verbose);
-struct amc_motion *parse_amc_motion(FILE *amc, struct amc_skeleton *skeleton, bool verbose);
-void write_bvh_skeleton(FILE *bvh, struct amc_skeleton *skeleton);
+// Frames are converted this many at a time into a block of rows small enough
+// to stay in cache, then written out. Tracing and the performance counters
+// record a span for each of these chunks.
+#define CONVERT_CHUNK_FRAMES 256
+
+struct motion_stats;
+
+enum output_format output_format_from_filename(char *filename);
+int convert_amc_file(struct amc_skeleton *skeleton,
+                     char *amc_filename,
+                     char *output_filename,
+                     enum output_format format,
+                     float fps,
+                     struct output_options *options,
+                     bool verbose,
+                     char **err_filename);
+int write_motion_file(struct amc_skeleton *skeleton,
+                      struct amc_motion *motion,
+                      char *output_filename,
+                      enum output_format format,
+                      float fps,
+                      struct output_options *options,
+                      bool verbose,
+                      char **err_filename);
+struct amc_skeleton *parse_asf_skeleton(FILE *asf, bool verbose);
+struct amc_motion *parse_amc_motion(FILE *amc, struct amc_skeleton *skeleton, enum sample_storage storage, bool verbose);
+struct amc_motion *parse_amc_buffer(char *data, size_t len, struct amc_skeleton *skeleton, enum sample_storage storage, bool verbose);
+void amc_parser_init(struct amc_parser *parser, struct amc_skeleton *skeleton, enum sample_storage storage, bool verbose);
+bool amc_parse_line(struct amc_parser *parser, char *line);
+void amc_parse_lines(struct amc_parser *parser, char *data, size_t len);
+tokenize_fn amc_select_tokenizer(const char **name);
+double parse_amc_number(const char *str, unsigned len, bool numeric);
+void write_bvh_skeleton(FILE *bvh, struct amc_skeleton *skeleton, struct output_options *options);
 void write_bvh_joint(FILE *bvh,
                      struct amc_skeleton *skeleton,
-                     struct amc_joint *joint,
+                     unsigned joint,
                      struct vec3 offset,
-                     int depth);
-void write_bvh_motion(FILE *bvh, struct amc_motion *motion, struct amc_skeleton *skeleton, float fps);
-void write_bvh_joint_sample(FILE *bvh, struct amc_joint *joint, struct amc_sample *sample);
+                     int depth,
+                     struct output_options *options);
+void write_bvh_motion(FILE *bvh, struct amc_motion *motion, struct amc_skeleton *skeleton, float fps, struct output_options *options, struct motion_stats *stats);
+void write_bvh_sample(FILE *bvh, struct amc_skeleton *skeleton, struct amc_sample *sample, struct output_options *options);
+void write_bvh_joint_sample(FILE *bvh, struct amc_skeleton *skeleton, unsigned joint, struct amc_sample *sample, struct output_options *options);
+unsigned compute_bvh_joint_sample(float *out, struct amc_skeleton *skeleton, unsigned joint, struct amc_sample *sample, struct output_options *options, struct quat *rotation);
+struct vec3 compute_joint_translation(struct amc_skeleton *skeleton, unsigned joint, struct amc_sample *sample);
+struct quat compute_joint_rotation(struct amc_skeleton *skeleton, unsigned joint, struct amc_sample *sample);
+unsigned bvh_joint_channels(const char **names, struct amc_skeleton *skeleton, unsigned joint, struct output_options *options);
+unsigned bvh_channel_count(struct amc_skeleton *skeleton, struct output_options *options);
+const char *rotation_units(struct output_options *options);
+void write_npy_motion(FILE *npy, struct amc_motion *motion, struct amc_skeleton *skeleton, struct output_options *options, struct motion_stats *stats);
+unsigned compute_motion_row(float *row, struct amc_skeleton *skeleton, struct amc_sample *sample, struct output_options *options, struct quat *rotations);
+unsigned motion_row_channels(const char **names, struct amc_skeleton *skeleton, unsigned joint, struct output_options *options);
+const char *amc_channel_name(enum channel channel);
+void write_npy_columns(FILE *json, struct amc_motion *motion, struct amc_skeleton *skeleton, float fps, struct output_options *options);
+void write_glb(FILE *glb, struct amc_motion *motion, struct amc_skeleton *skeleton, float fps);
+void live_frames_init(struct live_frames *frames, struct amc_skeleton *skeleton, enum sample_storage storage, bool verbose);
+void live_frames_free(struct live_frames *frames);
+struct amc_sample *live_frames_add_line(struct live_frames *frames, char *line, double now, double *started);
+struct amc_sample *live_frames_finish(struct live_frames *frames, double *started);
+unsigned follow_amc_motion(FILE *amc, FILE *bvh, struct amc_skeleton *skeleton, float fps, struct output_options *options, float timeout, bool verbose);
+bool parse_listen_address(char *str, bool *udp, unsigned *port);
+int stream_amc_motion(bool udp, unsigned port, struct amc_skeleton *skeleton, float fps, struct output_options *options, bool verbose);
+int watch_directory(struct watch_options *watch, float fps, struct output_options *options, bool verbose);
+int scan_library(char **paths, unsigned path_count, char *output_filename, unsigned jobs, float fps, bool verbose);
+int convert_amc_batch(struct amc_skeleton *skeleton,
+                      char **amc_filenames,
+                      unsigned count,
+                      struct batch_options *batch,
+                      float fps,
+                      struct output_options *options,
+                      bool verbose);
+char *batch_output_filename(char *output_directory, char *amc_filename);
+
+bool is_compressed_input(char *filename);
+FILE *open_input(char *filename);
+int convert_zip_archive(char *zip_filename, char *output_directory, float fps, struct output_options *options, bool verbose);
 
-struct quat parse_joint_rotation(char *str, bool degrees, struct amc_joint *joint, int line_num);
-void parse_amc_joint_animation_channels(struct amc_joint *joint, struct amc_sample *sample, bool degrees, char *str, int line_num);
+struct sched;
+unsigned sched_default_workers(void);
+struct sched *sched_new(unsigned workers);
+unsigned sched_worker_count(struct sched *s);
+void sched_submit(struct sched *s, void (*run)(void *arg), void *arg);
+void sched_wait(struct sched *s);
+void sched_free(struct sched *s);
+
+struct io_engine;
+struct io_request;
+struct io_output {
+    FILE *f;            // write the output here
+    char *filename;
+    char *data;         // the output, when it's buffered in memory
+    size_t len;
+    bool *failed;       // set if the write fails, or NULL
+};
+struct io_engine *io_engine_new(unsigned depth);
+bool io_engine_uses_uring(struct io_engine *engine);
+unsigned io_engine_finish(struct io_engine *engine);
+struct io_request *io_read_submit(struct io_engine *engine, char *filename);
+char *io_read_wait(struct io_engine *engine, struct io_request *req, size_t *len);
+struct io_output *io_output_open(struct io_engine *engine, char *filename, bool *failed);
+void io_output_close(struct io_engine *engine, struct io_output *out);
+
+struct motion_pack;
+int write_pack(char *pack_filename, char **inputs, unsigned input_count, struct output_options *options, bool verbose);
+struct motion_pack *pack_open(char *filename);
+void pack_close(struct motion_pack *pack);
+void pack_list(struct motion_pack *pack, FILE *out);
+int pack_find_clip(struct motion_pack *pack, char *name);
+struct amc_skeleton *pack_read_skeleton(struct motion_pack *pack, int clip);
+struct amc_motion *pack_read_motion(struct motion_pack *pack, int clip, struct amc_skeleton *skeleton, unsigned first, unsigned end);
+
+struct target_rig;
+struct target_rig *target_rig_load(char *filename);
+void target_rig_free(struct target_rig *rig);
+char *target_rig_sources(struct target_rig *rig);
+void target_rig_check(struct target_rig *rig, struct amc_skeleton *skeleton);
+void amc_skeleton_retarget(struct amc_skeleton *skeleton, struct target_rig *rig, bool verbose);
+
+struct motion_stats *motion_stats_new(unsigned channels, unsigned joints);
+void motion_stats_free(struct motion_stats *stats);
+void motion_stats_add(struct motion_stats *stats, const float *rows, const struct quat *rotations, unsigned frames);
+void write_motion_stats(FILE *json, struct motion_stats *stats, struct amc_skeleton *skeleton, float fps, struct output_options *options);
+char *stats_filename(char *output_filename);
+
+struct manifest;
+struct manifest_input {
+    char *filename;
+    long long size;
+    long long mtime;        // in nanoseconds
+    uint64_t hash;
+};
+struct manifest *manifest_load(char *filename);
+void manifest_free(struct manifest *manifest);
+void manifest_stamp(char *stamp, size_t len, float fps, struct output_options *options);
+bool manifest_is_up_to_date(struct manifest *manifest, char *output_filename, char *stamp, char *asf_filename, char *amc_filename);
+bool manifest_snapshot(char *filename, struct manifest_input *input);
+void manifest_record(struct manifest *manifest, char *output_filename, char *stamp, struct manifest_input *asf, struct manifest_input *amc);
+int manifest_save(struct manifest *manifest, char *filename);
+
+struct quat parse_joint_rotation(char *str, bool degrees, int line_num);
+void parse_amc_joint_animation_channels(struct amc_skeleton *skeleton, struct amc_motion *motion, unsigned joint, struct amc_sample *sample, bool degrees, struct amc_tokens *tokens, int line_num);
 void parse_channel_order(enum channel *channels, char *str, bool verbose, int line_num);
 struct vec3 parse_vec3(char *str, int line_num);
 
-struct amc_skeleton *amc_skeleton_new(unsigned char max_child_count);
+struct amc_skeleton *amc_skeleton_new(void);
 void amc_skeleton_free(struct amc_skeleton *skeleton);
-struct amc_joint *amc_joint_new(unsigned char max_child_count);
-bool amc_joint_has_translation(struct amc_joint *joint);
-void amc_joint_free(struct amc_joint *joint);
-struct amc_motion *amc_motion_new(unsigned total_channels);
+unsigned amc_skeleton_add_joint(struct amc_skeleton *skeleton, char *name);
+void amc_skeleton_build_tree(struct amc_skeleton *skeleton, unsigned *edges, unsigned edge_count, bool verbose);
+void amc_skeleton_select_joints(struct amc_skeleton *skeleton, char *joints, char *exclude_joints, bool verbose);
+void amc_skeleton_set_convention(struct amc_skeleton *skeleton, float scale, struct vec3 up, struct vec3 forward);
+const char *validate_convention(struct output_options *options);
+void amc_skeleton_apply_options(struct amc_skeleton *skeleton, struct output_options *options, bool verbose);
+bool parse_axis(char *str, struct vec3 *axis);
+struct vec3 amc_joint_offset(struct amc_skeleton *skeleton, unsigned joint);
+struct vec3 amc_joint_end_offset(struct amc_skeleton *skeleton, unsigned joint);
+bool amc_joint_has_translation(struct amc_skeleton *skeleton, unsigned joint);
+struct amc_motion *amc_motion_new(unsigned total_channels, enum sample_storage storage);
 void amc_motion_free(struct amc_motion *motion);
-struct amc_sample *amc_sample_new(unsigned total_channels);
-unsigned compute_amc_joint_indices(struct amc_joint *joint, unsigned offset);
+struct amc_sample *amc_sample_new(unsigned total_channels, enum sample_storage storage);
+void amc_sample_get_channels(float *vals, struct amc_skeleton *skeleton, unsigned joint, struct amc_sample *sample);
+void amc_sample_set_channels(struct amc_motion *motion, struct amc_skeleton *skeleton, unsigned joint, struct amc_sample *sample, const float *vals);
+bool parse_sample_storage(char *str, enum sample_storage *storage);
+const char *sample_storage_name(enum sample_storage storage);
+unsigned amc_channel_count(struct amc_skeleton *skeleton);
+unsigned compute_amc_joint_indices(struct amc_skeleton *skeleton);
+void compute_rotation_kernels(struct amc_skeleton *skeleton);
 
-#define FAIL(...) do {                                                         \
-    fprintf(stderr, "Error: " __VA_ARGS__);                                    \
-    exit(1);                                                                   \
-} while(0)
+// Reports an error and exits, unless the current thread has installed a
+// handler in `fail_handler`, in which case the message is saved in
+// `fail_message` and control returns to the handler's setjmp(). Anything
+// allocated by the failed operation is leaked.
+#define FAIL(...) fail(__VA_ARGS__)
+
+extern _Thread_local jmp_buf *fail_handler;
+extern _Thread_local char fail_message[BUFFSIZE];
+_Noreturn void fail(const char *fmt, ...);
+
+// Tracing (see trace.c). TRACE_BEGIN() starts a span, and TRACE_END() records
+// it with a name (a string literal) and the range of frames it covered, or -1
+// for none. Parsing and conversion have a span per CONVERT_CHUNK_FRAMES
+// frames. Building with -DAMC2BVH_NO_TRACE compiles them out.
+#ifdef AMC2BVH_NO_TRACE
+#define trace_enabled false
+#else
+extern bool trace_enabled;
+#endif
+
+#define TRACE_BEGIN(span) double span = trace_enabled ? trace_now() : 0
+#define TRACE_END(span, name, first_frame, last_frame) do {                    \
+    if (trace_enabled) trace_event(name, span, first_frame, last_frame);       \
+} while (0)
+
+bool trace_open(char *filename);
+int trace_close(void);
+double trace_now(void);
+void trace_event(const char *name, double start, long first_frame, long last_frame);
+
+// Performance counters (see perf.c). PERF_BEGIN() starts a span of a phase,
+// and PERF_END() adds it to the phase's totals along with the frames and bytes
+// it handled. Like tracing, they cost a single branch when they're off.
+enum perf_phase { PERF_ASF_PARSE, PERF_AMC_PARSE, PERF_CONVERT, PERF_WRITE, PERF_PHASE_COUNT };
+enum perf_counter { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_BRANCH_MISSES, PERF_CACHE_MISSES, PERF_PAGE_FAULTS, PERF_COUNTER_COUNT };
+
+struct perf_sample {
+    double ms;
+    uint64_t enabled, running;  // nanoseconds the counters were enabled and actually counting
+    uint64_t values[PERF_COUNTER_COUNT];
+};
+
+extern bool perf_enabled;
+
+#define PERF_BEGIN(sample) struct perf_sample sample = perf_enabled ? perf_now() : (struct perf_sample) { 0 }
+#define PERF_END(sample, phase, frames, bytes) do {                            \
+    if (perf_enabled) perf_add(phase, &sample, frames, bytes);                 \
+} while (0)
+
+bool perf_open(void);
+void perf_close(void);
+struct perf_sample perf_now(void);
+void perf_add(enum perf_phase phase, struct perf_sample *start, uint64_t frames, uint64_t bytes);
+void perf_report(FILE *f);
+uint64_t perf_file_bytes(FILE *f);
 
 #define fprintf_indent(indent, f, ...) do {                                    \
     for (int ind = 0; ind < indent; ind++) fprintf(f, "\t");                   \
@@ -110,28 +429,47 @@ unsigned compute_amc_joint_indices(struct amc_joint *joint, unsigned offset);
 void *xmalloc(size_t size);
 void *xcalloc(size_t num, size_t size);
 void *xrealloc(void *mem, size_t size);
+char *xstrdup(const char *str);
 char *readline(char *str, int n, FILE *f);
 char *trim(char *str);
 char *bifurcate(char *str, char delim);
+double now_ms(void);
+double percentile(double *vals, size_t count, double p);
+uint16_t float_to_half(float val);
+float half_to_float(uint16_t half);
+void fwrite_le_u32(FILE *f, uint32_t val);
+void fwrite_le_f32(FILE *f, const float *vals, size_t count);
+void fprint_json_string(FILE *f, const char *str);
 bool streq(char *str, char *str2);
 bool starts_with(char *str, char *pref);
 bool ends_with(char *str, char *suff);
+bool is_input_type(char *filename, char *ext);
+char *file_stem(const char *filename);
+char *asf_stem_for_amc(const char *amc_stem, unsigned choice);
+
+struct jointmap_entry {
+    char *name;     // the joint name, owned by the map
+    unsigned index; // the joint's index in the skeleton, or AMC_NO_JOINT
+};
 
 struct hashmap *jointmap_new(void);
 void jointmap_free(struct hashmap *map);
 void jointmap_free_item(void *item);
-struct amc_joint *jointmap_get(struct hashmap *map, char *name);
-void jointmap_set(struct hashmap *map, struct amc_joint *joint);
+struct jointmap_entry *jointmap_get(struct hashmap *map, char *name);
+void jointmap_set(struct hashmap *map, char *name, unsigned index);
 int jointmap_cmp(const void *a, const void *b, void *data);
 uint64_t jointmap_hash(const void *item, uint64_t seed0, uint64_t seed1);
 
 struct vec3 vec3_scale(struct vec3 v, float s);
 struct vec3 vec3_normalize(struct vec3 v);
 float vec3_length(struct vec3 v);
+struct vec3 vec3_cross(struct vec3 a, struct vec3 b);
 
 struct quat angle_axis_to_quat(float angle, struct vec3 axis);
 struct quat quat_mul(struct quat a, struct quat b);
 struct quat quat_conj(struct quat q);
 struct quat quat_inv(struct quat q);
+struct vec3 quat_rotate(struct quat q, struct vec3 v);
+struct quat basis_to_quat(struct vec3 x, struct vec3 y, struct vec3 z);
 struct quat euler_to_quat(struct euler_triple e);
 struct euler_triple quat_to_euler_xyz(struct quat q);
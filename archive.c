@@ -0,0 +1,591 @@
+// Reading inputs straight from compressed archives, so a corpus distributed as
+// zip files doesn't have to be extracted first. An input may be gzipped
+// (01_01.amc.gz), or a member of a zip archive (subjects.zip:01/01_01.amc),
+// and every AMC file in a zip archive can be converted with the archive
+// opened only once.
+//
+// Each input is inflated on its own thread into a ring buffer, which the
+// parser reads through an ordinary FILE, so decompression overlaps with
+// parsing. Zip members are read from the archive with pread(), so several can
+// share one open archive.
+//
+// This relies on zlib, POSIX threads and fopencookie(), so it's only
+// available on Linux.
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include "amc2bvh.h"
+
+bool is_compressed_input(char *filename) {
+    // a gzipped file, or ARCHIVE.zip:MEMBER
+    return ends_with(filename, ".gz") || ends_with(filename, ".GZ") || strstr(filename, ".zip:") || strstr(filename, ".ZIP:");
+}
+
+#if defined(__linux__) && !defined(AMC2BVH_NO_ZLIB)
+
+#include <zlib.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// the decompressed data waiting to be parsed
+#define INFLATE_RING_SIZE (1 << 20)
+
+// how much compressed data is read at once
+#define INFLATE_CHUNK_SIZE (1 << 16)
+
+#define ZIP_LOCAL_HEADER 0x04034b50
+#define ZIP_CENTRAL_HEADER 0x02014b50
+#define ZIP_END_RECORD 0x06054b50
+#define ZIP64_END_RECORD 0x06064b50
+#define ZIP64_END_LOCATOR 0x07064b50
+#define ZIP_STORED 0
+#define ZIP_DEFLATED 8
+
+struct zip_member {
+    char *name;
+    uint64_t header_offset;     // where the member's local header is
+    uint64_t compressed_size;
+    uint64_t size;
+    uint32_t crc;
+    uint16_t method;
+    uint16_t flags;
+};
+
+struct zip_archive {
+    char *filename;
+    int fd;
+    unsigned member_count;
+    struct zip_member *members;
+};
+
+struct inflate_stream {
+    int fd;
+    uint64_t offset;            // the compressed data still to be read
+    uint64_t remaining;
+    bool gzip;                  // whether the data has a gzip wrapper, rather than being a zip member
+    uint16_t method;
+    uint32_t crc;               // what the data should check out to, for zip members
+    uint64_t size;
+    bool owns_fd;
+    struct zip_archive *owned_zip; // closed along with the stream, or NULL
+
+    pthread_t thread;
+    bool started;               // whether the thread was created
+    pthread_mutex_t lock;       // protects everything below
+    pthread_cond_t changed;
+    unsigned char *ring;
+    uint64_t produced;          // bytes written to the ring so far
+    uint64_t consumed;          // bytes read from the ring so far
+    bool done;
+    bool cancelled;             // the stream was closed before the end
+    int error;                  // errno, if decompression failed
+};
+
+static uint16_t le16(const unsigned char *p) {
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t le32(const unsigned char *p) {
+    return (uint32_t) le16(p) | (uint32_t) le16(p+2) << 16;
+}
+
+static uint64_t le64(const unsigned char *p) {
+    return (uint64_t) le32(p) | (uint64_t) le32(p+4) << 32;
+}
+
+static bool read_exactly(int fd, void *buf, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return false;
+        }
+        buf = (char *) buf + n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+/*
+  DECOMPRESSION
+*/
+
+static void *inflate_thread(void *arg) {
+    struct inflate_stream *s = arg;
+    unsigned char *in = malloc(INFLATE_CHUNK_SIZE);
+    z_stream z = { .zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL, .next_in = Z_NULL, .avail_in = 0 };
+    bool inflating = s->method == ZIP_DEFLATED,
+         finished = false;
+    int err = in ? 0 : ENOMEM;
+    if (!err && inflating && inflateInit2(&z, s->gzip ? 16+MAX_WBITS : -MAX_WBITS) != Z_OK) err = ENOMEM;
+    uint32_t crc = crc32(0, Z_NULL, 0);
+    uint64_t size = 0;
+
+    while (!err && !finished) {
+        if (z.avail_in == 0 && s->remaining > 0) {
+            size_t len = s->remaining < INFLATE_CHUNK_SIZE ? s->remaining : INFLATE_CHUNK_SIZE;
+            if (!read_exactly(s->fd, in, len, s->offset)) {
+                err = errno;
+                break;
+            }
+            s->offset += len;
+            s->remaining -= len;
+            z.next_in = in;
+            z.avail_in = len;
+        }
+
+        // wait for room in the ring, and fill as much of it as is contiguous
+        pthread_mutex_lock(&s->lock);
+        while (!s->cancelled && s->produced - s->consumed == INFLATE_RING_SIZE) pthread_cond_wait(&s->changed, &s->lock);
+        bool cancelled = s->cancelled;
+        size_t start = s->produced % INFLATE_RING_SIZE,
+               space = INFLATE_RING_SIZE - (s->produced - s->consumed);
+        pthread_mutex_unlock(&s->lock);
+        if (cancelled) break;
+        if (space > INFLATE_RING_SIZE - start) space = INFLATE_RING_SIZE - start;
+
+        unsigned char *out = s->ring + start;
+        size_t made;
+        if (!inflating) {
+            made = z.avail_in < space ? z.avail_in : space;
+            memcpy(out, z.next_in, made);
+            z.next_in += made;
+            z.avail_in -= made;
+            finished = z.avail_in == 0 && s->remaining == 0;
+        } else {
+            z.next_out = out;
+            z.avail_out = space;
+            int ret = inflate(&z, Z_NO_FLUSH);
+            made = space - z.avail_out;
+            if (ret == Z_STREAM_END) {
+                // gzip files may be several gzip streams one after another
+                if (s->gzip && (z.avail_in > 0 || s->remaining > 0)) inflateReset(&z);
+                else finished = true;
+            } else if (ret == Z_BUF_ERROR && z.avail_in == 0 && s->remaining == 0) {
+                err = EIO; // truncated
+            } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                err = ret == Z_MEM_ERROR ? ENOMEM : EIO;
+            }
+        }
+        if (!s->gzip) crc = crc32(crc, out, made);
+        size += made;
+
+        pthread_mutex_lock(&s->lock);
+        s->produced += made;
+        pthread_cond_broadcast(&s->changed);
+        pthread_mutex_unlock(&s->lock);
+    }
+    if (finished && !s->gzip && (crc != s->crc || size != s->size)) err = EIO;
+
+    if (inflating) inflateEnd(&z);
+    free(in);
+    pthread_mutex_lock(&s->lock);
+    s->done = true;
+    s->error = err;
+    pthread_cond_broadcast(&s->changed);
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+static ssize_t inflate_stream_read(void *cookie, char *buf, size_t len) {
+    struct inflate_stream *s = cookie;
+    pthread_mutex_lock(&s->lock);
+    while (s->produced == s->consumed && !s->done) pthread_cond_wait(&s->changed, &s->lock);
+    if (s->produced == s->consumed) {
+        int err = s->error;
+        pthread_mutex_unlock(&s->lock);
+        if (!err) return 0;
+        errno = err;
+        return -1;
+    }
+    size_t start = s->consumed % INFLATE_RING_SIZE,
+           available = s->produced - s->consumed;
+    pthread_mutex_unlock(&s->lock);
+
+    if (len > available) len = available;
+    if (len > INFLATE_RING_SIZE - start) len = INFLATE_RING_SIZE - start;
+    memcpy(buf, s->ring + start, len);
+
+    pthread_mutex_lock(&s->lock);
+    s->consumed += len;
+    pthread_cond_broadcast(&s->changed);
+    pthread_mutex_unlock(&s->lock);
+    return len;
+}
+
+static void zip_archive_close(struct zip_archive *zip);
+
+static int inflate_stream_close(void *cookie) {
+    struct inflate_stream *s = cookie;
+    pthread_mutex_lock(&s->lock);
+    s->cancelled = true;
+    pthread_cond_broadcast(&s->changed);
+    pthread_mutex_unlock(&s->lock);
+    if (s->started) pthread_join(s->thread, NULL);
+
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->changed);
+    if (s->owns_fd) close(s->fd);
+    if (s->owned_zip) zip_archive_close(s->owned_zip);
+    free(s->ring);
+    free(s);
+    return 0;
+}
+
+static FILE *inflate_stream_open(struct inflate_stream *init) {
+    // starts inflating on a new thread, returning the stream to read from
+    struct inflate_stream *s = xmalloc(sizeof(*s));
+    *s = *init;
+    s->ring = xmalloc(INFLATE_RING_SIZE);
+    s->produced = s->consumed = 0;
+    s->done = s->cancelled = false;
+    s->started = false;
+    s->error = 0;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->changed, NULL);
+
+    // closing the stream releases everything, even if the thread never started
+    cookie_io_functions_t functions = { .read = inflate_stream_read, .write = NULL, .seek = NULL, .close = inflate_stream_close };
+    FILE *f = fopencookie(s, "r", functions);
+    if (!f) {
+        inflate_stream_close(s);
+        FAIL("Unable to start decompressing\n");
+    } else if (pthread_create(&s->thread, NULL, inflate_thread, s)) {
+        fclose(f);
+        FAIL("Unable to start decompressing\n");
+    }
+    s->started = true;
+    return f;
+}
+
+/*
+  ZIP ARCHIVES
+*/
+
+static _Noreturn void zip_archive_fail(char *filename, bool owns_filename, const char *problem) {
+    char message[BUFFSIZE];
+    snprintf(message, sizeof(message), "'%s' %s", filename, problem);
+    if (owns_filename) free(filename);
+    FAIL("%s\n", message);
+}
+
+static struct zip_archive *zip_archive_open(char *filename, bool owns_filename) {
+    // Reads the archive's directory. Returns NULL with errno set if the file
+    // can't be opened, and fails if it isn't a zip archive, after freeing
+    // everything, including the filename if it's owned.
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st)) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+
+    // the end record is last, followed by a comment of up to 64 KB
+    uint64_t file_size = st.st_size,
+             tail_len = file_size < 65557 ? file_size : 65557;
+    unsigned char *tail = xmalloc(tail_len ? tail_len : 1);
+    if (!read_exactly(fd, tail, tail_len, file_size - tail_len)) tail_len = 0;
+    long end = -1;
+    for (long i = (long) tail_len - 22; i >= 0; i--) {
+        if (le32(tail+i) == ZIP_END_RECORD) {
+            end = i;
+            break;
+        }
+    }
+    if (end < 0) {
+        free(tail);
+        close(fd);
+        zip_archive_fail(filename, owns_filename, "is not a zip archive");
+    }
+    uint64_t count = le16(tail+end+10),
+             directory_len = le32(tail+end+12),
+             directory_offset = le32(tail+end+16);
+
+    // archives over 4 GB, or with over 65535 members, keep these in a ZIP64 record
+    if (end >= 20 && le32(tail+end-20) == ZIP64_END_LOCATOR) {
+        unsigned char record[56];
+        if (read_exactly(fd, record, sizeof(record), le64(tail+end-20+8)) && le32(record) == ZIP64_END_RECORD) {
+            count = le64(record+32);
+            directory_len = le64(record+40);
+            directory_offset = le64(record+48);
+        }
+    }
+    free(tail);
+
+    unsigned char *directory = xmalloc(directory_len ? directory_len : 1);
+    if (directory_offset + directory_len > file_size || !read_exactly(fd, directory, directory_len, directory_offset)) {
+        free(directory);
+        close(fd);
+        zip_archive_fail(filename, owns_filename, "is not a valid zip archive");
+    }
+
+    struct zip_archive *zip = xmalloc(sizeof(*zip));
+    zip->filename = filename;
+    zip->fd = fd;
+    zip->member_count = 0;
+    zip->members = xmalloc(sizeof(*zip->members)*(count ? count : 1));
+    bool valid = true;
+    for (uint64_t i = 0, pos = 0; i < count; i++) {
+        unsigned char *header = directory+pos;
+        if (pos + 46 > directory_len || le32(header) != ZIP_CENTRAL_HEADER) {
+            valid = false;
+            break;
+        }
+        unsigned name_len = le16(header+28),
+                 extra_len = le16(header+30),
+                 comment_len = le16(header+32);
+        if (pos + 46 + name_len + extra_len + comment_len > directory_len) {
+            valid = false;
+            break;
+        }
+
+        struct zip_member *member = &zip->members[zip->member_count++];
+        member->flags = le16(header+8);
+        member->method = le16(header+10);
+        member->crc = le32(header+16);
+        member->compressed_size = le32(header+20);
+        member->size = le32(header+24);
+        member->header_offset = le32(header+42);
+        member->name = xmalloc(name_len+1);
+        memcpy(member->name, header+46, name_len);
+        member->name[name_len] = '\0';
+
+        // sizes and offsets too large for the header are in a ZIP64 extra field
+        unsigned char *extra = header+46+name_len, *extra_end = extra+extra_len;
+        while (extra+4 <= extra_end) {
+            unsigned id = le16(extra), len = le16(extra+2);
+            unsigned char *field = extra+4;
+            if (id == 1) {
+                if (member->size == 0xFFFFFFFF && field+8 <= extra+4+len) member->size = le64(field), field += 8;
+                if (member->compressed_size == 0xFFFFFFFF && field+8 <= extra+4+len) member->compressed_size = le64(field), field += 8;
+                if (member->header_offset == 0xFFFFFFFF && field+8 <= extra+4+len) member->header_offset = le64(field);
+            }
+            extra += 4+len;
+        }
+        pos += 46 + name_len + extra_len + comment_len;
+    }
+    free(directory);
+    if (!valid) {
+        zip_archive_close(zip);
+        zip_archive_fail(filename, owns_filename, "is not a valid zip archive");
+    }
+    return zip;
+}
+
+static void zip_archive_close(struct zip_archive *zip) {
+    close(zip->fd);
+    for (unsigned i = 0; i < zip->member_count; i++) free(zip->members[i].name);
+    free(zip->members);
+    free(zip);
+}
+
+static int zip_find_member(struct zip_archive *zip, char *name) {
+    for (unsigned i = 0; i < zip->member_count; i++) {
+        if (streq(zip->members[i].name, name)) return i;
+    }
+    return -1;
+}
+
+static FILE *zip_open_member(struct zip_archive *zip, unsigned index, bool owns_zip) {
+    // the archive is closed before failing if the stream would have owned it
+    struct zip_member *member = &zip->members[index];
+    unsigned char header[30];
+    const char *problem = NULL;
+    if (!read_exactly(zip->fd, header, sizeof(header), member->header_offset) || le32(header) != ZIP_LOCAL_HEADER) {
+        problem = "is damaged";
+    } else if (member->flags & 1) {
+        problem = "is encrypted";
+    } else if (member->method != ZIP_STORED && member->method != ZIP_DEFLATED) {
+        problem = "uses an unsupported compression method";
+    }
+    if (problem) {
+        char message[BUFFSIZE];
+        snprintf(message, sizeof(message), "'%s' in '%s' %s", member->name, zip->filename, problem);
+        if (owns_zip) zip_archive_close(zip);
+        FAIL("%s\n", message);
+    }
+    struct inflate_stream init = {
+        .fd = zip->fd,
+        .offset = member->header_offset + 30 + le16(header+26) + le16(header+28),
+        .remaining = member->compressed_size,
+        .gzip = false,
+        .method = member->method,
+        .crc = member->crc,
+        .size = member->size,
+        .owns_fd = false,
+        .owned_zip = owns_zip ? zip : NULL
+    };
+    return inflate_stream_open(&init);
+}
+
+/*
+  INPUTS
+*/
+
+FILE *open_input(char *filename) {
+    // Opens an input file for reading, decompressing it if it's gzipped or
+    // a zip archive member. Returns NULL with errno set if it can't be opened.
+    char *member = strstr(filename, ".zip:");
+    if (!member) member = strstr(filename, ".ZIP:");
+    if (member) {
+        size_t archive_len = member+4 - filename;
+        char *archive_filename = xmalloc(archive_len+1);
+        memcpy(archive_filename, filename, archive_len);
+        archive_filename[archive_len] = '\0';
+        struct zip_archive *zip = zip_archive_open(archive_filename, true);
+        if (!zip) {
+            int err = errno;
+            free(archive_filename);
+            errno = err;
+            return NULL;
+        }
+        zip->filename = filename; // the archive's name is only needed for errors
+        int index = zip_find_member(zip, member+5);
+        free(archive_filename);
+        if (index < 0) {
+            zip_archive_close(zip);
+            errno = ENOENT;
+            return NULL;
+        }
+        return zip_open_member(zip, index, true);
+    }
+
+    if (!ends_with(filename, ".gz") && !ends_with(filename, ".GZ")) return fopen(filename, "r");
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st)) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    struct inflate_stream init = {
+        .fd = fd,
+        .offset = 0,
+        .remaining = st.st_size,
+        .gzip = true,
+        .method = ZIP_DEFLATED,
+        .owns_fd = true,
+        .owned_zip = NULL
+    };
+    return inflate_stream_open(&init);
+}
+
+static int find_asf_member(struct zip_archive *zip, char *amc_name) {
+    // the ASF file in the same directory that asf_stem_for_amc() pairs it with
+    char *base = strrchr(amc_name, '/');
+    size_t dir_len = base ? (size_t) (base+1 - amc_name) : 0;
+    char *amc_stem = file_stem(amc_name), *stem;
+    int found = -1;
+    for (unsigned choice = 0; found < 0 && (stem = asf_stem_for_amc(amc_stem, choice)); choice++) {
+        for (unsigned i = 0; found < 0 && i < zip->member_count; i++) {
+            char *name = zip->members[i].name;
+            if (strncmp(name, amc_name, dir_len) || strchr(name+dir_len, '/') || !is_input_type(name, ".asf")) continue;
+            char *asf_stem = file_stem(name);
+            if (streq(asf_stem, stem)) found = i;
+            free(asf_stem);
+        }
+        free(stem);
+    }
+    free(amc_stem);
+    return found;
+}
+
+int convert_zip_archive(char *zip_filename, char *output_directory, float fps, struct output_options *options, bool verbose) {
+    // Converts every AMC file in the archive to a BVH file of the same name in
+    // the output directory. The skeletons are parsed once each, as they're
+    // needed. Returns nonzero if any file failed, after reporting it.
+    struct zip_archive *zip = zip_archive_open(zip_filename, false);
+    if (!zip) {
+        fprintf(stderr, "Error: cannot access '%s': %s\n", zip_filename, strerror(errno));
+        return 1;
+    }
+    struct amc_skeleton **skeletons = xcalloc(zip->member_count ? zip->member_count : 1, sizeof(*skeletons));
+    bool *skeleton_failed = xcalloc(zip->member_count ? zip->member_count : 1, sizeof(*skeleton_failed));
+    unsigned converted = 0, failed = 0;
+
+    for (unsigned i = 0; i < zip->member_count; i++) {
+        char *name = zip->members[i].name;
+        if (!is_input_type(name, ".amc") || strstr(name, "__MACOSX/")) continue;
+        int asf = find_asf_member(zip, name);
+        if (asf < 0 || skeleton_failed[asf]) {
+            fprintf(stderr, "Error: %s: %s\n", name, asf < 0 ? "no ASF file for it in the archive" : "its ASF file couldn't be parsed");
+            failed++;
+            continue;
+        }
+
+        // FAIL() returns here, so one bad file doesn't stop the rest
+        FILE *volatile input = NULL;
+        jmp_buf handler;
+        if (setjmp(handler)) {
+            fail_handler = NULL;
+            if (input) fclose(input);
+            if (!skeletons[asf]) skeleton_failed[asf] = true;
+            fprintf(stderr, "Error: %s: %s\n", skeletons[asf] ? name : zip->members[asf].name, fail_message);
+            failed++;
+            continue;
+        }
+        fail_handler = &handler;
+        if (!skeletons[asf]) {
+            input = zip_open_member(zip, asf, false);
+            struct amc_skeleton *skeleton = parse_asf_skeleton(input, verbose);
+            fclose(input);
+            input = NULL;
+            amc_skeleton_apply_options(skeleton, options, verbose);
+            skeletons[asf] = skeleton;
+            if (verbose) printf("Successfully parsed ASF skeleton from %s\n", zip->members[asf].name);
+        }
+        input = zip_open_member(zip, i, false);
+        struct amc_motion *motion = parse_amc_motion(input, skeletons[asf], options->storage, verbose);
+        fclose(input);
+        input = NULL;
+        fail_handler = NULL;
+
+        char *output_filename = batch_output_filename(output_directory, name),
+             *err_filename;
+        if (write_motion_file(skeletons[asf], motion, output_filename, OUTPUT_BVH, fps, options, false, &err_filename)) {
+            fprintf(stderr, "Error: cannot access '%s': %s\n", err_filename, strerror(errno));
+            failed++;
+        } else {
+            if (verbose) printf("Converted %s to %s (%u frames)\n", name, output_filename, motion->sample_count);
+            converted++;
+        }
+        free(output_filename);
+        amc_motion_free(motion);
+    }
+    printf("Converted %u files from %s, %u failed\n", converted, zip_filename, failed);
+
+    for (unsigned i = 0; i < zip->member_count; i++) {
+        if (skeletons[i]) amc_skeleton_free(skeletons[i]);
+    }
+    free(skeletons);
+    free(skeleton_failed);
+    zip_archive_close(zip);
+    return failed > 0;
+}
+
+#else
+
+FILE *open_input(char *filename) {
+    if (is_compressed_input(filename)) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+    return fopen(filename, "r");
+}
+
+int convert_zip_archive(char *zip_filename, char *output_directory, float fps, struct output_options *options, bool verbose) {
+    fprintf(stderr, "Error: reading zip archives is only supported on Linux, with zlib\n");
+    return 1;
+}
+
+#endif
@@ -0,0 +1,488 @@
+// Batch conversion of many AMC files that share a skeleton. Each file is
+// converted to a BVH file of the same name in the output directory. Reads of
+// the next few files and writes of finished ones go through the batch I/O
+// engine on the calling thread, so conversion overlaps with waiting on
+// storage.
+//
+// The conversion itself runs on the work-stealing scheduler (see sched.c). A
+// small file is a single task, but a large one is cut at frame lines into
+// chunks that are parsed and converted as separate tasks, each into its own
+// buffer, and written out in order. So with a mix of short and long takes,
+// every core stays busy until the end, instead of waiting on the longest.
+
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include "amc2bvh.h"
+
+char *batch_output_filename(char *output_directory, char *amc_filename) {
+    // output_directory/stem.bvh, for the AMC file's file_stem()
+    char *stem = file_stem(amc_filename);
+    size_t stem_len = strlen(stem),
+           dir_len = strlen(output_directory);
+    char *path = xmalloc(dir_len + 1 + stem_len + 5);
+    memcpy(path, output_directory, dir_len);
+    path[dir_len] = '/';
+    memcpy(path+dir_len+1, stem, stem_len);
+    strcpy(path+dir_len+1+stem_len, ".bvh");
+    free(stem);
+    return path;
+}
+
+static struct io_request *submit_read(struct io_engine *engine, char *amc_filename) {
+    // compressed files are decompressed as they're parsed instead
+    return is_compressed_input(amc_filename) ? NULL : io_read_submit(engine, amc_filename);
+}
+
+// AMC text per task when a large file is split, about a thousand CMU frames
+#define BATCH_CHUNK_BYTES (1 << 19)
+
+struct text_buffer {
+    char *data;
+    size_t len, cap;
+};
+
+struct batch_chunk {
+    struct batch_clip *clip;
+    char *lines;                // this chunk's AMC lines, NUL-terminated
+    size_t len;
+    int line_num;               // of the line before the first
+    unsigned first_frame;       // the number of frames in the file before this chunk's
+    struct text_buffer text;    // the converted frames, as BVH motion lines
+    unsigned frames;
+    float max_rotation_error, max_translation_error;
+    char *error;                // why the chunk failed, or NULL
+};
+
+struct batch_clip {
+    struct batch_state *state;
+    unsigned index;             // in the list of AMC files
+    char *data;                 // the whole file, NUL-terminated
+    size_t len;
+    bool unit_degrees, is_fully_specified; // from the header
+    struct batch_chunk *chunks;
+    unsigned chunk_count;
+    unsigned remaining;         // chunks that haven't finished
+    struct motion_stats *stats; // with --stats, where the file isn't split
+    char *error;                // why the file couldn't be split, or NULL
+    struct batch_clip *next_done;
+};
+
+struct batch_state {
+    struct amc_skeleton *skeleton;
+    struct output_options *options;
+    char **amc_filenames;
+    struct sched *sched;
+    pthread_mutex_t lock;       // protects the rest
+    pthread_cond_t clip_done;
+    struct batch_clip *done;    // finished files waiting to be written
+};
+
+static void text_append_rows(struct text_buffer *buf, const float *rows, unsigned frames, unsigned channels) {
+    // as write_bvh_motion() writes them
+    for (unsigned f = 0; f < frames; f++) {
+        const float *row = rows + (size_t) f*channels;
+        for (unsigned c = 0; c <= channels; c++) {
+            if (buf->cap - buf->len < 64) {
+                buf->cap = buf->cap ? 2*buf->cap : 1 << 16;
+                buf->data = xrealloc(buf->data, buf->cap);
+            }
+            if (c == channels) {
+                buf->data[buf->len++] = '\n';
+                break;
+            }
+            int n = snprintf(buf->data+buf->len, buf->cap-buf->len, "\t%f", row[c]);
+            while ((size_t) n >= buf->cap-buf->len) {
+                buf->cap *= 2;
+                buf->data = xrealloc(buf->data, buf->cap);
+                n = snprintf(buf->data+buf->len, buf->cap-buf->len, "\t%f", row[c]);
+            }
+            buf->len += n;
+        }
+    }
+}
+
+static void clip_finished(struct batch_clip *clip) {
+    struct batch_state *state = clip->state;
+    pthread_mutex_lock(&state->lock);
+    clip->next_done = state->done;
+    state->done = clip;
+    pthread_cond_signal(&state->clip_done);
+    pthread_mutex_unlock(&state->lock);
+}
+
+static void chunk_finished(struct batch_chunk *chunk) {
+    struct batch_clip *clip = chunk->clip;
+    pthread_mutex_lock(&clip->state->lock);
+    bool last = --clip->remaining == 0;
+    pthread_mutex_unlock(&clip->state->lock);
+    if (last) clip_finished(clip);
+}
+
+static void convert_chunk(void *arg) {
+    // parses and converts a run of whole frames
+    struct batch_chunk *chunk = arg;
+    struct batch_clip *clip = chunk->clip;
+    struct amc_skeleton *skeleton = clip->state->skeleton;
+    struct output_options *options = clip->state->options;
+    unsigned channels = bvh_channel_count(skeleton, options);
+    struct amc_motion *volatile motion = NULL;
+    float *volatile rows = NULL;
+    struct quat *volatile rotations = NULL;
+
+    jmp_buf handler;
+    if (setjmp(handler)) {
+        fail_handler = NULL;
+        chunk->error = xstrdup(fail_message);
+        if (motion) amc_motion_free(motion);
+        free(rows);
+        free(rotations);
+        chunk_finished(chunk);
+        return;
+    }
+    fail_handler = &handler;
+
+    struct amc_parser parser;
+    amc_parser_init(&parser, skeleton, options->storage, false);
+    motion = parser.motion;
+    parser.mode = MODE_MOTION;
+    parser.unit_degrees = clip->unit_degrees;
+    parser.is_fully_specified = clip->is_fully_specified;
+    parser.line_num = chunk->line_num;
+    parser.first_frame = chunk->first_frame;
+    amc_parse_lines(&parser, chunk->lines, chunk->len);
+
+    // convert a chunk of frames at a time, as write_bvh_motion() does
+    rows = xmalloc(sizeof(*rows)*CONVERT_CHUNK_FRAMES*(channels ? channels : 1));
+    rotations = clip->stats ? xmalloc(sizeof(*rotations)*CONVERT_CHUNK_FRAMES*(skeleton->joint_count ? skeleton->joint_count : 1)) : NULL;
+    struct amc_sample *sample = motion->samples;
+    unsigned first = chunk->first_frame;
+    while (sample) {
+        TRACE_BEGIN(convert);
+        unsigned frames = 0;
+        for (; sample && frames < CONVERT_CHUNK_FRAMES; sample = sample->next, frames++) {
+            float *row = rows + frames*channels;
+            struct quat *rotation = rotations ? rotations + frames*skeleton->joint_count : NULL;
+            for (unsigned j = 0; j < skeleton->joint_count; j++) {
+                row += compute_bvh_joint_sample(row, skeleton, j, sample, options, rotation ? rotation+j : NULL);
+            }
+        }
+        if (clip->stats) motion_stats_add(clip->stats, rows, rotations, frames);
+        text_append_rows(&chunk->text, rows, frames, channels);
+        TRACE_END(convert, "convert_bvh", first, first+frames-1);
+        first += frames;
+    }
+    fail_handler = NULL;
+
+    chunk->frames = motion->sample_count;
+    chunk->max_rotation_error = motion->max_rotation_error;
+    chunk->max_translation_error = motion->max_translation_error;
+    amc_motion_free(motion);
+    free(rows);
+    free(rotations);
+    chunk_finished(chunk);
+}
+
+static bool is_frame_line(const char *line) {
+    while (*line == ' ' || *line == '\t') line++;
+    return isdigit(*line);
+}
+
+static int count_lines(const char *from, const char *to, unsigned *frames) {
+    // counts the newlines, and the frame lines that follow them
+    int count = 0;
+    while ((from = memchr(from, '\n', to-from))) {
+        from++, count++;
+        if (from < to && is_frame_line(from)) (*frames)++;
+    }
+    return count;
+}
+
+static void convert_clip(void *arg) {
+    // Parses the file's header, then converts its frames, split into chunks
+    // that can run on other workers if the file is large.
+    struct batch_clip *clip = arg;
+    struct batch_state *state = clip->state;
+    char *filename = state->amc_filenames[clip->index];
+    FILE *volatile input = NULL;
+    struct amc_motion *volatile header_motion = NULL;
+
+    jmp_buf handler;
+    if (setjmp(handler)) {
+        fail_handler = NULL;
+        clip->error = xstrdup(fail_message);
+        if (input) fclose(input);
+        if (header_motion) amc_motion_free(header_motion);
+        clip_finished(clip);
+        return;
+    }
+    fail_handler = &handler;
+
+    // compressed files are read here, so decompression runs on the workers too
+    if (!clip->data) {
+        if (!(input = open_input(filename))) FAIL("cannot access '%s': %s\n", filename, strerror(errno));
+        size_t cap = 1 << 16;
+        clip->data = xmalloc(cap+1+AMC_TOKEN_PADDING);
+        clip->len = 0;
+        size_t n;
+        while ((n = fread(clip->data+clip->len, 1, cap-clip->len, input)) > 0) {
+            clip->len += n;
+            if (clip->len == cap) clip->data = xrealloc(clip->data, (cap *= 2) + 1+AMC_TOKEN_PADDING);
+        }
+        memset(clip->data+clip->len, 0, 1+AMC_TOKEN_PADDING);
+        if (ferror(input)) FAIL("Unable to read AMC data: %s\n", strerror(errno));
+        fclose(input);
+        input = NULL;
+    }
+
+    // the header, up to the first frame
+    struct amc_parser parser;
+    amc_parser_init(&parser, state->skeleton, state->options->storage, false);
+    header_motion = parser.motion;
+    char *line = clip->data, *end = clip->data+clip->len;
+    while (line < end && !is_frame_line(line)) {
+        char *next = memchr(line, '\n', end-line);
+        if (next) *next++ = '\0';
+        else next = end;
+        amc_parse_line(&parser, line);
+        line = next;
+    }
+    amc_motion_free(header_motion);
+    header_motion = NULL;
+    fail_handler = NULL;
+    clip->unit_degrees = parser.unit_degrees;
+    clip->is_fully_specified = parser.is_fully_specified;
+
+    // Cut the frames into chunks at frame lines. Statistics need the frames
+    // in order, so with --stats the file isn't split.
+    size_t body = end - line;
+    unsigned count = state->options->stats || body < 2*BATCH_CHUNK_BYTES ? 1 : body/BATCH_CHUNK_BYTES;
+    clip->chunks = xcalloc(count, sizeof(*clip->chunks));
+    clip->chunk_count = 0;
+    int line_num = parser.line_num;
+    unsigned first_frame = 0;
+    char *chunk_start = line;
+    for (unsigned k = 1; k <= count; k++) {
+        char *cut = end;
+        if (k < count) {
+            cut = line + body/count*k;
+            while ((cut = memchr(cut, '\n', end-cut)) && !is_frame_line(cut+1)) cut++;
+            cut = cut ? cut+1 : end;
+        }
+        if (cut <= chunk_start && k < count) continue;
+        struct batch_chunk *chunk = &clip->chunks[clip->chunk_count++];
+        chunk->clip = clip;
+        chunk->lines = chunk_start;
+        chunk->len = cut - chunk_start;
+        chunk->line_num = line_num;
+        chunk->first_frame = first_frame;
+        if (cut < end) {
+            // the chunk starts with a frame line, which no newline in it precedes
+            first_frame += is_frame_line(chunk_start);
+            line_num += count_lines(chunk_start, cut, &first_frame);
+            cut[-1] = '\0'; // the newline before the next chunk
+        }
+        chunk_start = cut;
+        if (cut == end) break;
+    }
+    clip->remaining = clip->chunk_count;
+    if (state->options->stats) clip->stats = motion_stats_new(bvh_channel_count(state->skeleton, state->options), state->skeleton->joint_count);
+
+    // the later chunks are left for other workers to steal
+    for (unsigned k = 1; k < clip->chunk_count; k++) sched_submit(state->sched, convert_chunk, &clip->chunks[k]);
+    convert_chunk(&clip->chunks[0]);
+}
+
+static bool write_clip(struct batch_clip *clip, struct io_engine *engine, char *output_filename, bool *write_failed, float fps, bool verbose) {
+    // Writes out a finished file, returning false if it failed. If the write
+    // itself fails, that's only known once the engine is finished, and
+    // `write_failed` is set then.
+    struct batch_state *state = clip->state;
+    struct amc_skeleton *skeleton = state->skeleton;
+    struct output_options *options = state->options;
+    char *amc_filename = state->amc_filenames[clip->index],
+         *error = clip->error;
+    unsigned frames = 0;
+    bool failed = false;
+    float max_rotation_error = 0, max_translation_error = 0;
+    for (unsigned k = 0; k < clip->chunk_count; k++) {
+        struct batch_chunk *chunk = &clip->chunks[k];
+        if (!error) error = chunk->error; // the first in the file
+        frames += chunk->frames;
+        if (chunk->max_rotation_error > max_rotation_error) max_rotation_error = chunk->max_rotation_error;
+        if (chunk->max_translation_error > max_translation_error) max_translation_error = chunk->max_translation_error;
+    }
+
+    struct io_output *out;
+    if (error) {
+        fprintf(stderr, "Error: %s: %s\n", amc_filename, error);
+        failed = true;
+    } else if (!(out = io_output_open(engine, output_filename, write_failed))) {
+        fprintf(stderr, "Error: cannot access '%s': %s\n", output_filename, strerror(errno));
+        failed = true;
+    } else {
+        TRACE_BEGIN(write);
+        write_bvh_skeleton(out->f, skeleton, options);
+        fprintf(out->f, "MOTION\n");
+        fprintf(out->f, "Frames:\t%u\n", frames);
+        fprintf(out->f, "Frame Time:\t%f\n", 1/fps);
+        for (unsigned k = 0; k < clip->chunk_count; k++) {
+            fwrite(clip->chunks[k].text.data, 1, clip->chunks[k].text.len, out->f);
+        }
+        io_output_close(engine, out);
+        TRACE_END(write, "write_bvh", -1, -1);
+
+        if (clip->stats) {
+            // the sidecar is small, so it's written directly
+            char *stats_json_filename = stats_filename(output_filename);
+            FILE *stats_json = fopen(stats_json_filename, "w");
+            if (stats_json) {
+                write_motion_stats(stats_json, clip->stats, skeleton, fps, options);
+            }
+            if (!stats_json || fclose(stats_json)) {
+                fprintf(stderr, "Error: cannot access '%s': %s\n", stats_json_filename, strerror(errno));
+                failed = true;
+            }
+            free(stats_json_filename);
+        }
+        if (verbose) {
+            printf("Converted %s to %s (%u frames", amc_filename, output_filename, frames);
+            if (clip->chunk_count > 1) printf(" in %u chunks", clip->chunk_count);
+            if (options->storage != STORAGE_FLOAT32) {
+                printf(", max error %.4g degrees, %.4g units", max_rotation_error*180/M_PI, max_translation_error*skeleton->unit_scale);
+            }
+            printf(")\n");
+        }
+    }
+
+    for (unsigned k = 0; k < clip->chunk_count; k++) {
+        free(clip->chunks[k].text.data);
+        free(clip->chunks[k].error);
+    }
+    free(clip->chunks);
+    free(clip->error);
+    free(clip->data);
+    if (clip->stats) motion_stats_free(clip->stats);
+    return !failed;
+}
+
+int convert_amc_batch(struct amc_skeleton *skeleton,
+                      char **amc_filenames,
+                      unsigned count,
+                      struct batch_options *batch,
+                      float fps,
+                      struct output_options *options,
+                      bool verbose) {
+    // Returns nonzero if any file failed to convert. Failures are reported,
+    // but don't stop the rest of the batch.
+    char **output_filenames = xmalloc(sizeof(*output_filenames)*(count ? count : 1));
+    unsigned *todo = xmalloc(sizeof(*todo)*(count ? count : 1)),
+             todo_count = 0;
+    struct manifest_input *amc_inputs = batch->manifest ? xmalloc(sizeof(*amc_inputs)*(count ? count : 1)) : NULL;
+    for (unsigned i = 0; i < count; i++) {
+        output_filenames[i] = batch_output_filename(batch->output_directory, amc_filenames[i]);
+        if (batch->manifest && manifest_is_up_to_date(batch->manifest, output_filenames[i], batch->stamp, batch->asf_filename, amc_filenames[i])) {
+            if (verbose) printf("'%s' is up to date\n", output_filenames[i]);
+        } else {
+            if (batch->manifest) manifest_snapshot(amc_filenames[i], &amc_inputs[i]);
+            todo[todo_count++] = i;
+        }
+    }
+
+    struct io_engine *engine = io_engine_new(batch->io_depth);
+    struct batch_state state = {
+        .skeleton = skeleton,
+        .options = options,
+        .amc_filenames = amc_filenames,
+        .sched = sched_new(batch->jobs ? batch->jobs : sched_default_workers()),
+        .done = NULL
+    };
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.clip_done, NULL);
+    unsigned workers = sched_worker_count(state.sched);
+    if (verbose) printf("Converting %u files on %u threads with %s\n", todo_count, workers ? workers : 1, io_engine_uses_uring(engine) ? "io_uring" : "blocking I/O");
+
+    // keep up to io_depth reads in flight ahead of the file being converted
+    unsigned ahead = batch->io_depth ? batch->io_depth : 1;
+    struct io_request **reads = xmalloc(sizeof(*reads)*(todo_count ? todo_count : 1));
+    for (unsigned t = 0; t < todo_count && t < ahead; t++) {
+        reads[t] = submit_read(engine, amc_filenames[todo[t]]);
+    }
+
+    // This thread does the I/O, while the workers convert. Only so many
+    // files are held in memory at once.
+    struct batch_clip *clips = xcalloc(todo_count ? todo_count : 1, sizeof(*clips));
+    bool *converted = xcalloc(count ? count : 1, sizeof(*converted)),
+         *write_failed = xcalloc(count ? count : 1, sizeof(*write_failed));
+    unsigned failed = 0, in_flight = 0, max_in_flight = 2*workers + 2;
+    for (unsigned t = 0; t <= todo_count; t++) {
+        // write out whatever has finished, waiting if too much is in memory or it's the end
+        while (true) {
+            pthread_mutex_lock(&state.lock);
+            bool must_wait = t == todo_count ? in_flight > 0 : in_flight >= max_in_flight;
+            while (must_wait && !state.done) pthread_cond_wait(&state.clip_done, &state.lock);
+            struct batch_clip *done = state.done;
+            state.done = NULL;
+            pthread_mutex_unlock(&state.lock);
+            if (!done) break;
+            for (struct batch_clip *clip = done, *next; clip; clip = next) {
+                next = clip->next_done;
+                converted[clip->index] = write_clip(clip, engine, output_filenames[clip->index], &write_failed[clip->index], fps, verbose);
+                if (!converted[clip->index]) failed++;
+                in_flight--;
+            }
+        }
+        if (t == todo_count) break;
+
+        unsigned i = todo[t];
+        size_t len = 0;
+        TRACE_BEGIN(read_span);
+        char *data = reads[t] ? io_read_wait(engine, reads[t], &len) : NULL;
+        TRACE_END(read_span, "read_wait", -1, -1);
+        if (reads[t] && !data) {
+            fprintf(stderr, "Error: cannot access '%s': %s\n", amc_filenames[i], strerror(errno));
+            failed++;
+        }
+        if (t+ahead < todo_count) reads[t+ahead] = submit_read(engine, amc_filenames[todo[t+ahead]]);
+        if (reads[t] && !data) continue;
+
+        struct batch_clip *clip = &clips[t];
+        clip->state = &state;
+        clip->index = i;
+        clip->data = data;
+        clip->len = len;
+        in_flight++;
+        sched_submit(state.sched, convert_clip, clip);
+    }
+    sched_free(state.sched);
+    pthread_mutex_destroy(&state.lock);
+    pthread_cond_destroy(&state.clip_done);
+
+    // failed writes remove their output, and count against their file once
+    TRACE_BEGIN(write_span);
+    io_engine_finish(engine);
+    TRACE_END(write_span, "write_wait", -1, -1);
+    for (unsigned i = 0; i < count; i++) {
+        if (converted[i] && write_failed[i]) {
+            converted[i] = false;
+            failed++;
+        }
+    }
+    if (batch->manifest) {
+        for (unsigned i = 0; i < count; i++) {
+            if (converted[i]) manifest_record(batch->manifest, output_filenames[i], batch->stamp, batch->asf_input, &amc_inputs[i]);
+        }
+    }
+    printf("Converted %u files, %u up to date, %u failed\n", todo_count - failed, count - todo_count, failed);
+
+    for (unsigned i = 0; i < count; i++) free(output_filenames[i]);
+    free(output_filenames);
+    free(todo);
+    free(amc_inputs);
+    free(reads);
+    free(clips);
+    free(converted);
+    free(write_failed);
+    return failed > 0;
+}
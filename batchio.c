@@ -0,0 +1,331 @@
+// I/O for batch conversions. Reads of upcoming AMC files and writes of
+// finished outputs are submitted through io_uring, so that they overlap with
+// parsing and conversion instead of leaving the CPU waiting on storage. At
+// most `depth` requests are in flight at once.
+//
+// Where io_uring is unavailable (other platforms, old kernels, or sandboxes
+// that block it), reads happen when they're waited on and writes when the
+// output is closed, with plain stdio.
+//
+// liburing isn't required, the ring is set up with raw system calls.
+
+#include <string.h>
+#include <errno.h>
+#include "amc2bvh.h"
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define HAVE_IO_URING
+#endif
+
+struct io_request {
+    char *filename;
+    int fd;
+    bool is_write, is_done;
+    char *data;
+    size_t len, transferred;
+    int err;            // errno, if the request failed
+    bool *failed;       // for writes, set if the write fails, or NULL
+#ifdef HAVE_IO_URING
+    struct iovec iov;
+#endif
+};
+
+struct io_engine {
+    unsigned depth, inflight;
+    unsigned failed_writes;
+    bool uses_uring;
+#ifdef HAVE_IO_URING
+    int ring_fd;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+#endif
+};
+
+static char *read_whole_file(char *filename, size_t *len) {
+    // the data is NUL-terminated and padded, for parsing
+    FILE *f = fopen(filename, "rb");
+    if (!f) return NULL;
+
+    size_t cap = 1 << 16, n;
+    char *data = xmalloc(cap+1+AMC_TOKEN_PADDING);
+    *len = 0;
+    while ((n = fread(data+*len, 1, cap-*len, f)) > 0) {
+        *len += n;
+        if (*len == cap) data = xrealloc(data, (cap *= 2) + 1+AMC_TOKEN_PADDING);
+    }
+    if (ferror(f)) {
+        int err = errno;
+        fclose(f);
+        free(data);
+        errno = err;
+        return NULL;
+    }
+    fclose(f);
+    memset(data+*len, 0, 1+AMC_TOKEN_PADDING);
+    return data;
+}
+
+static void report_failed_write(struct io_engine *engine, char *filename, int err, bool *failed) {
+    // remove whatever was written, so that it isn't mistaken for a conversion
+    fprintf(stderr, "Error: unable to write '%s': %s\n", filename, strerror(err));
+    remove(filename);
+    engine->failed_writes++;
+    if (failed) *failed = true;
+}
+
+#ifdef HAVE_IO_URING
+
+static bool uring_init(struct io_engine *engine) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, engine->depth, &params);
+    if (fd < 0) return false;
+
+    engine->ring_fd = fd;
+    engine->sq_ring_size = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    engine->cq_ring_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    engine->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+    engine->sq_ring = mmap(NULL, engine->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    engine->cq_ring = mmap(NULL, engine->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    engine->sqes = mmap(NULL, engine->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (engine->sq_ring == MAP_FAILED || engine->cq_ring == MAP_FAILED || engine->sqes == MAP_FAILED) {
+        if (engine->sq_ring != MAP_FAILED) munmap(engine->sq_ring, engine->sq_ring_size);
+        if (engine->cq_ring != MAP_FAILED) munmap(engine->cq_ring, engine->cq_ring_size);
+        if (engine->sqes != MAP_FAILED) munmap(engine->sqes, engine->sqes_size);
+        close(fd);
+        return false;
+    }
+
+    char *sq = engine->sq_ring, *cq = engine->cq_ring;
+    engine->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    engine->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    engine->sq_array = (unsigned *) (sq + params.sq_off.array);
+    engine->cq_head = (unsigned *) (cq + params.cq_off.head);
+    engine->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    engine->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    engine->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return true;
+}
+
+static void uring_free(struct io_engine *engine) {
+    munmap(engine->sq_ring, engine->sq_ring_size);
+    munmap(engine->cq_ring, engine->cq_ring_size);
+    munmap(engine->sqes, engine->sqes_size);
+    close(engine->ring_fd);
+}
+
+static void uring_submit(struct io_engine *engine, struct io_request *req) {
+    // submits the rest of a request, which must be the only one submitted
+    // since the last call to io_uring_enter()
+    unsigned tail = *engine->sq_tail,
+             index = tail & *engine->sq_mask;
+    struct io_uring_sqe *sqe = engine->sqes + index;
+
+    req->iov.iov_base = req->data + req->transferred;
+    req->iov.iov_len = req->len - req->transferred;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = req->fd;
+    sqe->off = req->transferred;
+    sqe->addr = (uintptr_t) &req->iov;
+    sqe->len = 1;
+    sqe->user_data = (uintptr_t) req;
+
+    engine->sq_array[index] = index;
+    __atomic_store_n(engine->sq_tail, tail+1, __ATOMIC_RELEASE);
+    while (syscall(__NR_io_uring_enter, engine->ring_fd, 1, 0, 0, NULL, 0) < 0 && errno == EINTR);
+}
+
+static void complete_request(struct io_engine *engine, struct io_request *req) {
+    close(req->fd);
+    req->is_done = true;
+    engine->inflight--;
+
+    if (req->is_write) {
+        // nobody waits on writes, so clean them up here
+        if (req->err) report_failed_write(engine, req->filename, req->err, req->failed);
+        free(req->filename);
+        free(req->data);
+        free(req);
+    } else if (!req->err) {
+        memset(req->data+req->transferred, 0, 1+AMC_TOKEN_PADDING);
+        req->len = req->transferred;
+    }
+}
+
+static void uring_reap(struct io_engine *engine) {
+    // waits for at least one completion, and handles all that are available
+    unsigned head = *engine->cq_head;
+    if (head == __atomic_load_n(engine->cq_tail, __ATOMIC_ACQUIRE)) {
+        while (syscall(__NR_io_uring_enter, engine->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno == EINTR);
+    }
+
+    while (head != __atomic_load_n(engine->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = engine->cqes + (head & *engine->cq_mask);
+        struct io_request *req = (struct io_request *) (uintptr_t) cqe->user_data;
+        int res = cqe->res;
+        __atomic_store_n(engine->cq_head, ++head, __ATOMIC_RELEASE);
+
+        if (res == -EINTR || res == -EAGAIN) {
+            uring_submit(engine, req);
+        } else if (res < 0) {
+            req->err = -res;
+            complete_request(engine, req);
+        } else if (res == 0 || (req->transferred += res) == req->len) {
+            // a read can come up short if the file shrank
+            complete_request(engine, req);
+        } else {
+            uring_submit(engine, req); // a partial transfer
+        }
+        head = *engine->cq_head;
+    }
+}
+
+static void uring_start(struct io_engine *engine, struct io_request *req) {
+    while (engine->inflight == engine->depth) uring_reap(engine);
+    if (req->len == 0) {
+        close(req->fd);
+        req->is_done = true;
+        if (req->is_write) {
+            free(req->filename);
+            free(req->data);
+            free(req);
+        }
+        return;
+    }
+    engine->inflight++;
+    uring_submit(engine, req);
+}
+
+#endif
+
+struct io_engine *io_engine_new(unsigned depth) {
+    struct io_engine *engine = xmalloc(sizeof(*engine));
+    engine->depth = depth;
+    engine->inflight = 0;
+    engine->failed_writes = 0;
+    engine->uses_uring = false;
+#ifdef HAVE_IO_URING
+    if (depth > 0) engine->uses_uring = uring_init(engine);
+#endif
+    return engine;
+}
+
+bool io_engine_uses_uring(struct io_engine *engine) {
+    return engine->uses_uring;
+}
+
+unsigned io_engine_finish(struct io_engine *engine) {
+    // waits for all writes to finish, returning how many failed
+#ifdef HAVE_IO_URING
+    if (engine->uses_uring) {
+        while (engine->inflight > 0) uring_reap(engine);
+        uring_free(engine);
+    }
+#endif
+    unsigned failed = engine->failed_writes;
+    free(engine);
+    return failed;
+}
+
+struct io_request *io_read_submit(struct io_engine *engine, char *filename) {
+    struct io_request *req = xcalloc(1, sizeof(*req));
+    req->filename = filename;
+#ifdef HAVE_IO_URING
+    if (engine->uses_uring) {
+        struct stat st;
+        if ((req->fd = open(filename, O_RDONLY)) < 0 || fstat(req->fd, &st)) {
+            req->err = errno;
+            if (req->fd >= 0) close(req->fd);
+            req->is_done = true;
+            return req;
+        }
+        req->len = st.st_size;
+        req->data = xmalloc(req->len+1+AMC_TOKEN_PADDING);
+        req->data[0] = '\0';
+        uring_start(engine, req);
+    }
+#endif
+    return req;
+}
+
+char *io_read_wait(struct io_engine *engine, struct io_request *req, size_t *len) {
+    // Returns the NUL-terminated contents of the file, padded for parsing (see
+    // AMC_TOKEN_PADDING), which the caller must free, or NULL with errno set if
+    // it couldn't be read.
+    char *data;
+#ifdef HAVE_IO_URING
+    if (engine->uses_uring) {
+        while (!req->is_done) uring_reap(engine);
+        if (req->err) free(req->data);
+        data = req->err ? NULL : req->data;
+        *len = req->len;
+        errno = req->err;
+        free(req);
+        return data;
+    }
+#endif
+    data = read_whole_file(req->filename, len);
+    free(req);
+    return data;
+}
+
+struct io_output *io_output_open(struct io_engine *engine, char *filename, bool *failed) {
+    // Returns an output with a FILE to write to, or NULL with errno set. The
+    // output is only complete once it's closed and the engine is finished,
+    // and if writing it fails, `failed` (unless NULL) is set by then.
+    struct io_output *out = xcalloc(1, sizeof(*out));
+    out->filename = filename;
+    out->failed = failed;
+#ifdef HAVE_IO_URING
+    if (engine->uses_uring) {
+        out->f = open_memstream(&out->data, &out->len);
+        return out;
+    }
+#endif
+    if (!(out->f = fopen(filename, "w"))) {
+        int err = errno;
+        free(out);
+        errno = err;
+        return NULL;
+    }
+    return out;
+}
+
+void io_output_close(struct io_engine *engine, struct io_output *out) {
+#ifdef HAVE_IO_URING
+    if (engine->uses_uring) {
+        fclose(out->f);
+        struct io_request *req = xcalloc(1, sizeof(*req));
+        req->filename = xstrdup(out->filename);
+        req->is_write = true;
+        req->data = out->data;
+        req->len = out->len;
+        req->failed = out->failed;
+        free(out);
+        if ((req->fd = open(req->filename, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+            report_failed_write(engine, req->filename, errno, req->failed);
+            free(req->filename);
+            free(req->data);
+            free(req);
+            return;
+        }
+        uring_start(engine, req);
+        return;
+    }
+#endif
+    if (fclose(out->f)) report_failed_write(engine, out->filename, errno, out->failed);
+    free(out);
+}
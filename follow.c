@@ -0,0 +1,190 @@
+// Tail-follow conversion of an AMC file that is still being written, e.g. by a
+// capture system during a take. Frames are converted and appended to the BVH
+// as soon as they are complete, and the "Frames:" count is patched in place,
+// so the output is a valid BVH file at every point.
+
+#include <string.h>
+#include <signal.h>
+#include "amc2bvh.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#define sleep_ms(ms) Sleep(ms)
+#else
+#include <time.h>
+#define sleep_ms(ms) nanosleep(&(struct timespec) { .tv_sec = (ms)/1000, .tv_nsec = ((ms)%1000)*1000000L }, NULL)
+#endif
+
+// how long to wait for the AMC file to grow before checking again
+#define FOLLOW_POLL_MS 5
+
+static volatile sig_atomic_t is_following = 1;
+
+static void stop_following(int sig) {
+    is_following = 0;
+}
+
+struct follow_state {
+    FILE *bvh;
+    long count_pos;         // where the frame count is written in the BVH file
+    unsigned frames_written;
+    double *latencies;      // time from reading a frame to writing it, in ms
+    size_t latency_capacity;
+};
+
+static void write_frame(struct follow_state *state, struct amc_skeleton *skeleton, struct amc_sample *sample, double started, struct output_options *options) {
+    write_bvh_sample(state->bvh, skeleton, sample, options);
+    fprintf(state->bvh, "\n");
+
+    // the count is padded to a fixed width so it can be overwritten in place
+    state->frames_written++;
+    long end = ftell(state->bvh);
+    fseek(state->bvh, state->count_pos, SEEK_SET);
+    fprintf(state->bvh, "%-10u", state->frames_written);
+    fseek(state->bvh, end, SEEK_SET);
+    fflush(state->bvh);
+
+    if (state->frames_written > state->latency_capacity) {
+        state->latency_capacity = 2*state->latency_capacity;
+        state->latencies = xrealloc(state->latencies, sizeof(*state->latencies)*state->latency_capacity);
+    }
+    state->latencies[state->frames_written-1] = now_ms() - started;
+}
+
+void live_frames_init(struct live_frames *frames, struct amc_skeleton *skeleton, enum sample_storage storage, bool verbose) {
+    amc_parser_init(&frames->parser, skeleton, storage, verbose);
+    frames->animated_joints = 0;
+    frames->frame = 0;
+    frames->seen_count = 0;
+    frames->seen = xcalloc(skeleton->joint_count ? skeleton->joint_count : 1, sizeof(*frames->seen));
+    for (unsigned i = 0; i < skeleton->joint_count; i++) {
+        if (skeleton->channels[i][0] != CHANNEL_EMPTY) frames->animated_joints++;
+    }
+    frames->pending = NULL;
+    frames->pending_done = false;
+    frames->pending_started = 0;
+}
+
+void live_frames_free(struct live_frames *frames) {
+    free(frames->seen);
+    amc_motion_free(frames->parser.motion);
+}
+
+struct amc_sample *live_frames_add_line(struct live_frames *frames, char *line, double now, double *started) {
+    // Parses a line of AMC data that arrived at `now`, returning the frame it
+    // completed, if any, and setting `started` to when that frame began. A
+    // frame is complete once every joint with channels has been given data,
+    // or failing that, when the next frame begins. The frame returned is only
+    // valid until the next call.
+    struct amc_parser *parser = &frames->parser;
+    struct amc_motion *motion = parser->motion;
+
+    // only the frame being parsed needs to be kept around
+    while (motion->samples && motion->samples != parser->current_sample) {
+        struct amc_sample *next = motion->samples->next;
+        free(motion->samples);
+        motion->samples = next;
+    }
+
+    struct amc_sample *complete = NULL;
+    if (amc_parse_line(parser, line)) {
+        // a new frame, so the previous one is done
+        if (frames->pending && !frames->pending_done) {
+            complete = frames->pending;
+            *started = frames->pending_started;
+        }
+        frames->pending = parser->current_sample;
+        frames->pending_done = false;
+        frames->pending_started = now;
+        frames->frame++;
+        frames->seen_count = 0;
+    } else if (parser->last_joint != AMC_NO_JOINT && frames->seen[parser->last_joint] != frames->frame) {
+        frames->seen[parser->last_joint] = frames->frame;
+        if (++frames->seen_count == frames->animated_joints && !frames->pending_done) {
+            complete = frames->pending;
+            *started = frames->pending_started;
+            frames->pending_done = true;
+        }
+    }
+    return complete;
+}
+
+struct amc_sample *live_frames_finish(struct live_frames *frames, double *started) {
+    // the last frame, if it was never completed
+    if (!frames->pending || frames->pending_done) return NULL;
+    frames->pending_done = true;
+    *started = frames->pending_started;
+    return frames->pending;
+}
+
+unsigned follow_amc_motion(FILE *amc, FILE *bvh, struct amc_skeleton *skeleton, float fps, struct output_options *options, float timeout, bool verbose) {
+    struct live_frames frames;
+    live_frames_init(&frames, skeleton, options->storage, verbose);
+
+    struct follow_state state = {
+        .bvh = bvh,
+        .frames_written = 0,
+        .latency_capacity = 1024
+    };
+    state.latencies = xmalloc(sizeof(*state.latencies)*state.latency_capacity);
+
+    write_bvh_skeleton(bvh, skeleton, options);
+    fprintf(bvh, "MOTION\n");
+    fprintf(bvh, "Frames:\t");
+    state.count_pos = ftell(bvh);
+    fprintf(bvh, "%-10u\n", 0);
+    fprintf(bvh, "Frame Time:\t%f\n", 1/fps);
+    fflush(bvh);
+
+    double last_growth = now_ms(),
+           started;
+    struct amc_sample *complete;
+
+    void (*previous_handler)(int) = signal(SIGINT, stop_following);
+    char *buffer = xcalloc(BUFFSIZE+AMC_TOKEN_PADDING, 1);
+    size_t len = 0;
+    bool at_eof = false;
+
+    while (true) {
+        if (fgets(buffer+len, BUFFSIZE-len, amc)) {
+            len += strlen(buffer+len);
+            last_growth = now_ms();
+            if (buffer[len-1] != '\n') {
+                // a partial line, the rest hasn't been written yet
+                if (len == BUFFSIZE-1) FAIL("Line length exceeds internal buffer\n");
+                continue;
+            }
+        } else {
+            clearerr(amc);
+            if (is_following && now_ms() - last_growth <= timeout*1000) {
+                sleep_ms(FOLLOW_POLL_MS);
+                continue;
+            }
+            if (len == 0) break;
+            at_eof = true; // finish off a last line with no newline
+        }
+
+        len = 0;
+        if ((complete = live_frames_add_line(&frames, buffer, now_ms(), &started))) {
+            write_frame(&state, skeleton, complete, started, options);
+        }
+
+        if (at_eof) break;
+    }
+    if ((complete = live_frames_finish(&frames, &started))) write_frame(&state, skeleton, complete, started, options);
+    signal(SIGINT, previous_handler);
+
+    if (verbose || state.frames_written > 0) {
+        size_t n = state.frames_written;
+        printf("Converted %u frames, latency p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+               state.frames_written,
+               percentile(state.latencies, n, 0.5),
+               percentile(state.latencies, n, 0.99),
+               percentile(state.latencies, n, 1));
+    }
+
+    free(buffer);
+    free(state.latencies);
+    live_frames_free(&frames);
+    return state.frames_written;
+}
@@ -0,0 +1,214 @@
+// Binary glTF (.glb) output. The skeleton is written as a tree of nodes, one
+// per joint, and the motion as a single animation with a rotation sampler for
+// every joint and a translation sampler for every joint with translation
+// channels. All of the keyframe data lives in one binary chunk, so engines can
+// load it without any parsing. See https://registry.khronos.org/glTF/.
+
+#include <string.h>
+#include <stdarg.h>
+#include "amc2bvh.h"
+
+#define GLB_MAGIC 0x46546C67 // "glTF"
+#define GLB_CHUNK_JSON 0x4E4F534A
+#define GLB_CHUNK_BIN 0x004E4942
+#define GLTF_FLOAT 5126
+
+struct json_buffer {
+    char *data;
+    size_t len, cap;
+};
+
+static void json_printf(struct json_buffer *json, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int needed = vsnprintf(json->data+json->len, json->cap-json->len, fmt, args);
+    va_end(args);
+
+    if (json->len+needed >= json->cap) {
+        while (json->len+needed >= json->cap) json->cap *= 2;
+        json->data = xrealloc(json->data, json->cap);
+        va_start(args, fmt);
+        vsnprintf(json->data+json->len, json->cap-json->len, fmt, args);
+        va_end(args);
+    }
+    json->len += needed;
+}
+
+static void json_string(struct json_buffer *json, const char *str) {
+    json_printf(json, "\"");
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') json_printf(json, "\\%c", *str);
+        else if ((unsigned char) *str < 0x20) json_printf(json, "\\u%04x", *str);
+        else json_printf(json, "%c", *str);
+    }
+    json_printf(json, "\"");
+}
+
+static void json_accessor(struct json_buffer *json, unsigned view, unsigned count, const char *type, bool first) {
+    json_printf(json, "%s{\"bufferView\":%u,\"componentType\":%u,\"count\":%u,\"type\":\"%s\"",
+                first ? "" : ",", view, GLTF_FLOAT, count, type);
+}
+
+void write_glb(FILE *glb, struct amc_motion *motion, struct amc_skeleton *skeleton, float fps) {
+    unsigned frames = motion->sample_count,
+             joints = skeleton->joint_count;
+
+    // Lay out the binary chunk: keyframe times, then each joint's rotations
+    // followed by its translations (if it has any). Each block is a buffer
+    // view with a single accessor of the same index.
+    size_t *offsets = xmalloc(sizeof(*offsets)*(2*joints+1)),
+           size = 0;
+    unsigned *rotation_views = xmalloc(sizeof(*rotation_views)*(joints ? joints : 1)),
+             *translation_views = xmalloc(sizeof(*translation_views)*(joints ? joints : 1)),
+             views = 0;
+    offsets[views++] = size;
+    size += sizeof(float)*frames;
+    for (unsigned j = 0; j < joints; j++) {
+        rotation_views[j] = views;
+        offsets[views++] = size;
+        size += 4*sizeof(float)*frames;
+        translation_views[j] = AMC_NO_JOINT;
+        if (amc_joint_has_translation(skeleton, j)) {
+            translation_views[j] = views;
+            offsets[views++] = size;
+            size += 3*sizeof(float)*frames;
+        }
+    }
+
+    // fill in the keyframes in a single pass over the motion
+    TRACE_BEGIN(convert_span);
+    PERF_BEGIN(convert_sample);
+    float *bin = xmalloc(size ? size : 1),
+          t_max = 0;
+    unsigned f = 0;
+    for (struct amc_sample *sample = motion->samples; sample; sample = sample->next, f++) {
+        float *times = bin;
+        times[f] = t_max = f/fps;
+
+        for (unsigned j = 0; j < joints; j++) {
+            float *rotations = bin + offsets[rotation_views[j]]/sizeof(float);
+            struct quat q = compute_joint_rotation(skeleton, j, sample);
+
+            // keep neighboring keyframes in the same hemisphere so that they
+            // interpolate along the short arc
+            if (f > 0) {
+                float *prev = rotations + 4*(f-1);
+                if (prev[0]*q.x + prev[1]*q.y + prev[2]*q.z + prev[3]*q.w < 0) {
+                    q = (struct quat) { .w=-q.w, .x=-q.x, .y=-q.y, .z=-q.z };
+                }
+            }
+
+            // glTF quaternions are stored XYZW
+            rotations[4*f] = q.x;
+            rotations[4*f+1] = q.y;
+            rotations[4*f+2] = q.z;
+            rotations[4*f+3] = q.w;
+
+            if (translation_views[j] != AMC_NO_JOINT) {
+                // the animated translation replaces the node's rest offset
+                float *translations = bin + offsets[translation_views[j]]/sizeof(float);
+                struct vec3 offset = amc_joint_offset(skeleton, j),
+                            t = compute_joint_translation(skeleton, j, sample);
+                translations[3*f] = offset.x + t.x;
+                translations[3*f+1] = offset.y + t.y;
+                translations[3*f+2] = offset.z + t.z;
+            }
+        }
+    }
+
+    PERF_END(convert_sample, PERF_CONVERT, frames, 0);
+    TRACE_END(convert_span, "convert_glb", 0, (long) frames-1);
+
+    TRACE_BEGIN(write_span);
+    PERF_BEGIN(write_sample);
+    struct json_buffer json = { .data = xmalloc(4096), .len = 0, .cap = 4096 };
+    json_printf(&json, "{\"asset\":{\"version\":\"2.0\",\"generator\":\"amc2bvh v%u.%u.%u\"},",
+                VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH);
+    json_printf(&json, "\"scene\":0,\"scenes\":[{\"nodes\":[0]}],");
+
+    json_printf(&json, "\"nodes\":[");
+    for (unsigned j = 0; j < joints; j++) {
+        struct vec3 offset = amc_joint_offset(skeleton, j);
+        json_printf(&json, "%s{\"name\":", j ? "," : "");
+        json_string(&json, skeleton->names[j]);
+        json_printf(&json, ",\"translation\":[%.9g,%.9g,%.9g]", offset.x, offset.y, offset.z);
+        if (skeleton->child_counts[j] > 0) {
+            json_printf(&json, ",\"children\":[");
+            for (unsigned c = 0; c < skeleton->child_counts[j]; c++) {
+                json_printf(&json, "%s%u", c ? "," : "", skeleton->children[skeleton->child_offsets[j]+c]);
+            }
+            json_printf(&json, "]");
+        }
+        json_printf(&json, "}");
+    }
+    json_printf(&json, "],");
+
+    if (frames > 0) {
+        json_printf(&json, "\"animations\":[{\"samplers\":[");
+        unsigned sampler = 0;
+        for (unsigned v = 1; v < views; v++) {
+            json_printf(&json, "%s{\"input\":0,\"output\":%u,\"interpolation\":\"LINEAR\"}", sampler++ ? "," : "", v);
+        }
+        json_printf(&json, "],\"channels\":[");
+        sampler = 0;
+        for (unsigned j = 0; j < joints; j++) {
+            json_printf(&json, "%s{\"sampler\":%u,\"target\":{\"node\":%u,\"path\":\"rotation\"}}", sampler ? "," : "", sampler, j);
+            sampler++;
+            if (translation_views[j] != AMC_NO_JOINT) {
+                json_printf(&json, ",{\"sampler\":%u,\"target\":{\"node\":%u,\"path\":\"translation\"}}", sampler, j);
+                sampler++;
+            }
+        }
+        json_printf(&json, "]}],");
+
+        json_printf(&json, "\"accessors\":[");
+        json_accessor(&json, 0, frames, "SCALAR", true);
+        json_printf(&json, ",\"min\":[0],\"max\":[%.9g]}", t_max);
+        for (unsigned j = 0; j < joints; j++) {
+            json_accessor(&json, rotation_views[j], frames, "VEC4", false);
+            json_printf(&json, "}");
+            if (translation_views[j] != AMC_NO_JOINT) {
+                json_accessor(&json, translation_views[j], frames, "VEC3", false);
+                json_printf(&json, "}");
+            }
+        }
+        json_printf(&json, "],");
+
+        json_printf(&json, "\"bufferViews\":[");
+        for (unsigned v = 0; v < views; v++) {
+            size_t end = v+1 < views ? offsets[v+1] : size;
+            json_printf(&json, "%s{\"buffer\":0,\"byteOffset\":%zu,\"byteLength\":%zu}", v ? "," : "", offsets[v], end-offsets[v]);
+        }
+        json_printf(&json, "],");
+        json_printf(&json, "\"buffers\":[{\"byteLength\":%zu}]", size);
+    } else {
+        json.len--; // drop the trailing comma, there's nothing to animate
+    }
+    json_printf(&json, "}");
+
+    // chunks must be 4-byte aligned, JSON is padded with spaces
+    while (json.len % 4) json_printf(&json, " ");
+    bool has_bin = frames > 0;
+    size_t total = 12 + 8 + json.len + (has_bin ? 8 + size : 0);
+
+    fwrite_le_u32(glb, GLB_MAGIC);
+    fwrite_le_u32(glb, 2);
+    fwrite_le_u32(glb, total);
+    fwrite_le_u32(glb, json.len);
+    fwrite_le_u32(glb, GLB_CHUNK_JSON);
+    fwrite(json.data, 1, json.len, glb);
+    if (has_bin) {
+        fwrite_le_u32(glb, size);
+        fwrite_le_u32(glb, GLB_CHUNK_BIN);
+        fwrite_le_f32(glb, bin, size/sizeof(float));
+    }
+
+    PERF_END(write_sample, PERF_WRITE, frames, 0);
+    TRACE_END(write_span, "write_glb", 0, (long) frames-1);
+
+    free(json.data);
+    free(bin);
+    free(offsets);
+    free(rotation_views);
+    free(translation_views);
+}
@@ -580,6 +580,31 @@ static void MM86128(const void *key, const int len, uint32_t seed, void *out) {
     ((uint32_t*)out)[3] = h4;
 }
 
+//-----------------------------------------------------------------------------
+// FNV-1a was designed by Glenn Fowler, Landon Curt Noll, and Kiem-Phong Vo,
+// and is in the public domain.
+//
+// FNV-1a 64-bit, seeded, with the MurmurHash3 fmix64 finalizer so that the
+// low bits used for bucket selection are well mixed. It has no resistance to
+// hash flooding, but it is much cheaper than SipHash for short, trusted keys.
+//-----------------------------------------------------------------------------
+static uint64_t FNV1A64(const uint8_t *in, const size_t inlen,
+                        uint64_t seed0, uint64_t seed1)
+{
+    uint64_t h = UINT64_C(0xcbf29ce484222325) ^ seed0;
+    for (size_t i = 0; i < inlen; i++) {
+        h ^= in[i];
+        h *= UINT64_C(0x100000001b3);
+    }
+    h ^= seed1 ^ inlen;
+    h ^= h >> 33;
+    h *= UINT64_C(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h *= UINT64_C(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+    return h;
+}
+
 // hashmap_sip returns a hash value for `data` using SipHash-2-4.
 uint64_t hashmap_sip(const void *data, size_t len,
                      uint64_t seed0, uint64_t seed1)
@@ -596,6 +621,14 @@ uint64_t hashmap_murmur(const void *data, size_t len,
     return *(uint64_t*)out;
 }
 
+// hashmap_fnv1a returns a hash value for `data` using FNV-1a. It's intended
+// for short keys from a trusted source, where SipHash is needlessly slow.
+uint64_t hashmap_fnv1a(const void *data, size_t len,
+                       uint64_t seed0, uint64_t seed1)
+{
+    return FNV1A64((uint8_t*)data, len, seed0, seed1);
+}
+
 //==============================================================================
 // TESTS AND BENCHMARKS
 // $ cc -DHASHMAP_TEST hashmap.c && ./a.out              # run tests
@@ -686,6 +719,14 @@ static uint64_t hash_str(const void *item, uint64_t seed0, uint64_t seed1) {
     return hashmap_murmur(*(char**)item, strlen(*(char**)item), seed0, seed1);
 }
 
+static uint64_t hash_str_sip(const void *item, uint64_t seed0, uint64_t seed1) {
+    return hashmap_sip(*(char**)item, strlen(*(char**)item), seed0, seed1);
+}
+
+static uint64_t hash_str_fnv1a(const void *item, uint64_t seed0, uint64_t seed1) {
+    return hashmap_fnv1a(*(char**)item, strlen(*(char**)item), seed0, seed1);
+}
+
 static void free_str(void *item) {
     xfree(*(char**)item);
 }
@@ -701,6 +742,7 @@ static void all() {
     // test sip and murmur hashes
     assert(hashmap_sip("hello", 5, 1, 2) == 2957200328589801622);
     assert(hashmap_murmur("hello", 5, 1, 2) == 1682575153221130884);
+    assert(hashmap_fnv1a("hello", 5, 1, 2) == 9952724403924521653u);
 
     int *vals;
     while (!(vals = xmalloc(N * sizeof(int)))) {}
@@ -931,6 +973,59 @@ static void benchmarks() {
 
     xfree(vals);
 
+    // Short string keys, similar to the joint names in an ASF skeleton. The
+    // map is kept small so that hashing dominates the cost of a lookup.
+    static const char *prefixes[] = { "l", "r", "" };
+    static const char *parts[] = { "femur", "tibia", "foot", "toes", "humerus",
+                                   "radius", "wrist", "hand", "fingers",
+                                   "thumb", "clavicle", "hipjoint" };
+    int nparts = sizeof(parts)/sizeof(parts[0]);
+    int nkeys = 3*nparts;
+    char **keys = xmalloc(nkeys * sizeof(char*));
+    for (int i = 0; i < nkeys; i++) {
+        keys[i] = xmalloc(16);
+        sprintf(keys[i], "%s%s", prefixes[i/nparts], parts[i%nparts]);
+    }
+
+    uint64_t sink = 0;
+    bench("sip (str)", N, {
+        char *key = keys[i%nkeys];
+        sink += hashmap_sip(key, strlen(key), seed, seed);
+    })
+    bench("murmur (str)", N, {
+        char *key = keys[i%nkeys];
+        sink += hashmap_murmur(key, strlen(key), seed, seed);
+    })
+    bench("fnv1a (str)", N, {
+        char *key = keys[i%nkeys];
+        sink += hashmap_fnv1a(key, strlen(key), seed, seed);
+    })
+    if (sink == 1) printf("\n"); // keep the hashes from being optimized out
+
+    uint64_t (*str_hashes[])(const void*, uint64_t, uint64_t) = {
+        hash_str_sip, hash_str, hash_str_fnv1a
+    };
+    const char *str_hash_names[] = {
+        "get (sip)", "get (murmur)", "get (fnv1a)"
+    };
+    for (int h = 0; h < 3; h++) {
+        map = hashmap_new(sizeof(char*), 0, seed, seed, str_hashes[h],
+                          compare_strs, NULL, NULL);
+        for (int i = 0; i < nkeys; i++) {
+            assert(!hashmap_set(map, &keys[i]));
+        }
+        bench(str_hash_names[h], N, {
+            char **v = hashmap_get(map, &keys[i%nkeys]);
+            assert(v && *v == keys[i%nkeys]);
+        })
+        hashmap_free(map);
+    }
+
+    for (int i = 0; i < nkeys; i++) {
+        xfree(keys[i]);
+    }
+    xfree(keys);
+
     if (total_allocs != 0) {
         fprintf(stderr, "total_allocs: expected 0, got %lu\n", total_allocs);
         exit(1);
@@ -67,6 +67,8 @@ uint64_t hashmap_sip(const void *data, size_t len,
                      uint64_t seed0, uint64_t seed1);
 uint64_t hashmap_murmur(const void *data, size_t len,
                         uint64_t seed0, uint64_t seed1);
+uint64_t hashmap_fnv1a(const void *data, size_t len,
+                       uint64_t seed0, uint64_t seed1);
 
 
 // DEPRECATED: use `hashmap_new_with_allocator`
@@ -0,0 +1,268 @@
+// Build manifests, for skipping conversions whose output is already up to
+// date. For each output, the manifest records the size, modification time and
+// content hash of the ASF and AMC files it was made from, along with a stamp
+// of the tool version and conversion options, with the target rig's hash.
+//
+// Like make, an output is up to date if it exists and its inputs have the same
+// size and modification time as last time. Unlike make, an input whose
+// modification time has changed is then hashed, so that copying or touching a
+// file doesn't force a conversion unless its contents actually changed.
+// Modification times are kept to the nanosecond, and inputs are snapshotted
+// before they're parsed, so an edit made during a conversion is seen next time.
+//
+// The manifest is a text file with one tab-separated line per output:
+//
+//   output  stamp  asf  size  mtime  hash  amc  size  mtime  hash
+
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include "amc2bvh.h"
+
+#define MANIFEST_HEADER "# amc2bvh build manifest"
+#define MANIFEST_FIELDS 10
+
+struct manifest_entry {
+    char *output_filename;  // the key
+    char *stamp;
+    struct manifest_input asf, amc;
+};
+
+struct manifest {
+    struct hashmap *entries;
+    bool changed;           // whether the manifest needs to be saved
+};
+
+static int manifest_entry_cmp(const void *a, const void *b, void *data) {
+    const struct manifest_entry *ea = a, *eb = b;
+    return strcmp(ea->output_filename, eb->output_filename);
+}
+
+static uint64_t manifest_entry_hash(const void *item, uint64_t seed0, uint64_t seed1) {
+    const struct manifest_entry *entry = item;
+    return hashmap_fnv1a(entry->output_filename, strlen(entry->output_filename), seed0, seed1);
+}
+
+static void manifest_entry_free(void *item) {
+    struct manifest_entry *entry = item;
+    free(entry->output_filename);
+    free(entry->stamp);
+    free(entry->asf.filename);
+    free(entry->amc.filename);
+}
+
+static bool hash_file(char *filename, uint64_t *hash) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) return false;
+
+    size_t len = 0, cap = 1 << 16, n;
+    char *data = xmalloc(cap);
+    while ((n = fread(data+len, 1, cap-len, f)) > 0) {
+        len += n;
+        if (len == cap) data = xrealloc(data, cap *= 2);
+    }
+    bool ok = !ferror(f);
+    fclose(f);
+
+    *hash = hashmap_fnv1a(data, len, 0, 0);
+    free(data);
+    return ok;
+}
+
+static bool stat_input(char *filename, struct manifest_input *input) {
+    // the modification time is in nanoseconds, where the system keeps them
+    struct stat st;
+    if (stat(filename, &st)) return false;
+    input->size = st.st_size;
+#if defined(__APPLE__)
+    input->mtime = st.st_mtimespec.tv_sec*1000000000LL + st.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+    input->mtime = st.st_mtime*1000000000LL;
+#else
+    input->mtime = st.st_mtim.tv_sec*1000000000LL + st.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+static bool input_is_unchanged(struct manifest *manifest, char *filename, struct manifest_input *recorded) {
+    struct manifest_input current;
+    if (!streq(filename, recorded->filename) || !stat_input(filename, &current)) return false;
+    if (current.size != recorded->size) return false;
+    if (current.mtime == recorded->mtime) return true;
+
+    // touched, but possibly not modified
+    if (!hash_file(filename, &current.hash) || current.hash != recorded->hash) return false;
+    recorded->mtime = current.mtime;
+    manifest->changed = true;
+    return true;
+}
+
+bool manifest_snapshot(char *filename, struct manifest_input *input) {
+    // Records an input's state before it's read, for manifest_record(). The
+    // filename isn't copied. If the input can't be read, the snapshot is empty
+    // and the output won't be recorded.
+    input->filename = filename;
+    if (stat_input(filename, input) && hash_file(filename, &input->hash)) return true;
+    input->filename = NULL;
+    return false;
+}
+
+static bool is_recordable(char *str) {
+    // fields can't contain the separators
+    return !strpbrk(str, "\t\n");
+}
+
+struct manifest *manifest_load(char *filename) {
+    struct manifest *manifest = xmalloc(sizeof(*manifest));
+    manifest->entries = hashmap_new_with_allocator(xmalloc, xrealloc, free,
+                                                   sizeof(struct manifest_entry), 64, 0, 0,
+                                                   manifest_entry_hash, manifest_entry_cmp,
+                                                   manifest_entry_free, NULL);
+    manifest->changed = false;
+
+    FILE *f = fopen(filename, "r");
+    if (!f) return manifest; // a new manifest
+
+    char *buffer = xmalloc(4*BUFFSIZE);
+    while (readline(buffer, 4*BUFFSIZE, f)) {
+        char *line = buffer, *fields[MANIFEST_FIELDS];
+        if (starts_with(line, "#")) continue;
+        line[strcspn(line, "\n")] = '\0';
+
+        int n = 0;
+        while (line && n < MANIFEST_FIELDS) {
+            fields[n++] = line;
+            line = bifurcate(line, '\t');
+        }
+        if (n < MANIFEST_FIELDS) continue; // damaged, the output will be rebuilt
+
+        struct manifest_entry entry = {
+            .output_filename = xstrdup(fields[0]),
+            .stamp = xstrdup(fields[1]),
+            .asf = {
+                .filename = xstrdup(fields[2]),
+                .size = strtoll(fields[3], NULL, 10),
+                .mtime = strtoll(fields[4], NULL, 10),
+                .hash = strtoull(fields[5], NULL, 16)
+            },
+            .amc = {
+                .filename = xstrdup(fields[6]),
+                .size = strtoll(fields[7], NULL, 10),
+                .mtime = strtoll(fields[8], NULL, 10),
+                .hash = strtoull(fields[9], NULL, 16)
+            }
+        };
+        struct manifest_entry *replaced = hashmap_set(manifest->entries, &entry);
+        if (replaced) manifest_entry_free(replaced);
+    }
+
+    free(buffer);
+    fclose(f);
+    return manifest;
+}
+
+void manifest_free(struct manifest *manifest) {
+    hashmap_free(manifest->entries);
+    free(manifest);
+}
+
+void manifest_stamp(char *stamp, size_t len, float fps, struct output_options *options) {
+    // everything besides the input files that affects the output, including
+    // the contents of the target rig, which can change under the same name
+    char rig[BUFFSIZE] = "none";
+    uint64_t rig_hash;
+    if (options->retarget) {
+        if (hash_file(options->retarget, &rig_hash)) snprintf(rig, sizeof(rig), "%s#%016" PRIx64, options->retarget, rig_hash);
+        else snprintf(rig, sizeof(rig), "%s#unreadable", options->retarget);
+    }
+    snprintf(stamp, len, "v%u.%u.%u fps=%g raw=%d quaternions=%d storage=%s joints=%s exclude-joints=%s scale=%g up=%s forward=%s stats=%d retarget=%s",
+             VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH,
+             fps, options->raw, options->quaternions, sample_storage_name(options->storage),
+             options->joints ? options->joints : "all",
+             options->exclude_joints ? options->exclude_joints : "none",
+             options->scale,
+             options->up_axis ? options->up_axis : "y",
+             options->forward_axis ? options->forward_axis : "z",
+             options->stats,
+             rig);
+}
+
+bool manifest_is_up_to_date(struct manifest *manifest, char *output_filename, char *stamp, char *asf_filename, char *amc_filename) {
+    struct manifest_entry search = { .output_filename = output_filename },
+                          *entry = hashmap_get(manifest->entries, &search);
+    struct stat st;
+
+    return entry
+        && streq(entry->stamp, stamp)
+        && !stat(output_filename, &st)
+        && input_is_unchanged(manifest, asf_filename, &entry->asf)
+        && input_is_unchanged(manifest, amc_filename, &entry->amc);
+}
+
+void manifest_record(struct manifest *manifest, char *output_filename, char *stamp, struct manifest_input *asf, struct manifest_input *amc) {
+    // records the inputs as they were snapshotted before the conversion
+    struct manifest_entry entry = {
+        .output_filename = xstrdup(output_filename),
+        .stamp = xstrdup(stamp),
+        .asf = *asf,
+        .amc = *amc
+    };
+    bool ok = asf->filename && amc->filename
+           && is_recordable(output_filename) && is_recordable(asf->filename) && is_recordable(amc->filename);
+    entry.asf.filename = asf->filename ? xstrdup(asf->filename) : NULL;
+    entry.amc.filename = amc->filename ? xstrdup(amc->filename) : NULL;
+
+    // the old entry is stale either way
+    struct manifest_entry *replaced;
+    if (ok) {
+        replaced = hashmap_set(manifest->entries, &entry);
+    } else {
+        replaced = hashmap_delete(manifest->entries, &entry);
+        manifest_entry_free(&entry);
+    }
+    if (replaced) manifest_entry_free(replaced);
+    manifest->changed = true;
+}
+
+static bool write_manifest_entry(const void *item, void *data) {
+    const struct manifest_entry *entry = item;
+    FILE *f = data;
+    fprintf(f, "%s\t%s\t%s\t%lld\t%lld\t%016" PRIx64 "\t%s\t%lld\t%lld\t%016" PRIx64 "\n",
+            entry->output_filename, entry->stamp,
+            entry->asf.filename, entry->asf.size, entry->asf.mtime, entry->asf.hash,
+            entry->amc.filename, entry->amc.size, entry->amc.mtime, entry->amc.hash);
+    return true;
+}
+
+int manifest_save(struct manifest *manifest, char *filename) {
+    if (!manifest->changed) return 0;
+
+    // Write a new manifest and move it into place, so that the manifest is
+    // never left half-written. Concurrent runs sharing a manifest may lose each
+    // other's entries, but that only means those outputs are rebuilt.
+    char *tmp_filename = xmalloc(strlen(filename)+5);
+    sprintf(tmp_filename, "%s.tmp", filename);
+    FILE *f = fopen(tmp_filename, "w");
+    if (!f) {
+        free(tmp_filename);
+        return 1;
+    }
+
+    fprintf(f, MANIFEST_HEADER "\n");
+    hashmap_scan(manifest->entries, write_manifest_entry, f);
+    int err = fclose(f);
+#ifdef _WIN32
+    if (!err) remove(filename); // rename() won't replace a file on Windows
+#endif
+    err = err || rename(tmp_filename, filename);
+    if (err) {
+        int saved_errno = errno;
+        remove(tmp_filename);
+        errno = saved_errno;
+    } else {
+        manifest->changed = false;
+    }
+    free(tmp_filename);
+    return err;
+}
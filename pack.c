@@ -0,0 +1,694 @@
+// Motion packs: a whole library of takes in one compressed, indexed file.
+// Each ASF skeleton is stored once, already parsed, and each take's motion is
+// split into blocks of PACK_BLOCK_FRAMES frames that can be decoded on their
+// own, so any take or range of frames can be read without touching the rest.
+//
+// A pack is laid out as
+//
+//   "AMCPACK\1"  skeletons...  blocks...  index  index-offset(u64)  index-length(u64)
+//
+// where everything is little-endian, skeletons are deflated, and the index
+// lists the skeletons and then the takes, sorted by name, with the offset and
+// length of each of their blocks. A block is a take's samples for a run of
+// frames, stored channel by channel as the difference from the previous
+// frame. Sample values are first mapped to integers that sort the same way,
+// so nearby values have small differences, and the differences are split
+// into byte planes before deflating so that their mostly-zero high bytes
+// compress well. This is lossless, unless the motion was parsed into 16-bit
+// storage, in which case the packed motion has the error that was reported.
+
+#include <string.h>
+#include <errno.h>
+#include "amc2bvh.h"
+
+#ifndef AMC2BVH_NO_ZLIB
+
+#include <zlib.h>
+
+#define PACK_MAGIC "AMCPACK\1"
+#define PACK_BLOCK_FRAMES 256
+
+struct pack_skeleton {
+    char *name;
+    uint64_t offset;
+    uint32_t length;        // deflated
+    uint32_t raw_length;
+};
+
+struct pack_clip {
+    char *name;
+    unsigned skeleton;
+    unsigned frames;
+    unsigned channels;
+    enum sample_storage storage;
+    float max_rotation_error;
+    float max_translation_error;
+    unsigned block_count;
+    uint64_t *block_offsets;
+    uint32_t *block_lengths;
+};
+
+struct motion_pack {
+    FILE *f;
+    char *filename;
+    unsigned skeleton_count;
+    struct pack_skeleton *skeletons;
+    unsigned clip_count;
+    struct pack_clip *clips;
+};
+
+struct byte_buffer {
+    unsigned char *data;
+    size_t len, cap;
+};
+
+struct byte_reader {
+    const unsigned char *data;
+    size_t len, pos;
+    char *filename;         // for errors
+};
+
+static unsigned char *buffer_reserve(struct byte_buffer *buf, size_t len) {
+    // room for `len` more bytes, which are counted as written
+    if (buf->len+len > buf->cap) {
+        while (buf->len+len > buf->cap) buf->cap = buf->cap ? 2*buf->cap : 4096;
+        buf->data = xrealloc(buf->data, buf->cap);
+    }
+    buf->len += len;
+    return buf->data + buf->len - len;
+}
+
+static void put_uint(struct byte_buffer *buf, uint64_t val, int bytes) {
+    unsigned char *dest = buffer_reserve(buf, bytes);
+    for (int i = 0; i < bytes; i++) dest[i] = val >> 8*i;
+}
+
+static void put_f32(struct byte_buffer *buf, float val) {
+    uint32_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+    put_uint(buf, bits, 4);
+}
+
+static void put_string(struct byte_buffer *buf, const char *str) {
+    size_t len = strlen(str);
+    put_uint(buf, len, 2);
+    memcpy(buffer_reserve(buf, len), str, len);
+}
+
+static const unsigned char *get_bytes(struct byte_reader *reader, size_t len) {
+    if (len > reader->len - reader->pos) FAIL("'%s' is not a valid motion pack\n", reader->filename);
+    reader->pos += len;
+    return reader->data + reader->pos - len;
+}
+
+static uint64_t get_uint(struct byte_reader *reader, int bytes) {
+    const unsigned char *src = get_bytes(reader, bytes);
+    uint64_t val = 0;
+    for (int i = 0; i < bytes; i++) val |= (uint64_t) src[i] << 8*i;
+    return val;
+}
+
+static float get_f32(struct byte_reader *reader) {
+    uint32_t bits = get_uint(reader, 4);
+    float val;
+    memcpy(&val, &bits, sizeof(val));
+    return val;
+}
+
+static char *get_string(struct byte_reader *reader) {
+    size_t len = get_uint(reader, 2);
+    char *str = xmalloc(len+1);
+    memcpy(str, get_bytes(reader, len), len);
+    str[len] = '\0';
+    return str;
+}
+
+/*
+  SKELETONS
+*/
+
+static void serialize_skeleton(struct byte_buffer *buf, struct amc_skeleton *skeleton) {
+    // everything needed to convert motion, after the output options are applied
+    put_uint(buf, skeleton->joint_count, 4);
+    put_f32(buf, skeleton->root_position.x);
+    put_f32(buf, skeleton->root_position.y);
+    put_f32(buf, skeleton->root_position.z);
+    put_f32(buf, skeleton->translation_scale);
+    put_uint(buf, skeleton->has_convention, 1);
+    put_f32(buf, skeleton->basis.w);
+    put_f32(buf, skeleton->basis.x);
+    put_f32(buf, skeleton->basis.y);
+    put_f32(buf, skeleton->basis.z);
+    put_f32(buf, skeleton->unit_scale);
+    for (unsigned i = 0; i < skeleton->joint_count; i++) {
+        put_string(buf, skeleton->names[i]);
+        put_uint(buf, skeleton->parents[i], 4);
+        put_f32(buf, skeleton->directions[i].x);
+        put_f32(buf, skeleton->directions[i].y);
+        put_f32(buf, skeleton->directions[i].z);
+        put_f32(buf, skeleton->rotations[i].w);
+        put_f32(buf, skeleton->rotations[i].x);
+        put_f32(buf, skeleton->rotations[i].y);
+        put_f32(buf, skeleton->rotations[i].z);
+        put_f32(buf, skeleton->lengths[i]);
+        for (int c = 0; c < CHANNEL_COUNT; c++) put_uint(buf, skeleton->channels[i][c], 1);
+    }
+}
+
+static struct amc_skeleton *deserialize_skeleton(struct byte_reader *reader) {
+    // Joints are stored in depth-first order, so rebuilding the tree from
+    // their parents keeps them in the same order.
+    struct amc_skeleton *skeleton = amc_skeleton_new();
+    unsigned count = get_uint(reader, 4);
+    struct vec3 root_position;
+    root_position.x = get_f32(reader);
+    root_position.y = get_f32(reader);
+    root_position.z = get_f32(reader);
+    float translation_scale = get_f32(reader);
+    skeleton->has_convention = get_uint(reader, 1);
+    skeleton->basis.w = get_f32(reader);
+    skeleton->basis.x = get_f32(reader);
+    skeleton->basis.y = get_f32(reader);
+    skeleton->basis.z = get_f32(reader);
+    skeleton->unit_scale = get_f32(reader);
+    if (count == 0) FAIL("'%s' is not a valid motion pack\n", reader->filename);
+
+    unsigned *edges = xmalloc(2*sizeof(*edges)*count);
+    for (unsigned i = 0; i < count; i++) {
+        char *name = get_string(reader);
+        unsigned joint = 0;
+        if (i == 0) {
+            free(name); // the root is already there
+        } else {
+            joint = amc_skeleton_add_joint(skeleton, name);
+            jointmap_set(skeleton->map, name, joint);
+        }
+        unsigned parent = get_uint(reader, 4);
+        if (i > 0 && parent >= i) FAIL("'%s' is not a valid motion pack\n", reader->filename);
+        edges[2*i] = parent;
+        edges[2*i+1] = i;
+        skeleton->directions[joint].x = get_f32(reader);
+        skeleton->directions[joint].y = get_f32(reader);
+        skeleton->directions[joint].z = get_f32(reader);
+        skeleton->rotations[joint].w = get_f32(reader);
+        skeleton->rotations[joint].x = get_f32(reader);
+        skeleton->rotations[joint].y = get_f32(reader);
+        skeleton->rotations[joint].z = get_f32(reader);
+        skeleton->lengths[joint] = get_f32(reader);
+        for (int c = 0; c < CHANNEL_COUNT; c++) {
+            unsigned channel = get_uint(reader, 1);
+            skeleton->channels[joint][c] = channel <= CHANNEL_EMPTY ? channel : CHANNEL_EMPTY;
+        }
+    }
+
+    skeleton->root_position = root_position;
+    amc_skeleton_build_tree(skeleton, edges+2, count-1, false);
+    skeleton->translation_scale = translation_scale;
+    free(edges);
+    return skeleton;
+}
+
+/*
+  BLOCKS
+*/
+
+static unsigned storage_width(enum sample_storage storage) {
+    return storage == STORAGE_FLOAT32 ? 4 : 2;
+}
+
+static uint32_t load_value(struct amc_sample *sample, unsigned i) {
+    // as an unsigned integer that sorts like the value itself
+    if (sample->storage == STORAGE_FLOAT32) {
+        uint32_t bits;
+        memcpy(&bits, sample->data + 4*i, 4);
+        return bits & 0x80000000 ? ~bits : bits | 0x80000000;
+    }
+    uint16_t bits;
+    memcpy(&bits, sample->data + 2*i, 2);
+    if (sample->storage == STORAGE_INT16) return bits ^ 0x8000;
+    return bits & 0x8000 ? (uint16_t) ~bits : bits | 0x8000;
+}
+
+static void store_value(struct amc_sample *sample, unsigned i, uint32_t val) {
+    // the inverse of load_value()
+    if (sample->storage == STORAGE_FLOAT32) {
+        uint32_t bits = val & 0x80000000 ? val & 0x7fffffff : ~val;
+        memcpy(sample->data + 4*i, &bits, 4);
+        return;
+    }
+    uint16_t bits;
+    if (sample->storage == STORAGE_INT16) bits = val ^ 0x8000;
+    else bits = val & 0x8000 ? val & 0x7fff : (uint16_t) ~val;
+    memcpy(sample->data + 2*i, &bits, 2);
+}
+
+static void encode_block(struct byte_buffer *out, struct amc_sample *sample, unsigned frames, unsigned channels, uint32_t *previous) {
+    // Appends the deltas of `frames` samples in byte planes, plane by plane,
+    // then channel by channel, then frame by frame. `previous` must be zeroed.
+    unsigned width = storage_width(sample->storage);
+    uint32_t mask = width == 4 ? 0xffffffff : 0xffff;
+    size_t plane_len = (size_t) frames*channels;
+    unsigned char *planes = buffer_reserve(out, plane_len*width);
+
+    for (unsigned f = 0; f < frames; f++, sample = sample->next) {
+        for (unsigned c = 0; c < channels; c++) {
+            uint32_t val = load_value(sample, c),
+                     diff = (val - previous[c]) & mask,
+                     zigzag = ((diff << 1) & mask) ^ (diff >> (8*width-1) ? mask : 0);
+            previous[c] = val;
+            for (unsigned b = 0; b < width; b++) {
+                planes[b*plane_len + (size_t) c*frames + f] = zigzag >> 8*b;
+            }
+        }
+    }
+}
+
+static void decode_block(const unsigned char *planes, struct amc_sample **samples, unsigned frames, unsigned channels, uint32_t *previous) {
+    // the inverse of encode_block()
+    unsigned width = storage_width(samples[0]->storage);
+    uint32_t mask = width == 4 ? 0xffffffff : 0xffff;
+    size_t plane_len = (size_t) frames*channels;
+
+    for (unsigned c = 0; c < channels; c++) {
+        uint32_t val = previous[c];
+        for (unsigned f = 0; f < frames; f++) {
+            uint32_t zigzag = 0;
+            for (unsigned b = 0; b < width; b++) {
+                zigzag |= (uint32_t) planes[b*plane_len + (size_t) c*frames + f] << 8*b;
+            }
+            uint32_t diff = (zigzag >> 1) ^ (zigzag & 1 ? mask : 0);
+            val = (val + diff) & mask;
+            store_value(samples[f], c, val);
+        }
+        previous[c] = val;
+    }
+}
+
+/*
+  WRITING
+*/
+
+static int find_skeleton(char **asf_stems, unsigned asf_count, char *amc_stem) {
+    // the only ASF file, or else the one asf_stem_for_amc() pairs it with
+    if (asf_count == 1) return 0;
+    char *stem;
+    for (unsigned choice = 0; (stem = asf_stem_for_amc(amc_stem, choice)); choice++) {
+        for (unsigned i = 0; i < asf_count; i++) {
+            if (streq(asf_stems[i], stem)) {
+                free(stem);
+                return i;
+            }
+        }
+        free(stem);
+    }
+    return -1;
+}
+
+static int compare_clips(const void *a, const void *b) {
+    return strcmp(((const struct pack_clip *) a)->name, ((const struct pack_clip *) b)->name);
+}
+
+static bool write_deflated(FILE *f, uint64_t *offset, struct byte_buffer *raw, uint32_t *length) {
+    // deflates `raw` to the end of the pack
+    uLongf len = compressBound(raw->len);
+    unsigned char *deflated = xmalloc(len);
+    if (compress2(deflated, &len, raw->data, raw->len, Z_DEFAULT_COMPRESSION) != Z_OK) FAIL("Unable to compress motion data\n");
+    bool ok = fwrite(deflated, 1, len, f) == len;
+    free(deflated);
+    *length = len;
+    *offset += len;
+    return ok;
+}
+
+int write_pack(char *pack_filename, char **inputs, unsigned input_count, struct output_options *options, bool verbose) {
+    // Packs every AMC file in `inputs` with its ASF skeleton, which is also
+    // in `inputs`. Returns nonzero if the pack couldn't be written or any take
+    // failed, after reporting it.
+    FILE *f = fopen(pack_filename, "wb");
+    if (!f) {
+        fprintf(stderr, "Error: cannot access '%s': %s\n", pack_filename, strerror(errno));
+        return 1;
+    }
+    fwrite(PACK_MAGIC, 1, 8, f);
+    uint64_t offset = 8, amc_bytes = 0;
+
+    // the skeletons first, parsed once
+    unsigned asf_count = 0, failed = 0;
+    char **asf_stems = xmalloc(sizeof(*asf_stems)*input_count);
+    struct amc_skeleton **skeletons = xmalloc(sizeof(*skeletons)*input_count);
+    struct pack_skeleton *packed_skeletons = xmalloc(sizeof(*packed_skeletons)*input_count);
+    struct byte_buffer buf = { .data = NULL, .len = 0, .cap = 0 };
+    for (unsigned i = 0; i < input_count; i++) {
+        if (!is_input_type(inputs[i], ".asf")) continue;
+        FILE *asf = open_input(inputs[i]);
+        if (!asf) FAIL("cannot access '%s': %s\n", inputs[i], strerror(errno));
+        struct amc_skeleton *skeleton = parse_asf_skeleton(asf, verbose);
+        fclose(asf);
+        amc_skeleton_apply_options(skeleton, options, verbose);
+
+        buf.len = 0;
+        serialize_skeleton(&buf, skeleton);
+        struct pack_skeleton *packed = &packed_skeletons[asf_count];
+        packed->name = file_stem(inputs[i]);
+        packed->offset = offset;
+        packed->raw_length = buf.len;
+        write_deflated(f, &offset, &buf, &packed->length);
+        asf_stems[asf_count] = packed->name;
+        skeletons[asf_count++] = skeleton;
+    }
+
+    // then each take's blocks
+    unsigned clip_count = 0;
+    struct pack_clip *clips = xmalloc(sizeof(*clips)*input_count);
+    float max_rotation_error = 0, max_translation_error = 0;
+    for (unsigned i = 0; i < input_count; i++) {
+        if (is_input_type(inputs[i], ".asf")) continue;
+        char *name = file_stem(inputs[i]);
+        int s = find_skeleton(asf_stems, asf_count, name);
+        bool is_duplicate = false;
+        for (unsigned c = 0; c < clip_count; c++) is_duplicate |= streq(clips[c].name, name);
+        if (s < 0 || is_duplicate) {
+            fprintf(stderr, "Error: %s: %s\n", inputs[i], s < 0 ? "no ASF file to pair it with" : "a take of the same name is already packed");
+            failed++;
+            free(name);
+            continue;
+        }
+
+        FILE *amc = open_input(inputs[i]);
+        if (!amc) {
+            fprintf(stderr, "Error: cannot access '%s': %s\n", inputs[i], strerror(errno));
+            failed++;
+            free(name);
+            continue;
+        }
+        jmp_buf handler;
+        if (setjmp(handler)) {
+            // FAIL() returns here, so one bad file doesn't stop the pack
+            fail_handler = NULL;
+            fclose(amc);
+            fprintf(stderr, "Error: %s: %s\n", inputs[i], fail_message);
+            failed++;
+            free(name);
+            continue;
+        }
+        fail_handler = &handler;
+        struct amc_motion *motion = parse_amc_motion(amc, skeletons[s], options->storage, false);
+        fail_handler = NULL;
+        amc_bytes += ftell(amc);
+        fclose(amc);
+
+        struct pack_clip *clip = &clips[clip_count++];
+        clip->name = name;
+        clip->skeleton = s;
+        clip->frames = motion->sample_count;
+        clip->channels = motion->total_channels;
+        clip->storage = motion->storage;
+        clip->max_rotation_error = motion->max_rotation_error;
+        clip->max_translation_error = motion->max_translation_error;
+        clip->block_count = (clip->frames + PACK_BLOCK_FRAMES-1)/PACK_BLOCK_FRAMES;
+        clip->block_offsets = xmalloc(sizeof(*clip->block_offsets)*(clip->block_count ? clip->block_count : 1));
+        clip->block_lengths = xmalloc(sizeof(*clip->block_lengths)*(clip->block_count ? clip->block_count : 1));
+        if (motion->max_rotation_error > max_rotation_error) max_rotation_error = motion->max_rotation_error;
+        if (motion->max_translation_error > max_translation_error) max_translation_error = motion->max_translation_error;
+
+        TRACE_BEGIN(span);
+        uint32_t *previous = xmalloc(sizeof(*previous)*(clip->channels ? clip->channels : 1));
+        struct amc_sample *sample = motion->samples;
+        for (unsigned b = 0; b < clip->block_count; b++) {
+            unsigned frames = clip->frames - b*PACK_BLOCK_FRAMES;
+            if (frames > PACK_BLOCK_FRAMES) frames = PACK_BLOCK_FRAMES;
+            buf.len = 0;
+            memset(previous, 0, sizeof(*previous)*clip->channels);
+            encode_block(&buf, sample, frames, clip->channels, previous);
+            for (unsigned f = 0; f < frames; f++) sample = sample->next;
+            clip->block_offsets[b] = offset;
+            write_deflated(f, &offset, &buf, &clip->block_lengths[b]);
+        }
+        free(previous);
+        TRACE_END(span, "pack_motion", 0, (long) clip->frames-1);
+        if (verbose) printf("Packed %s (%u frames, %u blocks)\n", inputs[i], clip->frames, clip->block_count);
+        amc_motion_free(motion);
+    }
+
+    // and the index, with the takes sorted for lookup by name
+    qsort(clips, clip_count, sizeof(*clips), compare_clips);
+    uint64_t index_offset = offset;
+    buf.len = 0;
+    put_uint(&buf, asf_count, 4);
+    for (unsigned i = 0; i < asf_count; i++) {
+        put_string(&buf, packed_skeletons[i].name);
+        put_uint(&buf, packed_skeletons[i].offset, 8);
+        put_uint(&buf, packed_skeletons[i].length, 4);
+        put_uint(&buf, packed_skeletons[i].raw_length, 4);
+    }
+    put_uint(&buf, clip_count, 4);
+    for (unsigned i = 0; i < clip_count; i++) {
+        struct pack_clip *clip = &clips[i];
+        put_string(&buf, clip->name);
+        put_uint(&buf, clip->skeleton, 4);
+        put_uint(&buf, clip->frames, 4);
+        put_uint(&buf, clip->channels, 4);
+        put_uint(&buf, clip->storage, 1);
+        put_f32(&buf, clip->max_rotation_error);
+        put_f32(&buf, clip->max_translation_error);
+        put_uint(&buf, PACK_BLOCK_FRAMES, 4);
+        for (unsigned b = 0; b < clip->block_count; b++) {
+            put_uint(&buf, clip->block_offsets[b], 8);
+            put_uint(&buf, clip->block_lengths[b], 4);
+        }
+    }
+    put_uint(&buf, index_offset, 8);
+    put_uint(&buf, buf.len-8, 8);
+    fwrite(buf.data, 1, buf.len, f);
+    offset += buf.len;
+
+    int err = ferror(f) | fclose(f);
+    if (err) fprintf(stderr, "Error: unable to write '%s': %s\n", pack_filename, strerror(errno));
+    printf("Packed %u takes, %u failed, into %.1f MB from %.1f MB of AMC files\n", clip_count, failed, offset/1e6, amc_bytes/1e6);
+    if (options->storage != STORAGE_FLOAT32) {
+        printf("Stored motion as %s, max error %.4g degrees of rotation, %.4g units of translation\n",
+               sample_storage_name(options->storage), max_rotation_error*180/M_PI,
+               max_translation_error*(asf_count ? skeletons[0]->unit_scale : 1));
+    }
+
+    for (unsigned i = 0; i < asf_count; i++) {
+        amc_skeleton_free(skeletons[i]);
+        free(packed_skeletons[i].name);
+    }
+    for (unsigned i = 0; i < clip_count; i++) {
+        free(clips[i].name);
+        free(clips[i].block_offsets);
+        free(clips[i].block_lengths);
+    }
+    free(asf_stems);
+    free(skeletons);
+    free(packed_skeletons);
+    free(clips);
+    free(buf.data);
+    return err || failed > 0;
+}
+
+/*
+  READING
+*/
+
+static unsigned char *read_at(struct motion_pack *pack, uint64_t offset, size_t len) {
+    unsigned char *data = xmalloc(len ? len : 1);
+    if (fseek(pack->f, offset, SEEK_SET) || fread(data, 1, len, pack->f) != len) {
+        FAIL("'%s' is not a valid motion pack\n", pack->filename);
+    }
+    return data;
+}
+
+static unsigned char *read_deflated(struct motion_pack *pack, uint64_t offset, uint32_t len, size_t raw_len) {
+    unsigned char *deflated = read_at(pack, offset, len),
+                  *raw = xmalloc(raw_len ? raw_len : 1);
+    uLongf inflated_len = raw_len;
+    if (uncompress(raw, &inflated_len, deflated, len) != Z_OK || inflated_len != raw_len) {
+        FAIL("'%s' is not a valid motion pack\n", pack->filename);
+    }
+    free(deflated);
+    return raw;
+}
+
+struct motion_pack *pack_open(char *filename) {
+    // Reads a pack's index. Returns NULL with errno set if the file can't be
+    // opened, and fails if it isn't a pack.
+    FILE *f = fopen(filename, "rb");
+    if (!f) return NULL;
+    struct motion_pack *pack = xmalloc(sizeof(*pack));
+    pack->f = f;
+    pack->filename = filename;
+
+    char magic[8];
+    unsigned char *trailer_data;
+    if (fread(magic, 1, 8, f) != 8 || memcmp(magic, PACK_MAGIC, 8) || fseek(f, -16, SEEK_END)) {
+        FAIL("'%s' is not a valid motion pack\n", filename);
+    }
+    long trailer_offset = ftell(f);
+    trailer_data = read_at(pack, trailer_offset, 16);
+    struct byte_reader trailer = { .data = trailer_data, .len = 16, .pos = 0, .filename = filename };
+    uint64_t index_offset = get_uint(&trailer, 8),
+             index_len = get_uint(&trailer, 8);
+    free(trailer_data);
+    // a truncated pack would otherwise point past its end
+    if (trailer_offset < 8 || index_offset < 8 || index_offset > (uint64_t) trailer_offset
+        || index_len > (uint64_t) trailer_offset - index_offset) {
+        FAIL("'%s' is not a valid motion pack\n", filename);
+    }
+
+    unsigned char *index_data = read_at(pack, index_offset, index_len);
+    struct byte_reader index = { .data = index_data, .len = index_len, .pos = 0, .filename = filename };
+    pack->skeleton_count = get_uint(&index, 4);
+    pack->skeletons = xmalloc(sizeof(*pack->skeletons)*(pack->skeleton_count ? pack->skeleton_count : 1));
+    for (unsigned i = 0; i < pack->skeleton_count; i++) {
+        struct pack_skeleton *skeleton = &pack->skeletons[i];
+        skeleton->name = get_string(&index);
+        skeleton->offset = get_uint(&index, 8);
+        skeleton->length = get_uint(&index, 4);
+        skeleton->raw_length = get_uint(&index, 4);
+    }
+    pack->clip_count = get_uint(&index, 4);
+    pack->clips = xmalloc(sizeof(*pack->clips)*(pack->clip_count ? pack->clip_count : 1));
+    for (unsigned i = 0; i < pack->clip_count; i++) {
+        struct pack_clip *clip = &pack->clips[i];
+        clip->name = get_string(&index);
+        clip->skeleton = get_uint(&index, 4);
+        clip->frames = get_uint(&index, 4);
+        clip->channels = get_uint(&index, 4);
+        clip->storage = get_uint(&index, 1);
+        clip->max_rotation_error = get_f32(&index);
+        clip->max_translation_error = get_f32(&index);
+        unsigned block_frames = get_uint(&index, 4);
+        if (clip->skeleton >= pack->skeleton_count || clip->storage > STORAGE_INT16 || block_frames != PACK_BLOCK_FRAMES) {
+            FAIL("'%s' is not a valid motion pack\n", filename);
+        }
+        clip->block_count = (clip->frames + PACK_BLOCK_FRAMES-1)/PACK_BLOCK_FRAMES;
+        clip->block_offsets = xmalloc(sizeof(*clip->block_offsets)*(clip->block_count ? clip->block_count : 1));
+        clip->block_lengths = xmalloc(sizeof(*clip->block_lengths)*(clip->block_count ? clip->block_count : 1));
+        for (unsigned b = 0; b < clip->block_count; b++) {
+            clip->block_offsets[b] = get_uint(&index, 8);
+            clip->block_lengths[b] = get_uint(&index, 4);
+        }
+    }
+    free(index_data);
+    return pack;
+}
+
+void pack_close(struct motion_pack *pack) {
+    fclose(pack->f);
+    for (unsigned i = 0; i < pack->skeleton_count; i++) free(pack->skeletons[i].name);
+    for (unsigned i = 0; i < pack->clip_count; i++) {
+        free(pack->clips[i].name);
+        free(pack->clips[i].block_offsets);
+        free(pack->clips[i].block_lengths);
+    }
+    free(pack->skeletons);
+    free(pack->clips);
+    free(pack);
+}
+
+void pack_list(struct motion_pack *pack, FILE *out) {
+    for (unsigned i = 0; i < pack->clip_count; i++) {
+        struct pack_clip *clip = &pack->clips[i];
+        fprintf(out, "%s\t%u frames\t%s.asf\t%s\n", clip->name, clip->frames,
+                pack->skeletons[clip->skeleton].name, sample_storage_name(clip->storage));
+    }
+}
+
+int pack_find_clip(struct motion_pack *pack, char *name) {
+    // the take's index, or -1 if it isn't in the pack
+    unsigned lo = 0, hi = pack->clip_count;
+    while (lo < hi) {
+        unsigned mid = lo + (hi-lo)/2;
+        int cmp = strcmp(pack->clips[mid].name, name);
+        if (cmp == 0) return mid;
+        if (cmp < 0) lo = mid+1;
+        else hi = mid;
+    }
+    return -1;
+}
+
+struct amc_skeleton *pack_read_skeleton(struct motion_pack *pack, int clip) {
+    struct pack_skeleton *packed = &pack->skeletons[pack->clips[clip].skeleton];
+    unsigned char *data = read_deflated(pack, packed->offset, packed->length, packed->raw_length);
+    struct byte_reader reader = { .data = data, .len = packed->raw_length, .pos = 0, .filename = pack->filename };
+    struct amc_skeleton *skeleton = deserialize_skeleton(&reader);
+    free(data);
+    return skeleton;
+}
+
+struct amc_motion *pack_read_motion(struct motion_pack *pack, int clip_index, struct amc_skeleton *skeleton, unsigned first, unsigned end) {
+    // Decodes frames [first, end) of a take, clamped to its length, decoding
+    // only the blocks that hold them.
+    struct pack_clip *clip = &pack->clips[clip_index];
+    if (clip->channels != skeleton->total_channels) FAIL("'%s' is not a valid motion pack\n", pack->filename);
+    if (end > clip->frames) end = clip->frames;
+    if (first > end) first = end;
+
+    struct amc_motion *motion = amc_motion_new(clip->channels, clip->storage);
+    motion->max_rotation_error = clip->max_rotation_error;
+    motion->max_translation_error = clip->max_translation_error;
+    struct amc_sample **samples = xmalloc(sizeof(*samples)*PACK_BLOCK_FRAMES),
+                      **tail = &motion->samples;
+    uint32_t *previous = xmalloc(sizeof(*previous)*(clip->channels ? clip->channels : 1));
+    TRACE_BEGIN(span);
+    for (unsigned b = first/PACK_BLOCK_FRAMES; b*PACK_BLOCK_FRAMES < end; b++) {
+        unsigned start = b*PACK_BLOCK_FRAMES,
+                 frames = clip->frames - start;
+        if (frames > PACK_BLOCK_FRAMES) frames = PACK_BLOCK_FRAMES;
+        for (unsigned f = 0; f < frames; f++) samples[f] = amc_sample_new(clip->channels, clip->storage);
+
+        size_t raw_len = (size_t) frames*clip->channels*storage_width(clip->storage);
+        unsigned char *planes = read_deflated(pack, clip->block_offsets[b], clip->block_lengths[b], raw_len);
+        memset(previous, 0, sizeof(*previous)*clip->channels);
+        decode_block(planes, samples, frames, clip->channels, previous);
+        free(planes);
+
+        // keep only the requested frames
+        for (unsigned f = 0; f < frames; f++) {
+            if (start+f < first || start+f >= end) {
+                free(samples[f]);
+                continue;
+            }
+            *tail = samples[f];
+            tail = &samples[f]->next;
+            motion->sample_count++;
+        }
+    }
+    TRACE_END(span, "unpack_motion", first, (long) end-1);
+    free(previous);
+    free(samples);
+    return motion;
+}
+
+#else
+
+// without zlib, packs are unavailable
+
+int write_pack(char *pack_filename, char **inputs, unsigned input_count, struct output_options *options, bool verbose) {
+    fprintf(stderr, "Error: this build of amc2bvh doesn't support motion packs\n");
+    return 1;
+}
+
+struct motion_pack *pack_open(char *filename) {
+    FAIL("this build of amc2bvh doesn't support motion packs\n");
+}
+
+void pack_close(struct motion_pack *pack) {}
+
+void pack_list(struct motion_pack *pack, FILE *out) {}
+
+int pack_find_clip(struct motion_pack *pack, char *name) {
+    return -1;
+}
+
+struct amc_skeleton *pack_read_skeleton(struct motion_pack *pack, int clip) {
+    return NULL;
+}
+
+struct amc_motion *pack_read_motion(struct motion_pack *pack, int clip, struct amc_skeleton *skeleton, unsigned first, unsigned end) {
+    return NULL;
+}
+
+#endif
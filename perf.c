@@ -0,0 +1,232 @@
+// Hardware performance counters for each phase of a single conversion: parsing
+// the skeleton, parsing the motion, converting it, and writing it out. Along
+// with wall time, each phase counts cycles, instructions, branch misses, cache
+// misses and page faults, which say whether it's bound by computation, memory
+// or mispredicted branches in a way that timings alone can't.
+//
+// The counters are opened as one group with perf_event_open(), counting user
+// space on the calling thread only, and read at the edges of each span of a
+// phase. Any counter the kernel or hardware won't provide (perf_event_paranoid,
+// a VM without a PMU, a sandbox) is reported as n/a, and with none at all
+// the report still has wall times and rates.
+
+#include <string.h>
+#include <errno.h>
+#include "amc2bvh.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+bool perf_enabled = false;
+
+static const char *phase_names[PERF_PHASE_COUNT] = { "ASF parse", "AMC parse", "conversion", "write" };
+
+struct perf_phase_totals {
+    double ms;
+    double counts[PERF_COUNTER_COUNT];
+    uint64_t frames, bytes;
+    unsigned spans;
+};
+
+static struct perf_phase_totals totals[PERF_PHASE_COUNT];
+static bool scaled;             // multiplexed counts were scaled up
+static int open_error;          // why the first counter that failed to open failed
+
+#ifdef __linux__
+
+static const struct { uint32_t type; uint64_t config; } counter_events[PERF_COUNTER_COUNT] = {
+    [PERF_CYCLES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    [PERF_INSTRUCTIONS] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    [PERF_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    [PERF_CACHE_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    [PERF_PAGE_FAULTS] = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS }
+};
+
+static int leader = -1;
+static int fds[PERF_COUNTER_COUNT];
+static unsigned slots[PERF_COUNTER_COUNT];     // where each open counter is in a group read
+static unsigned open_count;
+
+bool perf_open(void) {
+    // Opens whichever counters are available, returning false with errno set
+    // if none are. Phases are timed either way.
+    memset(totals, 0, sizeof(totals));
+    scaled = false;
+    open_error = 0;
+    open_count = 0;
+    for (unsigned i = 0; i < PERF_COUNTER_COUNT; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counter_events[i].type;
+        attr.config = counter_events[i].config;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        // the first counter to open leads the group, and the rest join it
+        fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+        if (fds[i] < 0) {
+            if (!open_error) open_error = errno;
+            continue;
+        }
+        if (leader < 0) leader = fds[i];
+        slots[i] = open_count++;
+    }
+    perf_enabled = true;
+    if (leader < 0) {
+        errno = open_error;
+        return false;
+    }
+    return true;
+}
+
+void perf_close(void) {
+    for (unsigned i = 0; i < PERF_COUNTER_COUNT; i++) {
+        if (fds[i] >= 0 && fds[i] != leader) close(fds[i]);
+    }
+    if (leader >= 0) close(leader);
+    leader = -1;
+    perf_enabled = false;
+}
+
+struct perf_sample perf_now(void) {
+    struct perf_sample sample = { .ms = now_ms() };
+    if (leader < 0) return sample;
+
+    uint64_t buf[3+PERF_COUNTER_COUNT];
+    if (read(leader, buf, sizeof(buf)) < (ssize_t) (sizeof(*buf)*(3+open_count))) return sample;
+    sample.enabled = buf[1];
+    sample.running = buf[2];
+    for (unsigned i = 0; i < PERF_COUNTER_COUNT; i++) {
+        if (fds[i] >= 0) sample.values[i] = buf[3+slots[i]];
+    }
+    return sample;
+}
+
+static bool counter_is_open(unsigned counter) {
+    return fds[counter] >= 0;
+}
+
+#else
+
+bool perf_open(void) {
+    memset(totals, 0, sizeof(totals));
+    open_error = ENOSYS;
+    perf_enabled = true;
+    errno = ENOSYS;
+    return false;
+}
+
+void perf_close(void) {
+    perf_enabled = false;
+}
+
+struct perf_sample perf_now(void) {
+    return (struct perf_sample) { .ms = now_ms() };
+}
+
+static bool counter_is_open(unsigned counter) {
+    return false;
+}
+
+#endif
+
+void perf_add(enum perf_phase phase, struct perf_sample *start, uint64_t frames, uint64_t bytes) {
+    // Adds the span from `start` until now to a phase, along with the frames
+    // and bytes it handled. While the group was multiplexed with other
+    // events, the counts are scaled up by the time it was actually counting.
+    struct perf_sample end = perf_now();
+    struct perf_phase_totals *t = totals+phase;
+    t->ms += end.ms - start->ms;
+    t->frames += frames;
+    t->bytes += bytes;
+    t->spans++;
+
+    if (end.running <= start->running) return;
+    uint64_t enabled = end.enabled - start->enabled,
+             running = end.running - start->running;
+    double scale = 1;
+    if (running < enabled) {
+        scale = (double) enabled/running;
+        scaled = true;
+    }
+    for (unsigned i = 0; i < PERF_COUNTER_COUNT; i++) {
+        t->counts[i] += (end.values[i] - start->values[i])*scale;
+    }
+}
+
+uint64_t perf_file_bytes(FILE *f) {
+    // how far into a file the conversion got, or 0 if that can't be told (as
+    // for a decompressed stream)
+    long pos = ftell(f);
+    return pos > 0 ? pos : 0;
+}
+
+static void format_count(char *buf, size_t size, double count) {
+    if (count >= 1e9) snprintf(buf, size, "%.2fG", count/1e9);
+    else if (count >= 1e6) snprintf(buf, size, "%.2fM", count/1e6);
+    else if (count >= 1e4) snprintf(buf, size, "%.1fk", count/1e3);
+    else snprintf(buf, size, "%.0f", count);
+}
+
+static void print_counter(FILE *f, struct perf_phase_totals *t, unsigned counter, int width) {
+    char buf[32];
+    if (!counter_is_open(counter)) snprintf(buf, sizeof(buf), "n/a");
+    else format_count(buf, sizeof(buf), t->counts[counter]);
+    fprintf(f, " %*s", width, buf);
+}
+
+static void print_ratio(FILE *f, bool known, double num, double den, const char *fmt, int width) {
+    char buf[32];
+    if (known && den > 0) snprintf(buf, sizeof(buf), fmt, num/den);
+    else snprintf(buf, sizeof(buf), "-");
+    fprintf(f, " %*s", width, buf);
+}
+
+static void print_phase(FILE *f, const char *name, struct perf_phase_totals *t) {
+    fprintf(f, "  %-10s %9.2f", name, t->ms);
+    print_ratio(f, true, t->ms*1e3, t->frames, "%.3f", 9);
+    print_ratio(f, t->bytes > 0, t->bytes/1e6, t->ms/1e3, "%.1f", 7);
+    print_counter(f, t, PERF_CYCLES, 8);
+    print_counter(f, t, PERF_INSTRUCTIONS, 8);
+    print_ratio(f, counter_is_open(PERF_CYCLES) && counter_is_open(PERF_INSTRUCTIONS),
+                t->counts[PERF_INSTRUCTIONS], t->counts[PERF_CYCLES], "%.2f", 5);
+    print_counter(f, t, PERF_BRANCH_MISSES, 8);
+    print_counter(f, t, PERF_CACHE_MISSES, 10);
+    print_counter(f, t, PERF_PAGE_FAULTS, 7);
+    print_ratio(f, counter_is_open(PERF_CYCLES), t->counts[PERF_CYCLES], t->frames, "%.0f", 9);
+    print_ratio(f, counter_is_open(PERF_CYCLES), t->counts[PERF_CYCLES], t->bytes, "%.2f", 8);
+    fprintf(f, "\n");
+}
+
+void perf_report(FILE *f) {
+    // one row per phase that ran, and their total
+    bool any = false;
+    for (unsigned i = 0; i < PERF_COUNTER_COUNT; i++) any |= counter_is_open(i);
+    const char *reason = open_error == EACCES || open_error == EPERM ? "not permitted, see /proc/sys/kernel/perf_event_paranoid" :
+                         open_error == ENOENT || open_error == EOPNOTSUPP ? "not supported by this CPU or VM" : strerror(open_error);
+    if (!any) fprintf(f, "Performance counters unavailable (%s); showing wall times only\n", reason);
+    else if (open_error) fprintf(f, "Some performance counters unavailable (%s)\n", reason);
+    fprintf(f, "  %-10s %9s %9s %7s %8s %8s %5s %8s %10s %7s %9s %8s\n", "phase", "wall ms", "us/frame", "MB/s",
+            "cycles", "instrs", "IPC", "br miss", "cache miss", "faults", "cyc/frame", "cyc/byte");
+
+    struct perf_phase_totals total;
+    memset(&total, 0, sizeof(total));
+    for (unsigned p = 0; p < PERF_PHASE_COUNT; p++) {
+        struct perf_phase_totals *t = totals+p;
+        if (!t->spans) continue;
+        print_phase(f, phase_names[p], t);
+        total.ms += t->ms;
+        total.bytes += t->bytes;
+        if (t->frames > total.frames) total.frames = t->frames;
+        for (unsigned i = 0; i < PERF_COUNTER_COUNT; i++) total.counts[i] += t->counts[i];
+    }
+    // the total's rates are per input byte and frame, if the input's size is known
+    total.bytes = totals[PERF_AMC_PARSE].bytes ? totals[PERF_ASF_PARSE].bytes + totals[PERF_AMC_PARSE].bytes : 0;
+    print_phase(f, "total", &total);
+    if (scaled) fprintf(f, "  (counts were scaled up to make up for time the counters were shared)\n");
+}
@@ -0,0 +1,561 @@
+// A CPython extension module, so that Python programs can load ASF/AMC files
+// directly instead of converting them to BVH and parsing that. Build it with
+// `make python`.
+//
+//   import amc2bvh
+//   skeleton = amc2bvh.Skeleton('06.asf', joints='body')
+//   motion = skeleton.load('06_15.amc')
+//   frames = np.asarray(motion)    # (frames, channels) float32, not copied
+//
+// A Motion holds its frames in a single block of memory, written row by row
+// as each parsed sample is converted, and exposes it through the buffer
+// protocol, so NumPy (or a memoryview) uses the block in place. The columns
+// are the same as those of .npy output, and skeleton.channels() names them.
+// Parsing and conversion run without the GIL, and Skeleton.load_many() loads
+// several files on separate threads.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "amc2bvh.h"
+
+typedef struct {
+    PyObject_HEAD
+    struct amc_skeleton *skeleton;
+    char *retarget;     // the rig it was retargeted onto, or NULL
+} SkeletonObject;
+
+typedef struct {
+    PyObject_HEAD
+    float *data;
+    Py_ssize_t shape[2];
+    Py_ssize_t strides[2];
+} MotionObject;
+
+// a file to load, and the result of loading it
+struct load_job {
+    char *filename;
+    float *data;
+    unsigned frames, channels;
+    char *error;
+    int os_error;       // errno, if the file couldn't be opened or read
+};
+
+struct load_state {
+    struct amc_skeleton *skeleton;
+    struct output_options *options;
+    struct load_job *jobs;
+    unsigned count;
+    unsigned next;
+    pthread_mutex_t lock;   // protects `next`
+};
+
+static PyTypeObject MotionType;
+
+static void load_motion(struct amc_skeleton *skeleton, struct output_options *options, struct load_job *job) {
+    // Parses and converts a file into a single block of rows. Samples are
+    // freed as soon as they're converted, so the parsed motion and the rows
+    // are never both held in full. Called without the GIL.
+    FILE *volatile amc = NULL;
+    struct amc_motion *volatile motion = NULL;
+    jmp_buf handler;
+    if (setjmp(handler)) {
+        fail_handler = NULL;
+        if (amc && ferror(amc) && !job->os_error) job->os_error = EIO;
+        if (amc) fclose(amc);
+        if (motion) amc_motion_free(motion);
+        free(job->data);
+        job->data = NULL;
+        job->error = xstrdup(fail_message);
+        return;
+    }
+    fail_handler = &handler;
+
+    if (!(amc = open_input(job->filename))) {
+        job->os_error = errno;
+        FAIL("cannot access '%s': %s\n", job->filename, strerror(errno));
+    }
+    motion = parse_amc_motion(amc, skeleton, STORAGE_FLOAT32, false);
+    if (ferror(amc)) FAIL("unable to read '%s'\n", job->filename);
+    fclose(amc);
+    amc = NULL;
+
+    job->frames = motion->sample_count;
+    job->channels = options->raw ? amc_channel_count(skeleton) : bvh_channel_count(skeleton, options);
+    size_t values = (size_t) job->frames*job->channels;
+    job->data = xmalloc(sizeof(*job->data)*(values ? values : 1));
+    float *row = job->data;
+    while (motion->samples) {
+        struct amc_sample *sample = motion->samples;
+        row += compute_motion_row(row, skeleton, sample, options, NULL);
+        motion->samples = sample->next;
+        free(sample);
+    }
+    amc_motion_free(motion);
+    motion = NULL;
+    fail_handler = NULL;
+}
+
+static void *load_worker(void *arg) {
+    struct load_state *state = arg;
+    while (true) {
+        pthread_mutex_lock(&state->lock);
+        unsigned i = state->next++;
+        pthread_mutex_unlock(&state->lock);
+        if (i >= state->count) return NULL;
+        load_motion(state->skeleton, state->options, state->jobs+i);
+    }
+}
+
+static void raise_load_error(struct load_job *job, bool with_filename) {
+    // OSError if the file couldn't be opened or read, and ValueError if it
+    // couldn't be parsed
+    if (job->os_error) {
+        errno = job->os_error;
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, job->filename);
+    } else if (with_filename) {
+        PyErr_Format(PyExc_ValueError, "%s: %s", job->filename, job->error);
+    } else {
+        PyErr_SetString(PyExc_ValueError, job->error);
+    }
+}
+
+static PyObject *motion_new(struct load_job *job) {
+    // takes ownership of the job's rows
+    MotionObject *motion = PyObject_New(MotionObject, &MotionType);
+    if (!motion) {
+        free(job->data);
+        return NULL;
+    }
+    motion->data = job->data;
+    motion->shape[0] = job->frames;
+    motion->shape[1] = job->channels;
+    motion->strides[0] = sizeof(float)*job->channels;
+    motion->strides[1] = sizeof(float);
+    job->data = NULL;
+    return (PyObject *) motion;
+}
+
+/*
+  Motion
+*/
+
+static void Motion_dealloc(MotionObject *self) {
+    free(self->data);
+    PyObject_Free(self);
+}
+
+static int Motion_getbuffer(MotionObject *self, Py_buffer *view, int flags) {
+    // the rows are C-contiguous, so any request can be met without copying
+    view->obj = (PyObject *) self;
+    Py_INCREF(self);
+    view->buf = self->data;
+    view->len = self->shape[0]*self->strides[0];
+    view->readonly = 0;
+    view->itemsize = sizeof(float);
+    view->format = (flags & PyBUF_FORMAT) ? "f" : NULL;
+    view->ndim = 2;
+    view->shape = (flags & PyBUF_ND) == PyBUF_ND ? self->shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? self->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+static PyObject *Motion_get_frames(MotionObject *self, void *closure) {
+    return PyLong_FromSsize_t(self->shape[0]);
+}
+
+static PyObject *Motion_get_shape(MotionObject *self, void *closure) {
+    return Py_BuildValue("(nn)", self->shape[0], self->shape[1]);
+}
+
+static Py_ssize_t Motion_length(MotionObject *self) {
+    return self->shape[0];
+}
+
+static PyBufferProcs Motion_as_buffer = {
+    .bf_getbuffer = (getbufferproc) Motion_getbuffer
+};
+
+static PySequenceMethods Motion_as_sequence = {
+    .sq_length = (lenfunc) Motion_length
+};
+
+static PyGetSetDef Motion_getset[] = {
+    { "frames", (getter) Motion_get_frames, NULL, "the number of frames", NULL },
+    { "shape", (getter) Motion_get_shape, NULL, "(frames, channels)", NULL },
+    { NULL }
+};
+
+static PyTypeObject MotionType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "amc2bvh.Motion",
+    .tp_doc = "Converted motion, as a (frames, channels) float32 buffer",
+    .tp_basicsize = sizeof(MotionObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor) Motion_dealloc,
+    .tp_as_buffer = &Motion_as_buffer,
+    .tp_as_sequence = &Motion_as_sequence,
+    .tp_getset = Motion_getset
+};
+
+/*
+  Skeleton
+*/
+
+static int Skeleton_init(SkeletonObject *self, PyObject *args, PyObject *kwargs) {
+    static char *keywords[] = { "asf", "joints", "exclude_joints", "scale", "up_axis", "forward_axis", "retarget", NULL };
+    PyObject *filename;
+    struct output_options options = { .joints = NULL, .exclude_joints = NULL, .scale = 1,
+                                      .up_axis = NULL, .forward_axis = NULL, .retarget = NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O&|zzfzzz", keywords, PyUnicode_FSConverter, &filename,
+                                     &options.joints, &options.exclude_joints, &options.scale,
+                                     &options.up_axis, &options.forward_axis, &options.retarget)) {
+        return -1;
+    }
+
+    // load() and load_many() use the skeleton without the GIL, so it's never replaced
+    if (self->skeleton) {
+        Py_DECREF(filename);
+        PyErr_SetString(PyExc_RuntimeError, "the skeleton has already been loaded");
+        return -1;
+    }
+    const char *invalid = validate_convention(&options);
+    if (invalid) {
+        Py_DECREF(filename);
+        PyErr_SetString(PyExc_ValueError, invalid);
+        return -1;
+    }
+    if (options.scale <= 0) options.scale = 1;
+
+    char *asf_filename = PyBytes_AS_STRING(filename);
+    FILE *volatile asf = NULL;
+    struct amc_skeleton *volatile skeleton = NULL;
+    char *volatile os_filename = NULL; // the file that couldn't be opened or read, if any
+    volatile int os_error = 0;
+    bool failed = false;
+    jmp_buf handler;
+    Py_BEGIN_ALLOW_THREADS
+    if (setjmp(handler)) {
+        if (asf && ferror(asf) && !os_error) {
+            os_error = EIO;
+            os_filename = asf_filename;
+        }
+        if (asf) fclose(asf);
+        if (skeleton) amc_skeleton_free(skeleton);
+        failed = true;
+    } else {
+        fail_handler = &handler;
+        if (!(asf = open_input(asf_filename))) {
+            os_error = errno;
+            os_filename = asf_filename;
+            FAIL("cannot access '%s': %s\n", asf_filename, strerror(errno));
+        }
+        skeleton = parse_asf_skeleton(asf, false);
+        if (ferror(asf)) FAIL("unable to read '%s'\n", asf_filename);
+        fclose(asf);
+        asf = NULL;
+        if (options.retarget) {
+            // target_rig_load() fails the same way whether the rig is missing or malformed
+            FILE *rig = fopen(options.retarget, "r");
+            if (!rig) {
+                os_error = errno;
+                os_filename = options.retarget;
+                FAIL("Unable to open target rig '%s': %s\n", options.retarget, strerror(errno));
+            }
+            fclose(rig);
+        }
+        amc_skeleton_apply_options(skeleton, &options, false);
+    }
+    fail_handler = NULL;
+    Py_END_ALLOW_THREADS
+
+    if (failed) {
+        if (os_error) {
+            errno = os_error;
+            PyErr_SetFromErrnoWithFilename(PyExc_OSError, os_filename);
+        } else {
+            PyErr_SetString(PyExc_ValueError, fail_message);
+        }
+        Py_DECREF(filename);
+        return -1;
+    }
+    Py_DECREF(filename);
+    // another thread may have initialized it while this one was parsing
+    if (self->skeleton) {
+        amc_skeleton_free(skeleton);
+        PyErr_SetString(PyExc_RuntimeError, "the skeleton has already been loaded");
+        return -1;
+    }
+    self->skeleton = skeleton;
+    self->retarget = options.retarget ? xstrdup(options.retarget) : NULL;
+    return 0;
+}
+
+static void Skeleton_dealloc(SkeletonObject *self) {
+    if (self->skeleton) amc_skeleton_free(self->skeleton);
+    free(self->retarget);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static bool check_skeleton(SkeletonObject *self) {
+    if (self->skeleton) return true;
+    PyErr_SetString(PyExc_ValueError, "the skeleton hasn't been loaded");
+    return false;
+}
+
+static bool check_output_options(SkeletonObject *self, struct output_options *options) {
+    // as the command line checks them, along with how the skeleton was loaded
+    options->retarget = self->retarget;
+    const char *invalid = validate_convention(options);
+    if (!invalid) return true;
+    PyErr_SetString(PyExc_ValueError, invalid);
+    return false;
+}
+
+static PyObject *Skeleton_load(SkeletonObject *self, PyObject *args, PyObject *kwargs) {
+    static char *keywords[] = { "amc", "raw", "quaternions", NULL };
+    PyObject *filename;
+    int raw = 0, quaternions = 0;
+    if (!check_skeleton(self)) return NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O&|pp", keywords, PyUnicode_FSConverter, &filename, &raw, &quaternions)) {
+        return NULL;
+    }
+
+    struct output_options options = { .raw = raw, .quaternions = quaternions, .storage = STORAGE_FLOAT32, .scale = 1 };
+    if (!check_output_options(self, &options)) {
+        Py_DECREF(filename);
+        return NULL;
+    }
+    struct load_job job = { .filename = PyBytes_AS_STRING(filename) };
+    Py_BEGIN_ALLOW_THREADS
+    load_motion(self->skeleton, &options, &job);
+    Py_END_ALLOW_THREADS
+    Py_DECREF(filename);
+
+    if (job.error) {
+        raise_load_error(&job, false);
+        free(job.error);
+        return NULL;
+    }
+    return motion_new(&job);
+}
+
+static PyObject *Skeleton_load_many(SkeletonObject *self, PyObject *args, PyObject *kwargs) {
+    static char *keywords[] = { "amcs", "raw", "quaternions", "jobs", NULL };
+    PyObject *filenames;
+    int raw = 0, quaternions = 0;
+    unsigned jobs = 0;
+    if (!check_skeleton(self)) return NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|ppI", keywords, &filenames, &raw, &quaternions, &jobs)) {
+        return NULL;
+    }
+    struct output_options options = { .raw = raw, .quaternions = quaternions, .storage = STORAGE_FLOAT32, .scale = 1 };
+    if (!check_output_options(self, &options)) return NULL;
+    PyObject *seq = PySequence_Fast(filenames, "amcs must be a sequence of paths");
+    if (!seq) return NULL;
+
+    // the paths are kept as bytes objects until everything has loaded
+    Py_ssize_t count = PySequence_Fast_GET_SIZE(seq);
+    PyObject **paths = PyMem_Calloc(count ? count : 1, sizeof(*paths));
+    struct load_job *load_jobs = PyMem_Calloc(count ? count : 1, sizeof(*load_jobs));
+    PyObject *result = NULL;
+    if (!paths || !load_jobs) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (Py_ssize_t i = 0; i < count; i++) {
+        if (!PyUnicode_FSConverter(PySequence_Fast_GET_ITEM(seq, i), &paths[i])) goto done;
+        load_jobs[i].filename = PyBytes_AS_STRING(paths[i]);
+    }
+
+    struct load_state state = {
+        .skeleton = self->skeleton,
+        .options = &options,
+        .jobs = load_jobs,
+        .count = count,
+        .next = 0
+    };
+    if (jobs == 0) jobs = sched_default_workers();
+    if (jobs > count) jobs = count ? count : 1;
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_t *workers = xmalloc(sizeof(*workers)*jobs);
+    unsigned started = 0;
+    for (; started < jobs; started++) {
+        if (pthread_create(&workers[started], NULL, load_worker, &state)) break;
+    }
+    if (started == 0) load_worker(&state); // load on this thread instead
+    for (unsigned i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    free(workers);
+    pthread_mutex_destroy(&state.lock);
+    Py_END_ALLOW_THREADS
+
+    // report the first failure, in the order the files were given
+    for (Py_ssize_t i = 0; i < count; i++) {
+        if (load_jobs[i].error) {
+            raise_load_error(&load_jobs[i], true);
+            goto done;
+        }
+    }
+    if (!(result = PyList_New(count))) goto done;
+    for (Py_ssize_t i = 0; i < count; i++) {
+        PyObject *motion = motion_new(&load_jobs[i]);
+        if (!motion) {
+            Py_CLEAR(result);
+            goto done;
+        }
+        PyList_SET_ITEM(result, i, motion);
+    }
+
+done:
+    for (Py_ssize_t i = 0; load_jobs && i < count; i++) {
+        free(load_jobs[i].data);
+        free(load_jobs[i].error);
+    }
+    for (Py_ssize_t i = 0; paths && i < count; i++) Py_XDECREF(paths[i]);
+    PyMem_Free(paths);
+    PyMem_Free(load_jobs);
+    Py_DECREF(seq);
+    return result;
+}
+
+static PyObject *Skeleton_channels(SkeletonObject *self, PyObject *args, PyObject *kwargs) {
+    static char *keywords[] = { "raw", "quaternions", NULL };
+    int raw = 0, quaternions = 0;
+    if (!check_skeleton(self) || !PyArg_ParseTupleAndKeywords(args, kwargs, "|pp", keywords, &raw, &quaternions)) return NULL;
+
+    struct output_options options = { .raw = raw, .quaternions = quaternions, .scale = 1 };
+    if (!check_output_options(self, &options)) return NULL;
+    struct amc_skeleton *skeleton = self->skeleton;
+    PyObject *list = PyList_New(0);
+    if (!list) return NULL;
+    for (unsigned j = 0; j < skeleton->joint_count; j++) {
+        const char *names[CHANNEL_COUNT];
+        unsigned count = 0;
+        if (options.raw) {
+            while (count < CHANNEL_COUNT && skeleton->channels[j][count] != CHANNEL_EMPTY) {
+                names[count] = amc_channel_name(skeleton->channels[j][count]);
+                count++;
+            }
+        } else {
+            count = bvh_joint_channels(names, skeleton, j, &options);
+        }
+
+        for (unsigned c = 0; c < count; c++) {
+            PyObject *column = Py_BuildValue("(ss)", skeleton->names[j], names[c]);
+            if (!column || PyList_Append(list, column)) {
+                Py_XDECREF(column);
+                Py_DECREF(list);
+                return NULL;
+            }
+            Py_DECREF(column);
+        }
+    }
+    return list;
+}
+
+static PyObject *Skeleton_get_names(SkeletonObject *self, void *closure) {
+    if (!check_skeleton(self)) return NULL;
+    PyObject *names = PyTuple_New(self->skeleton->joint_count);
+    for (unsigned j = 0; names && j < self->skeleton->joint_count; j++) {
+        PyObject *name = PyUnicode_FromString(self->skeleton->names[j]);
+        if (!name) {
+            Py_DECREF(names);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(names, j, name);
+    }
+    return names;
+}
+
+static PyObject *Skeleton_get_parents(SkeletonObject *self, void *closure) {
+    if (!check_skeleton(self)) return NULL;
+    PyObject *parents = PyTuple_New(self->skeleton->joint_count);
+    for (unsigned j = 0; parents && j < self->skeleton->joint_count; j++) {
+        unsigned parent = self->skeleton->parents[j];
+        PyObject *index = PyLong_FromLong(parent == AMC_NO_JOINT ? -1 : (long) parent);
+        if (!index) {
+            Py_DECREF(parents);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(parents, j, index);
+    }
+    return parents;
+}
+
+static PyObject *Skeleton_get_offsets(SkeletonObject *self, void *closure) {
+    if (!check_skeleton(self)) return NULL;
+    // each joint's offset from its parent, as in the BVH hierarchy
+    struct amc_skeleton *skeleton = self->skeleton;
+    PyObject *offsets = PyTuple_New(skeleton->joint_count);
+    for (unsigned j = 0; offsets && j < skeleton->joint_count; j++) {
+        struct vec3 offset = amc_joint_offset(skeleton, j);
+        PyObject *item = Py_BuildValue("(fff)", offset.x, offset.y, offset.z);
+        if (!item) {
+            Py_DECREF(offsets);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(offsets, j, item);
+    }
+    return offsets;
+}
+
+static PyMethodDef Skeleton_methods[] = {
+    { "load", (PyCFunction) (void (*)(void)) Skeleton_load, METH_VARARGS | METH_KEYWORDS,
+      "load(amc, raw=False, quaternions=False)\n--\n\nParse and convert an AMC file into a Motion." },
+    { "load_many", (PyCFunction) (void (*)(void)) Skeleton_load_many, METH_VARARGS | METH_KEYWORDS,
+      "load_many(amcs, raw=False, quaternions=False, jobs=0)\n--\n\n"
+      "Load several AMC files on `jobs` threads (default one per core), returning a list of Motions." },
+    { "channels", (PyCFunction) (void (*)(void)) Skeleton_channels, METH_VARARGS | METH_KEYWORDS,
+      "channels(raw=False, quaternions=False)\n--\n\nThe (joint, channel) names of each column of a Motion." },
+    { NULL }
+};
+
+static PyGetSetDef Skeleton_getset[] = {
+    { "names", (getter) Skeleton_get_names, NULL, "joint names, in depth-first order", NULL },
+    { "parents", (getter) Skeleton_get_parents, NULL, "the index of each joint's parent, -1 for the root", NULL },
+    { "offsets", (getter) Skeleton_get_offsets, NULL, "each joint's (x, y, z) offset from its parent", NULL },
+    { NULL }
+};
+
+static PyTypeObject SkeletonType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "amc2bvh.Skeleton",
+    .tp_doc = "Skeleton(asf, joints=None, exclude_joints=None, scale=1, up_axis=None, forward_axis=None, retarget=None)\n--\n\n"
+              "A skeleton parsed from an ASF file, with the same options as the command line.",
+    .tp_basicsize = sizeof(SkeletonObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) Skeleton_init,
+    .tp_dealloc = (destructor) Skeleton_dealloc,
+    .tp_methods = Skeleton_methods,
+    .tp_getset = Skeleton_getset
+};
+
+static struct PyModuleDef amc2bvh_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "amc2bvh",
+    .m_doc = "Load ASF/AMC motion capture files.",
+    .m_size = -1
+};
+
+PyMODINIT_FUNC PyInit_amc2bvh(void) {
+    if (PyType_Ready(&SkeletonType) < 0 || PyType_Ready(&MotionType) < 0) return NULL;
+    PyObject *module = PyModule_Create(&amc2bvh_module);
+    if (!module) return NULL;
+    Py_INCREF(&SkeletonType);
+    Py_INCREF(&MotionType);
+    if (PyModule_AddObject(module, "Skeleton", (PyObject *) &SkeletonType) < 0
+        || PyModule_AddObject(module, "Motion", (PyObject *) &MotionType) < 0) {
+        Py_DECREF(&SkeletonType);
+        Py_DECREF(&MotionType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}
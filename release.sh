@@ -18,7 +18,7 @@ fi
 printf "creating source archive..."
 dir=${base}_source
 mkdir $dir
-cp README.md Makefile amc2bvh.c amc2bvh.h hashmap.c hashmap.h -t $dir/
+cp README.md Makefile amc2bvh.c amc2bvh.h hashmap.c hashmap.h glb.c follow.c watch.c manifest.c batch.c batchio.c trace.c scan.c stats.c pack.c stream.c retarget.c archive.c tokenize.c sched.c perf.c python.c -t $dir/
 make clean &>> /dev/null
 tar cf $dir.tar $dir/
 rm -rf $dir
@@ -38,7 +38,7 @@ echo "done"
 printf "building windows x86_64..."
 dir=${base}_x86_64_windows
 mkdir $dir
-CC=x86_64-w64-mingw32-gcc make &>> $log
+CC=x86_64-w64-mingw32-gcc ZLIB=0 make &>> $log
 mv amc2bvh.exe $dir/
 cp README.md $dir/
 make clean &> /dev/null
@@ -49,7 +49,7 @@ echo "done"
 printf "building windows i686..."
 dir=${base}_i686_windows
 mkdir $dir
-CC=i686-w64-mingw32-gcc make &>> $log
+CC=i686-w64-mingw32-gcc ZLIB=0 make &>> $log
 mv amc2bvh.exe $dir/
 cp README.md $dir/
 make clean &> /dev/null
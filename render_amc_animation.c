@@ -7,12 +7,19 @@
 // and AMC motion. Press Ctrl-C to stop. It will be fairly difficult to run
 // this on Windows, due to signal handling (which can be easily removed) and
 // ATTYR installation (which is harder to work around).
+//
+// To measure rendering speed, call render_amc_benchmark() with a frame count
+// instead. It renders that many frames into the framebuffer without printing
+// anything, then reports the frame rate, the distribution of frame times, and
+// how the time was split between computing bone transforms and rasterizing.
 
 #include <attyr/attyr.h>
 #include <attyr/short_names.h>
 #include <signal.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 #include <math.h>
 
 #define SCALE 1.5
@@ -109,14 +116,20 @@ void frag_shader(attyr_vec4 *color, attyr_vec3 *coords, attyr_vec3 *pos, void *d
     attyr_init_vec4(color, illum, illum, illum, 1.0);
 }
 
-void render_bone(attyr_framebuffer_t *buffer, struct amc_joint *joint, mat4 *transform) {
-    struct renderstate state = { .face = 0, .scale = joint->length };
-    attyr_dup_mat4x4(transform, &state.transform);
+struct bone_transform {
+    mat4 local;     // the rendering transform of the bone
+    float length;   // the length of the bone
+};
+
+void render_bone(attyr_framebuffer_t *buffer, struct bone_transform *bone) {
+    struct renderstate state = { .face = 0, .scale = bone->length };
+    attyr_dup_mat4x4(&bone->local, &state.transform);
     attyr_rasterize(buffer, vert_shader, frag_shader, &state);
 }
 
-void calculate_animation_transform(mat4 *animation, struct amc_joint *joint, struct amc_sample *sample) {
-    float *anim_data = sample->data + joint->motion_index;
+void calculate_animation_transform(mat4 *animation, struct amc_skeleton *skeleton, unsigned joint, struct amc_sample *sample) {
+    float anim_data[CHANNEL_COUNT];
+    amc_sample_get_channels(anim_data, skeleton, joint, sample);
     mat4 rotation, translation;
     attyr_diag_mat4x4(1, &rotation);
     attyr_diag_mat4x4(1, &translation);
@@ -124,7 +137,7 @@ void calculate_animation_transform(mat4 *animation, struct amc_joint *joint, str
     // T = T3 * T2 * T1
     // R = R3 * R2 * R1
     for (int i = 0; i < CHANNEL_COUNT; i++) {
-        enum channel channel = joint->channels[i];
+        enum channel channel = skeleton->channels[joint][i];
         mat4 ch;
 
         if (channel == CHANNEL_EMPTY) {
@@ -154,8 +167,8 @@ void calculate_animation_transform(mat4 *animation, struct amc_joint *joint, str
     attyr_mult_mat4x4_4x4(&translation, &rotation, animation);
 }
 
-void calculate_axis_transform(mat4 *transform, mat4 *inv_transform, struct amc_joint *joint) {
-    struct euler_triple e = quat_to_euler_xyz(joint->rotation);
+void calculate_axis_transform(mat4 *transform, mat4 *inv_transform, struct amc_skeleton *skeleton, unsigned joint) {
+    struct euler_triple e = quat_to_euler_xyz(skeleton->rotations[joint]);
 
     attyr_diag_mat4x4(1, transform);
     attyr_diag_mat4x4(1, inv_transform);
@@ -184,14 +197,15 @@ void calculate_axis_transform(mat4 *transform, mat4 *inv_transform, struct amc_j
     }
 }
 
-void render_bones(attyr_framebuffer_t *buffer, struct amc_joint *joint, struct amc_sample *sample, mat4 *inherited) {
+void calculate_bone_transform(struct bone_transform *bone, mat4 *transform, struct amc_skeleton *skeleton, unsigned joint, struct amc_sample *sample, mat4 *inherited) {
     // A significant portion of this could be precalculated. But performance is pretty good anyway,
     // and that would complicate the code.
-    vec3 dir = { joint->direction.x, joint->direction.y, joint->direction.z };
-    attyr_scale_vec3(&dir, joint->length);
-    mat4 animation, joint_animation, local, transform, translation, joint_space, inv_joint_space;
-    calculate_animation_transform(&animation, joint, sample);
-    calculate_axis_transform(&joint_space, &inv_joint_space, joint);
+    vec3 dir = { skeleton->directions[joint].x, skeleton->directions[joint].y, skeleton->directions[joint].z };
+    attyr_scale_vec3(&dir, skeleton->lengths[joint]);
+    mat4 animation, joint_animation, translation, joint_space, inv_joint_space;
+    mat4 *local = &bone->local;
+    calculate_animation_transform(&animation, skeleton, joint, sample);
+    calculate_axis_transform(&joint_space, &inv_joint_space, skeleton, joint);
 
     // convert into bone space
     // Ja = J * A * J^
@@ -201,12 +215,12 @@ void render_bones(attyr_framebuffer_t *buffer, struct amc_joint *joint, struct a
     // calculate bone transform (inherited by children)
     // L = Lparent * Ja * B
     attyr_translate(&dir, &translation);
-    attyr_mult_mat4x4_4x4(inherited, &joint_animation, &transform);
-    attyr_mult_mat4x4_4x4(&transform, &translation, &transform);
+    attyr_mult_mat4x4_4x4(inherited, &joint_animation, transform);
+    attyr_mult_mat4x4_4x4(transform, &translation, transform);
 
     // calculate bone rendering transform
     // R = Lparent * Ja * D
-    attyr_mult_mat4x4_4x4(inherited, &joint_animation, &local);
+    attyr_mult_mat4x4_4x4(inherited, &joint_animation, local);
     if (attyr_len_vec3(&dir) > 0) {
         // point the bone in the correct direction
         vec3 axis, i = { 0, 1, 0 };
@@ -215,14 +229,31 @@ void render_bones(attyr_framebuffer_t *buffer, struct amc_joint *joint, struct a
         attyr_normalize_vec3(&axis);
         mat4 rotation;
         attyr_rotate(&axis, acos(attyr_dot_vec3(&dir, &i)), &rotation);
-        attyr_mult_mat4x4_4x4(&local, &rotation, &local);
+        attyr_mult_mat4x4_4x4(local, &rotation, local);
     }
+    bone->length = skeleton->lengths[joint];
+}
 
-    render_bone(buffer, joint, &local);
+unsigned calculate_frame_transforms(struct bone_transform *bones, mat4 *transforms, struct amc_skeleton *skeleton, struct amc_sample *sample) {
+    mat4 rotateY, translate, transform;
+    attyr_rotate_y(1.57, &rotateY);
+    attyr_translate(&(attyr_vec3) { 0, -15, -40 }, &translate);
+    attyr_mult_mat4x4_4x4(&translate, &rotateY, &transform);
+
+    // joints are in depth-first order, so every parent transform is ready
+    // before its children need it
+    for (unsigned i = 0; i < skeleton->joint_count; i++) {
+        unsigned parent = skeleton->parents[i];
+        mat4 *inherited = parent == AMC_NO_JOINT ? &transform : transforms+parent;
+        calculate_bone_transform(bones+i, transforms+i, skeleton, i, sample, inherited);
+    }
+    return skeleton->joint_count;
+}
 
-    for (unsigned i = 0; i < joint->child_count; i++) {
-        struct amc_joint *child = joint->children[i];
-        render_bones(buffer, child, sample, &transform);
+void render_frame(attyr_framebuffer_t *buffer, struct bone_transform *bones, unsigned bone_count) {
+    attyr_reset_framebuffer(buffer);
+    for (unsigned i = 0; i < bone_count; i++) {
+        render_bone(buffer, bones+i);
     }
 }
 
@@ -239,23 +270,77 @@ void render_amc_animation(struct amc_skeleton *skeleton, struct amc_motion *moti
     sigaction(SIGINT, &sa, NULL);
 
     attyr_framebuffer_t *framebuffer = attyr_init_framebuffer((int) (RENDER_WIDTH*SCALE), (int) (RENDER_HEIGHT*SCALE));
+    struct bone_transform *bones = xmalloc(sizeof(*bones)*skeleton->joint_count);
+    mat4 *transforms = xmalloc(sizeof(*transforms)*skeleton->joint_count);
     float time = 0;
     struct amc_sample *sample = motion->samples;
     printf("\x1b[?25l");
     while (is_alive) {
         printf("\x1b[H");
-        attyr_reset_framebuffer(framebuffer);
-
-        mat4 rotateY, translate, transform;
-        attyr_rotate_y(1.57, &rotateY);
-        attyr_translate(&(attyr_vec3) { 0, -15, -40 }, &translate);
-        attyr_mult_mat4x4_4x4(&translate, &rotateY, &transform);
-        render_bones(framebuffer, skeleton->root, sample, &transform);
+        unsigned bone_count = calculate_frame_transforms(bones, transforms, skeleton, sample);
+        render_frame(framebuffer, bones, bone_count);
         attyr_render_truecolor(framebuffer);
 
         sample = sample->next ? sample->next : motion->samples;
         time += 0.01;
     }
     printf("\x1b[?25h\n\n");
+    free(transforms);
+    free(bones);
+    attyr_free_framebuffer(framebuffer);
+}
+
+static double elapsed_ms(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec)*1e3 + (end->tv_nsec - start->tv_nsec)/1e6;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double da = *(const double *) a,
+           db = *(const double *) b;
+    return (da > db) - (da < db);
+}
+
+void render_amc_benchmark(struct amc_skeleton *skeleton, struct amc_motion *motion, unsigned frame_count) {
+    if (frame_count == 0 || !motion->samples) return;
+
+    attyr_framebuffer_t *framebuffer = attyr_init_framebuffer((int) (RENDER_WIDTH*SCALE), (int) (RENDER_HEIGHT*SCALE));
+    struct bone_transform *bones = xmalloc(sizeof(*bones)*skeleton->joint_count);
+    mat4 *transforms = xmalloc(sizeof(*transforms)*skeleton->joint_count);
+    double *frame_times = xmalloc(sizeof(*frame_times)*frame_count),
+           transform_total = 0,
+           raster_total = 0;
+    struct amc_sample *sample = motion->samples;
+
+    for (unsigned i = 0; i < frame_count; i++) {
+        struct timespec start, computed, rasterized;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        unsigned bone_count = calculate_frame_transforms(bones, transforms, skeleton, sample);
+        clock_gettime(CLOCK_MONOTONIC, &computed);
+        render_frame(framebuffer, bones, bone_count);
+        clock_gettime(CLOCK_MONOTONIC, &rasterized);
+
+        transform_total += elapsed_ms(&start, &computed);
+        raster_total += elapsed_ms(&computed, &rasterized);
+        frame_times[i] = elapsed_ms(&start, &rasterized);
+
+        sample = sample->next ? sample->next : motion->samples;
+    }
+
+    double total = transform_total + raster_total;
+    qsort(frame_times, frame_count, sizeof(*frame_times), compare_doubles);
+    printf("Rendered %u frames in %.3f ms (%.1f frames/s)\n", frame_count, total, frame_count/(total/1e3));
+    printf("Frame time (ms): min %.3f, median %.3f, p90 %.3f, p99 %.3f, max %.3f\n",
+           frame_times[0],
+           frame_times[frame_count/2],
+           frame_times[(unsigned) (frame_count*0.9)],
+           frame_times[(unsigned) (frame_count*0.99)],
+           frame_times[frame_count-1]);
+    printf("Transforms: %.3f ms (%.1f%%), rasterization: %.3f ms (%.1f%%)\n",
+           transform_total, 100*transform_total/total,
+           raster_total, 100*raster_total/total);
+
+    free(frame_times);
+    free(transforms);
+    free(bones);
     attyr_free_framebuffer(framebuffer);
 }
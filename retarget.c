@@ -0,0 +1,198 @@
+// Retargeting onto another rig, so that clips come out on a studio's standard
+// hierarchy without a separate pass through a DCC tool. A rig file maps bones
+// to the target's joint names, and can give each joint its rest offset and its
+// rest rotation relative to the source bone:
+//
+//     # SOURCE   TARGET      [offset X Y Z] [rotation X Y Z ORDER]
+//     root       Hips
+//     lfemur     LeftUpLeg   offset 0.09 -0.06 0   rotation 0 0 -20 XYZ
+//
+// Rotations are in degrees, as with the axis of an ASF bone. Bones that aren't
+// listed are dropped, as with --joints, except those connecting listed bones
+// to the root. Offsets and rotations are in the output's units and axes.
+//
+// If a target joint's rest pose is its source bone's rotated by C, its motion
+// is conj(C_parent) * R * C, where R is the source's local rotation. These are
+// folded into the joint's local rotation once, so retargeting costs nothing
+// per frame.
+
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include "amc2bvh.h"
+
+struct rig_joint {
+    char *source;
+    char *target;
+    bool has_offset;
+    struct vec3 offset;     // from the parent on the target rig
+    struct quat rotation;   // from the source bone's rest pose to the target's
+    int line_num;
+};
+
+struct target_rig {
+    char *filename;
+    struct rig_joint *joints;
+    unsigned joint_count;
+    char *sources;          // the source bones, comma-separated, for amc_skeleton_select_joints()
+};
+
+struct target_rig *target_rig_load(char *filename) {
+    FILE *f = fopen(filename, "r");
+    if (!f) FAIL("Unable to open target rig '%s': %s\n", filename, strerror(errno));
+
+    struct target_rig *rig = xmalloc(sizeof(*rig));
+    rig->filename = filename;
+    rig->joints = NULL;
+    rig->joint_count = 0;
+    size_t capacity = 0, sources_len = 0;
+    char buffer[BUFFSIZE];
+    int line_num = 0;
+    while (readline(buffer, BUFFSIZE, f)) {
+        line_num++;
+        char *trimmed = trim(buffer);
+        if (starts_with(trimmed, "#") || strlen(trimmed) == 0) continue;
+
+        // split the line into words
+        char *words[16];
+        int word_count = 0;
+        for (char *c = trimmed; *c; ) {
+            if (isspace(*c)) {
+                *c++ = '\0';
+                continue;
+            }
+            if (word_count == 16) FAIL("Unexpected token `%s' on line %i of '%s'\n", c, line_num, filename);
+            words[word_count++] = c;
+            while (*c && !isspace(*c)) c++;
+        }
+        if (word_count < 2) FAIL("Expected a source and target bone on line %i of '%s'\n", line_num, filename);
+
+        if (rig->joint_count == capacity) {
+            capacity = capacity ? 2*capacity : 32;
+            rig->joints = xrealloc(rig->joints, sizeof(*rig->joints)*capacity);
+        }
+        struct rig_joint *joint = &rig->joints[rig->joint_count++];
+        joint->source = xstrdup(words[0]);
+        joint->target = xstrdup(words[1]);
+        joint->has_offset = false;
+        joint->rotation = (struct quat) { .w=1, .x=0, .y=0, .z=0 };
+        joint->line_num = line_num;
+        sources_len += strlen(words[0]) + 1;
+
+        // optional properties, each a keyword followed by its values
+        for (int w = 2; w < word_count; ) {
+            char *prop = words[w++];
+            if (streq(prop, "offset") && w+3 <= word_count) {
+                joint->has_offset = true;
+                joint->offset = (struct vec3) { atof(words[w]), atof(words[w+1]), atof(words[w+2]) };
+                w += 3;
+            } else if (streq(prop, "rotation") && w+4 <= word_count) {
+                char axis[BUFFSIZE];
+                snprintf(axis, sizeof(axis), "%s %s %s %s", words[w], words[w+1], words[w+2], words[w+3]);
+                joint->rotation = parse_joint_rotation(axis, true, line_num);
+                w += 4;
+            } else {
+                FAIL("Unexpected token `%s' on line %i of '%s'\n", prop, line_num, filename);
+            }
+        }
+    }
+    fclose(f);
+
+    rig->sources = xmalloc(sources_len + 1);
+    rig->sources[0] = '\0';
+    for (unsigned i = 0; i < rig->joint_count; i++) {
+        if (i > 0) strcat(rig->sources, ",");
+        strcat(rig->sources, rig->joints[i].source);
+    }
+    return rig;
+}
+
+void target_rig_free(struct target_rig *rig) {
+    for (unsigned i = 0; i < rig->joint_count; i++) {
+        free(rig->joints[i].source);
+        free(rig->joints[i].target);
+    }
+    free(rig->joints);
+    free(rig->sources);
+    free(rig);
+}
+
+char *target_rig_sources(struct target_rig *rig) {
+    return rig->sources;
+}
+
+void target_rig_check(struct target_rig *rig, struct amc_skeleton *skeleton) {
+    // every source bone must be in the skeleton, checked before the rig's
+    // bones are selected so that errors point into the rig file
+    for (unsigned i = 0; i < rig->joint_count; i++) {
+        struct rig_joint *rig_joint = &rig->joints[i];
+        if (!jointmap_get(skeleton->map, rig_joint->source)) {
+            FAIL("Unrecognized bone `%s' on line %i of '%s'\n", rig_joint->source, rig_joint->line_num, rig->filename);
+        }
+    }
+}
+
+void amc_skeleton_retarget(struct amc_skeleton *skeleton, struct target_rig *rig, bool verbose) {
+    // Renames the skeleton's joints and replaces its rest pose with the rig's.
+    // The skeleton's joints must already be selected, and it must already be
+    // in the output convention.
+    unsigned count = skeleton->joint_count;
+    struct quat *corrections = xmalloc(sizeof(*corrections)*(count ? count : 1));
+    bool *has_offset = xcalloc(count ? count : 1, sizeof(*has_offset)),
+         *has_rig_joint = xcalloc(count ? count : 1, sizeof(*has_rig_joint));
+    struct vec3 *offsets = xmalloc(sizeof(*offsets)*(count ? count : 1)),
+                *end_offsets = xmalloc(sizeof(*end_offsets)*(count ? count : 1));
+    for (unsigned j = 0; j < count; j++) corrections[j] = (struct quat) { .w=1, .x=0, .y=0, .z=0 };
+
+    for (unsigned i = 0; i < rig->joint_count; i++) {
+        struct rig_joint *rig_joint = &rig->joints[i];
+        unsigned j = jointmap_get(skeleton->map, rig_joint->source)->index;
+        if (has_rig_joint[j]) FAIL("Bone `%s' is retargeted more than once in '%s'\n", rig_joint->source, rig->filename);
+        has_rig_joint[j] = true;
+        corrections[j] = rig_joint->rotation;
+        has_offset[j] = rig_joint->has_offset;
+        offsets[j] = rig_joint->offset;
+
+        // the source name stays in the map, so the AMC file can still be read
+        if (!streq(rig_joint->source, rig_joint->target)) {
+            if (jointmap_get(skeleton->map, rig_joint->target)) {
+                FAIL("Target joint `%s' on line %i of '%s' has the name of another bone\n", rig_joint->target, rig_joint->line_num, rig->filename);
+            }
+            char *name = xstrdup(rig_joint->target);
+            jointmap_set(skeleton->map, name, j);
+            skeleton->names[j] = name;
+        }
+        if (verbose) printf("Retargeting bone `%s' onto `%s'\n", rig_joint->source, rig_joint->target);
+    }
+
+    // Offsets that aren't given keep the source's rest pose, as seen from the
+    // parent's rotated rest pose. The same goes for end sites.
+    for (unsigned j = 0; j < count; j++) {
+        unsigned parent = skeleton->parents[j];
+        struct vec3 offset = amc_joint_offset(skeleton, j);
+        if (!has_offset[j]) offsets[j] = parent == AMC_NO_JOINT ? offset : quat_rotate(quat_conj(corrections[parent]), offset);
+        end_offsets[j] = quat_rotate(quat_conj(corrections[j]), amc_joint_end_offset(skeleton, j));
+    }
+
+    // fold the corrections into each joint's local rotation, see compute_joint_rotation()
+    struct quat (*rest_rotations)[2] = xmalloc(sizeof(*rest_rotations)*(count ? count : 1));
+    for (unsigned j = 0; j < count; j++) {
+        unsigned parent = skeleton->parents[j];
+        struct quat local = skeleton->rotations[j],
+                    parent_correction = parent == AMC_NO_JOINT ? (struct quat) { .w=1, .x=0, .y=0, .z=0 } : corrections[parent];
+        rest_rotations[j][0] = quat_mul(quat_conj(parent_correction), local);
+        rest_rotations[j][1] = quat_mul(quat_inv(local), corrections[j]);
+    }
+
+    free(skeleton->offsets);
+    free(skeleton->end_offsets);
+    free(skeleton->rest_rotations);
+    skeleton->offsets = offsets;
+    skeleton->end_offsets = end_offsets;
+    skeleton->rest_rotations = rest_rotations;
+    if (verbose) printf("Retargeted %u of %u bones onto %s\n", rig->joint_count, count, rig->filename);
+
+    free(corrections);
+    free(has_offset);
+    free(has_rig_joint);
+}
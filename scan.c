@@ -0,0 +1,275 @@
+// Inventory of a motion capture library. Every AMC file under the given
+// directories is scanned for its frame count, joints, units and flags, and
+// summarized in one JSON or CSV line per file, so that conversions can be
+// planned without converting anything.
+//
+// Scanning only looks at the first character of most lines, since frames can
+// be counted by their frame number lines without parsing any motion data.
+// Files are scanned in parallel, but reported in order. A file that can't be
+// read or parsed gets an error in its line, and doesn't stop the scan.
+
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "amc2bvh.h"
+
+struct scan_result {
+    bool is_done;
+    long long size;
+    unsigned frames;
+    bool degrees;
+    bool fully_specified;
+    char *joints;       // the joints given data in the first frame, space-separated
+    char *error;        // NULL if the file was scanned successfully
+};
+
+struct scan_state {
+    char **filenames;
+    unsigned count;
+    unsigned next;              // the next file to scan
+    struct scan_result *results;
+    pthread_mutex_t lock;       // protects `next` and `is_done`
+    pthread_cond_t has_result;
+};
+
+static bool is_amc(char *name) {
+    return ends_with(name, ".amc") || ends_with(name, ".AMC");
+}
+
+static void add_filename(char ***filenames, unsigned *count, unsigned *capacity, char *filename) {
+    if (*count == *capacity) {
+        *capacity = *capacity ? 2*(*capacity) : 64;
+        *filenames = xrealloc(*filenames, sizeof(**filenames)*(*capacity));
+    }
+    (*filenames)[(*count)++] = filename;
+}
+
+static void find_amc_files(char *path, char ***filenames, unsigned *count, unsigned *capacity) {
+    // AMC files anywhere below a directory, or the path itself if it's a file
+    struct stat st;
+    if (stat(path, &st) || !S_ISDIR(st.st_mode)) {
+        add_filename(filenames, count, capacity, xstrdup(path)); // errors are reported with the file
+        return;
+    }
+
+    DIR *dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "Error: cannot access '%s': %s\n", path, strerror(errno));
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (streq(entry->d_name, ".") || streq(entry->d_name, "..")) continue;
+        char *child = xmalloc(strlen(path) + 1 + strlen(entry->d_name) + 1);
+        sprintf(child, "%s/%s", path, entry->d_name);
+        if (!stat(child, &st) && S_ISDIR(st.st_mode)) {
+            find_amc_files(child, filenames, count, capacity);
+            free(child);
+        } else if (is_amc(entry->d_name)) {
+            add_filename(filenames, count, capacity, child);
+        } else {
+            free(child);
+        }
+    }
+    closedir(dir);
+}
+
+static int compare_filenames(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static void scan_amc_file(char *filename, struct scan_result *result) {
+    // Fills in everything but `is_done`. FAIL() must have a handler.
+    FILE *f = fopen(filename, "r");
+    if (!f) FAIL("cannot access '%s': %s\n", filename, strerror(errno));
+
+    struct stat st;
+    if (!fstat(fileno(f), &st)) result->size = st.st_size;
+
+    size_t joints_len = 0, joints_cap = 256;
+    result->joints = xmalloc(joints_cap);
+    result->joints[0] = '\0';
+
+    char *buffer = xmalloc(BUFFSIZE);
+    int line_num = 0;
+    while (readline(buffer, BUFFSIZE, f)) {
+        line_num++;
+        if (isdigit(buffer[0])) {
+            result->frames++;
+            continue;
+        } else if (result->frames > 1) {
+            continue; // the joints are already known
+        }
+
+        char *trimmed = trim(buffer);
+        if (starts_with(trimmed, "#") || strlen(trimmed) == 0) continue;
+        if (result->frames == 0) {
+            // the header, as in amc_parse_line()
+            if (streq(trimmed, ":RADIANS")) result->degrees = false;
+            else if (streq(trimmed, ":DEGREES")) result->degrees = true;
+            else if (streq(trimmed, ":FULLY-SPECIFIED")) result->fully_specified = true;
+            else if (isdigit(trimmed[0])) result->frames++;
+            else if (!starts_with(trimmed, ":")) {
+                bifurcate(trimmed, ' ');
+                fclose(f);
+                FAIL("Unexpected token `%s' on line %i\n", trimmed, line_num);
+            }
+        } else if (isdigit(trimmed[0])) {
+            result->frames++;
+        } else {
+            bifurcate(trimmed, ' ');
+            size_t len = strlen(trimmed);
+            while (joints_len + len + 2 > joints_cap) {
+                joints_cap *= 2;
+                result->joints = xrealloc(result->joints, joints_cap);
+            }
+            if (joints_len > 0) result->joints[joints_len++] = ' ';
+            memcpy(result->joints + joints_len, trimmed, len+1);
+            joints_len += len;
+        }
+    }
+
+    free(buffer);
+    if (ferror(f)) {
+        int err = errno;
+        fclose(f);
+        FAIL("unable to read '%s': %s\n", filename, strerror(err));
+    }
+    fclose(f);
+}
+
+static void *scan_worker(void *arg) {
+    struct scan_state *state = arg;
+    while (true) {
+        pthread_mutex_lock(&state->lock);
+        unsigned i = state->next++;
+        pthread_mutex_unlock(&state->lock);
+        if (i >= state->count) return NULL;
+
+        struct scan_result *result = state->results+i;
+        jmp_buf handler;
+        if (setjmp(handler)) {
+            result->error = xstrdup(fail_message);
+        } else {
+            fail_handler = &handler;
+            scan_amc_file(state->filenames[i], result);
+        }
+        fail_handler = NULL;
+
+        pthread_mutex_lock(&state->lock);
+        result->is_done = true;
+        pthread_cond_broadcast(&state->has_result);
+        pthread_mutex_unlock(&state->lock);
+    }
+}
+
+static void fprint_csv_string(FILE *f, const char *str) {
+    fputc('"', f);
+    for (; *str; str++) {
+        if (*str == '"') fputc('"', f);
+        fputc(*str, f);
+    }
+    fputc('"', f);
+}
+
+static void write_scan_result(FILE *out, char *filename, struct scan_result *result, float fps, bool csv) {
+    const char *units = result->degrees ? "degrees" : "radians",
+               *fully_specified = result->fully_specified ? "true" : "false";
+    char *joints = result->joints ? result->joints : "";
+    if (csv) {
+        fprint_csv_string(out, filename);
+        fprintf(out, ",%lld,%u,%f,%s,%s,", result->size, result->frames, result->frames/fps, units, fully_specified);
+        fprint_csv_string(out, joints);
+        fputc(',', out);
+        if (result->error) fprint_csv_string(out, result->error);
+        fputc('\n', out);
+        return;
+    }
+
+    fprintf(out, "{\"file\":");
+    fprint_json_string(out, filename);
+    fprintf(out, ",\"size\":%lld,\"frames\":%u,\"duration\":%f,\"units\":\"%s\",\"fully_specified\":%s,\"joints\":[",
+            result->size, result->frames, result->frames/fps, units, fully_specified);
+    for (char *joint = joints, *next; *joint; joint = next) {
+        next = joint + strcspn(joint, " ");
+        bool is_last = *next == '\0';
+        *next = '\0';
+        if (joint != joints) fputc(',', out);
+        fprint_json_string(out, joint);
+        if (!is_last) *next++ = ' ';
+    }
+    fprintf(out, "],\"error\":");
+    if (result->error) fprint_json_string(out, result->error);
+    else fprintf(out, "null");
+    fprintf(out, "}\n");
+}
+
+int scan_library(char **paths, unsigned path_count, char *output_filename, unsigned jobs, float fps, bool verbose) {
+    // Writes a line for every AMC file to `output_filename`, as CSV if it ends
+    // in .csv and JSON otherwise, or JSON to stdout if it's NULL. Returns
+    // nonzero if the output couldn't be written, after reporting it.
+    bool csv = output_filename && (ends_with(output_filename, ".csv") || ends_with(output_filename, ".CSV"));
+    FILE *out = stdout;
+    if (output_filename && !(out = fopen(output_filename, "w"))) {
+        fprintf(stderr, "Error: cannot access '%s': %s\n", output_filename, strerror(errno));
+        return 1;
+    }
+
+    struct scan_state state = { .filenames = NULL, .count = 0, .next = 0 };
+    unsigned capacity = 0;
+    for (unsigned i = 0; i < path_count; i++) {
+        find_amc_files(paths[i], &state.filenames, &state.count, &capacity);
+    }
+    qsort(state.filenames, state.count, sizeof(*state.filenames), compare_filenames);
+    state.results = xcalloc(state.count ? state.count : 1, sizeof(*state.results));
+    for (unsigned i = 0; i < state.count; i++) state.results[i].degrees = true; // the AMC default
+
+    if (jobs == 0) jobs = sched_default_workers();
+    if (jobs > state.count) jobs = state.count ? state.count : 1;
+    if (verbose) fprintf(stderr, "Scanning %u files with %u threads\n", state.count, jobs);
+
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.has_result, NULL);
+    pthread_t *workers = xmalloc(sizeof(*workers)*jobs);
+    unsigned started = 0;
+    for (; started < jobs; started++) {
+        if (pthread_create(&workers[started], NULL, scan_worker, &state)) break;
+    }
+    if (started == 0) scan_worker(&state); // scan on this thread instead
+
+    // write each result as soon as it and all of those before it are done
+    if (csv) fprintf(out, "file,size,frames,duration,units,fully_specified,joints,error\n");
+    unsigned failed = 0;
+    for (unsigned i = 0; i < state.count; i++) {
+        pthread_mutex_lock(&state.lock);
+        while (!state.results[i].is_done) pthread_cond_wait(&state.has_result, &state.lock);
+        pthread_mutex_unlock(&state.lock);
+
+        struct scan_result *result = state.results+i;
+        write_scan_result(out, state.filenames[i], result, fps, csv);
+        if (result->error) failed++;
+        free(result->joints);
+        free(result->error);
+        free(state.filenames[i]);
+    }
+    for (unsigned i = 0; i < started; i++) pthread_join(workers[i], NULL);
+
+    bool write_failed = ferror(out);
+    write_failed |= out == stdout ? fflush(out) != 0 : fclose(out) != 0;
+    if (write_failed) {
+        if (output_filename) fprintf(stderr, "Error: unable to write '%s': %s\n", output_filename, strerror(errno));
+        else fprintf(stderr, "Error: unable to write to standard output: %s\n", strerror(errno));
+    } else if (output_filename) {
+        printf("Scanned %u files, %u failed\n", state.count, failed);
+    }
+
+    pthread_mutex_destroy(&state.lock);
+    pthread_cond_destroy(&state.has_result);
+    free(workers);
+    free(state.results);
+    free(state.filenames);
+    return write_failed;
+}
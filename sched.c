@@ -0,0 +1,210 @@
+// A work-stealing scheduler for running many tasks of very different sizes on
+// a fixed set of threads. Each worker has its own deque of tasks. Tasks that
+// a worker spawns go on the back of its deque, and it takes its next task from
+// the back too, so related work stays on one thread. A worker that runs out
+// steals from the front of another's deque, where the oldest and usually
+// largest tasks are, so no worker sits idle while there's work anywhere.
+//
+// Tasks are coarse (a whole small file, or thousands of frames), so the
+// deques are simply locked rather than lock-free.
+
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "amc2bvh.h"
+
+struct sched_task {
+    void (*run)(void *arg);
+    void *arg;
+};
+
+struct sched_deque {
+    pthread_mutex_t lock;
+    struct sched_task *tasks;   // a ring of `cap` tasks
+    size_t head, count, cap;
+};
+
+struct sched {
+    unsigned worker_count;
+    struct sched_deque *deques;
+    pthread_t *threads;
+    pthread_mutex_t lock;       // protects the rest
+    pthread_cond_t work;        // signalled when a task is queued, or the workers should stop
+    pthread_cond_t idle;        // signalled when the last unfinished task finishes
+    unsigned queued;            // tasks waiting in deques
+    unsigned unfinished;        // tasks submitted but not yet finished
+    unsigned next_deque;        // where the next task from outside the workers goes
+    bool stopping;
+};
+
+struct sched_worker {
+    struct sched *sched;
+    unsigned index;
+};
+
+// the worker running on this thread, if any
+static _Thread_local struct sched *current_sched = NULL;
+static _Thread_local unsigned current_worker;
+
+unsigned sched_default_workers(void) {
+    // one per core, for batches, --scan and the Python module's load_many()
+#ifdef _SC_NPROCESSORS_ONLN
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores > 0) return cores;
+#endif
+    return 4;
+}
+
+static bool take_task(struct sched *s, unsigned worker, struct sched_task *task) {
+    // the back of the worker's own deque, or else the front of another's
+    for (unsigned i = 0; i < s->worker_count; i++) {
+        bool own = i == 0;
+        struct sched_deque *d = &s->deques[(worker+i) % s->worker_count];
+        pthread_mutex_lock(&d->lock);
+        if (d->count > 0) {
+            if (own) {
+                *task = d->tasks[(d->head + d->count - 1) % d->cap];
+            } else {
+                *task = d->tasks[d->head];
+                d->head = (d->head + 1) % d->cap;
+            }
+            d->count--;
+            pthread_mutex_lock(&s->lock);
+            s->queued--;
+            pthread_mutex_unlock(&s->lock);
+            pthread_mutex_unlock(&d->lock);
+            return true;
+        }
+        pthread_mutex_unlock(&d->lock);
+    }
+    return false;
+}
+
+static void *sched_worker(void *arg) {
+    struct sched_worker *w = arg;
+    struct sched *s = w->sched;
+    current_sched = s;
+    current_worker = w->index;
+    while (true) {
+        struct sched_task task;
+        if (take_task(s, w->index, &task)) {
+            task.run(task.arg);
+            pthread_mutex_lock(&s->lock);
+            if (--s->unfinished == 0) pthread_cond_broadcast(&s->idle);
+            pthread_mutex_unlock(&s->lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&s->lock);
+        while (s->queued == 0 && !s->stopping) pthread_cond_wait(&s->work, &s->lock);
+        bool done = s->queued == 0 && s->stopping;
+        pthread_mutex_unlock(&s->lock);
+        if (done) break;
+    }
+    free(w);
+    return NULL;
+}
+
+struct sched *sched_new(unsigned workers) {
+    // Starts up to `workers` threads. If none can be started, tasks are run
+    // as they're submitted.
+    struct sched *s = xmalloc(sizeof(*s));
+    s->deques = xmalloc(sizeof(*s->deques)*(workers ? workers : 1));
+    s->threads = xmalloc(sizeof(*s->threads)*(workers ? workers : 1));
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->work, NULL);
+    pthread_cond_init(&s->idle, NULL);
+    s->queued = s->unfinished = s->next_deque = 0;
+    s->stopping = false;
+    for (unsigned i = 0; i < workers; i++) {
+        struct sched_deque *d = &s->deques[i];
+        pthread_mutex_init(&d->lock, NULL);
+        d->cap = 64;
+        d->tasks = xmalloc(sizeof(*d->tasks)*d->cap);
+        d->head = d->count = 0;
+    }
+
+    s->worker_count = 0;
+    for (unsigned i = 0; i < workers; i++) {
+        struct sched_worker *w = xmalloc(sizeof(*w));
+        w->sched = s;
+        w->index = i;
+        if (pthread_create(&s->threads[i], NULL, sched_worker, w)) {
+            free(w);
+            break;
+        }
+        s->worker_count++;
+    }
+    for (unsigned i = s->worker_count; i < workers; i++) {
+        pthread_mutex_destroy(&s->deques[i].lock);
+        free(s->deques[i].tasks);
+    }
+    return s;
+}
+
+unsigned sched_worker_count(struct sched *s) {
+    return s->worker_count;
+}
+
+void sched_submit(struct sched *s, void (*run)(void *arg), void *arg) {
+    // Tasks submitted by a task go on the back of its worker's deque, others
+    // are spread across the workers.
+    if (s->worker_count == 0) {
+        run(arg);
+        return;
+    }
+    unsigned worker;
+    if (current_sched == s) {
+        worker = current_worker;
+    } else {
+        pthread_mutex_lock(&s->lock);
+        worker = s->next_deque++ % s->worker_count;
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    struct sched_deque *d = &s->deques[worker];
+    pthread_mutex_lock(&d->lock);
+    if (d->count == d->cap) {
+        // unwrap the ring into a larger one
+        struct sched_task *tasks = xmalloc(sizeof(*tasks)*2*d->cap);
+        for (size_t i = 0; i < d->count; i++) tasks[i] = d->tasks[(d->head + i) % d->cap];
+        free(d->tasks);
+        d->tasks = tasks;
+        d->head = 0;
+        d->cap *= 2;
+    }
+    d->tasks[(d->head + d->count) % d->cap] = (struct sched_task) { .run = run, .arg = arg };
+    d->count++;
+    pthread_mutex_lock(&s->lock);
+    s->queued++;
+    s->unfinished++;
+    pthread_cond_signal(&s->work);
+    pthread_mutex_unlock(&s->lock);
+    pthread_mutex_unlock(&d->lock);
+}
+
+void sched_wait(struct sched *s) {
+    // waits until every task, including those they submitted, has finished
+    pthread_mutex_lock(&s->lock);
+    while (s->unfinished > 0) pthread_cond_wait(&s->idle, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void sched_free(struct sched *s) {
+    // finishes every task, then stops the workers
+    pthread_mutex_lock(&s->lock);
+    s->stopping = true;
+    pthread_cond_broadcast(&s->work);
+    pthread_mutex_unlock(&s->lock);
+    for (unsigned i = 0; i < s->worker_count; i++) {
+        pthread_join(s->threads[i], NULL);
+        pthread_mutex_destroy(&s->deques[i].lock);
+        free(s->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->work);
+    pthread_cond_destroy(&s->idle);
+    free(s->deques);
+    free(s->threads);
+    free(s);
+}
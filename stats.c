@@ -0,0 +1,152 @@
+// Per-channel statistics of the converted motion, for normalizing it as
+// training data. The minimum, maximum, mean and variance of every output
+// channel, and the slowest and fastest rotation of every joint, are collected
+// from each chunk of rows as it's written, so no second pass over the motion
+// or the output is needed.
+//
+// The mean and variance use Welford's update, which stays accurate over long
+// clips. Every channel of a frame shares the same count, so each update is a
+// loop over a contiguous row that the compiler can vectorize.
+
+#include <string.h>
+#include <math.h>
+#include "amc2bvh.h"
+
+struct motion_stats {
+    unsigned channels;
+    unsigned joints;
+    unsigned frames;        // the number of rows added so far
+    double *mean;
+    double *m2;             // the sum of squared differences from the mean
+    float *min;
+    float *max;
+    struct quat *previous;  // each joint's rotation in the last frame added
+    float *min_speed;       // in radians per frame
+    float *max_speed;
+};
+
+struct motion_stats *motion_stats_new(unsigned channels, unsigned joints) {
+    struct motion_stats *stats = xmalloc(sizeof(*stats));
+    stats->channels = channels;
+    stats->joints = joints;
+    stats->frames = 0;
+    stats->mean = xcalloc(channels ? channels : 1, sizeof(*stats->mean));
+    stats->m2 = xcalloc(channels ? channels : 1, sizeof(*stats->m2));
+    stats->min = xmalloc(sizeof(*stats->min)*(channels ? channels : 1));
+    stats->max = xmalloc(sizeof(*stats->max)*(channels ? channels : 1));
+    for (unsigned c = 0; c < channels; c++) {
+        stats->min[c] = INFINITY;
+        stats->max[c] = -INFINITY;
+    }
+    stats->previous = xmalloc(sizeof(*stats->previous)*(joints ? joints : 1));
+    stats->min_speed = xmalloc(sizeof(*stats->min_speed)*(joints ? joints : 1));
+    stats->max_speed = xmalloc(sizeof(*stats->max_speed)*(joints ? joints : 1));
+    for (unsigned j = 0; j < joints; j++) {
+        stats->min_speed[j] = INFINITY;
+        stats->max_speed[j] = -INFINITY;
+    }
+    return stats;
+}
+
+void motion_stats_free(struct motion_stats *stats) {
+    free(stats->mean);
+    free(stats->m2);
+    free(stats->min);
+    free(stats->max);
+    free(stats->previous);
+    free(stats->min_speed);
+    free(stats->max_speed);
+    free(stats);
+}
+
+static void add_row(unsigned channels, unsigned count, const float *restrict row,
+                    double *restrict mean, double *restrict m2, float *restrict min, float *restrict max) {
+    double inv_count = 1.0/count;
+    for (unsigned c = 0; c < channels; c++) {
+        double x = row[c],
+               delta = x - mean[c];
+        mean[c] += delta*inv_count;
+        m2[c] += delta*(x - mean[c]);
+        min[c] = row[c] < min[c] ? row[c] : min[c];
+        max[c] = row[c] > max[c] ? row[c] : max[c];
+    }
+}
+
+static void add_rotations(struct motion_stats *stats, const struct quat *rotations) {
+    // the angle of the rotation from the last frame to this one
+    if (stats->frames > 1) {
+        for (unsigned j = 0; j < stats->joints; j++) {
+            struct quat delta = quat_mul(rotations[j], quat_conj(stats->previous[j]));
+            float angle = 2*atan2(sqrt(delta.x*delta.x + delta.y*delta.y + delta.z*delta.z), fabs(delta.w));
+            if (angle < stats->min_speed[j]) stats->min_speed[j] = angle;
+            if (angle > stats->max_speed[j]) stats->max_speed[j] = angle;
+        }
+    }
+    memcpy(stats->previous, rotations, sizeof(*rotations)*stats->joints);
+}
+
+void motion_stats_add(struct motion_stats *stats, const float *rows, const struct quat *rotations, unsigned frames) {
+    // Adds `frames` rows of output channels and, for each, the rotation of
+    // every joint (as from compute_joint_rotation()).
+    for (unsigned f = 0; f < frames; f++) {
+        add_row(stats->channels, ++stats->frames, rows + (size_t) f*stats->channels,
+                stats->mean, stats->m2, stats->min, stats->max);
+        add_rotations(stats, rotations + (size_t) f*stats->joints);
+    }
+}
+
+static void fprint_json_number(FILE *f, double val) {
+    // JSON has no infinities, which is what's left when there's no data
+    if (isfinite(val)) fprintf(f, "%.9g", val);
+    else fprintf(f, "null");
+}
+
+void write_motion_stats(FILE *json, struct motion_stats *stats, struct amc_skeleton *skeleton, float fps, struct output_options *options) {
+    fprintf(json, "{\n");
+    fprintf(json, "  \"frames\": %u,\n", stats->frames);
+    fprintf(json, "  \"frame_time\": %f,\n", 1/fps);
+    fprintf(json, "  \"units\": \"%s\",\n", rotation_units(options));
+    fprintf(json, "  \"channels\": [");
+    for (unsigned j = 0, c = 0; j < skeleton->joint_count; j++) {
+        const char *names[CHANNEL_COUNT];
+        unsigned count = motion_row_channels(names, skeleton, j, options);
+        for (unsigned i = 0; i < count; i++, c++) {
+            fprintf(json, "%s\n    { \"joint\": ", c ? "," : "");
+            fprint_json_string(json, skeleton->names[j]);
+            fprintf(json, ", \"channel\": \"%s\", \"min\": ", names[i]);
+            fprint_json_number(json, stats->min[c]);
+            fprintf(json, ", \"max\": ");
+            fprint_json_number(json, stats->max[c]);
+            fprintf(json, ", \"mean\": ");
+            fprint_json_number(json, stats->frames ? stats->mean[c] : NAN);
+            fprintf(json, ", \"variance\": ");
+            fprint_json_number(json, stats->frames ? stats->m2[c]/stats->frames : NAN);
+            fprintf(json, " }");
+        }
+    }
+
+    // angular speeds are in degrees per second, whatever the channel units
+    float to_degrees_per_second = 180/M_PI*fps;
+    fprintf(json, "\n  ],\n  \"angular_speed\": [");
+    for (unsigned j = 0; j < skeleton->joint_count; j++) {
+        fprintf(json, "%s\n    { \"joint\": ", j ? "," : "");
+        fprint_json_string(json, skeleton->names[j]);
+        fprintf(json, ", \"min\": ");
+        fprint_json_number(json, stats->min_speed[j]*to_degrees_per_second);
+        fprintf(json, ", \"max\": ");
+        fprint_json_number(json, stats->max_speed[j]*to_degrees_per_second);
+        fprintf(json, " }");
+    }
+    fprintf(json, "\n  ]\n}\n");
+}
+
+char *stats_filename(char *output_filename) {
+    // out.bvh becomes out.stats.json
+    size_t base_len = strlen(output_filename);
+    char *ext = strrchr(output_filename, '.');
+    if (ext && !strchr(ext, '/')) base_len = ext - output_filename;
+    char *filename = xmalloc(base_len + 12);
+    memcpy(filename, output_filename, base_len);
+    strcpy(filename+base_len, ".stats.json");
+    return filename;
+}
@@ -0,0 +1,272 @@
+// Live streaming over a local socket, e.g. from a capture system to a realtime
+// previs engine. AMC frames are received over TCP or UDP on the loopback
+// interface, and each one is converted and sent back to the sender as a BVH
+// motion line as soon as it's complete, in a single write with no buffering
+// in between. Each connection (or with UDP, each new sender) is first sent the
+// BVH hierarchy, so a client can reconnect at any time.
+//
+// One sender is served at a time. This relies on POSIX sockets, so it isn't
+// available on Windows.
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include "amc2bvh.h"
+
+bool parse_listen_address(char *str, bool *udp, unsigned *port) {
+    // [tcp:|udp:]PORT, e.g. 7000 or udp:7000
+    *udp = false;
+    if (starts_with(str, "udp:")) {
+        *udp = true;
+        str += 4;
+    } else if (starts_with(str, "tcp:")) {
+        str += 4;
+    }
+    char *end;
+    long val = strtol(str, &end, 10);
+    if (end == str || *end || val < 0 || val > 65535) return false;
+    *port = val;
+    return true;
+}
+
+#ifndef _WIN32
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+
+// how often to check for Ctrl-C while waiting for data; data wakes it at once
+#define STREAM_POLL_MS 100
+
+// the most data read at once, the largest possible UDP datagram
+#define STREAM_READ_SIZE 65536
+
+static volatile sig_atomic_t is_streaming = 1;
+
+static void stop_streaming(int sig) {
+    is_streaming = 0;
+}
+
+struct stream_client {
+    int fd;                     // the connection, or the listening socket with UDP
+    bool udp;
+    struct sockaddr_in peer;    // where to send, with UDP
+    char name[32];              // the peer's address and port, for reporting
+    struct live_frames frames;
+    char line[BUFFSIZE+AMC_TOKEN_PADDING]; // a line that hasn't been completely received
+    size_t line_len;
+    FILE *out;                  // each message is formatted here, then sent in one write
+    char *out_data;
+    size_t out_size;
+    unsigned frames_sent;
+    double *latencies;          // from receiving the end of a frame to sending it, in ms
+    size_t latency_capacity;
+};
+
+static bool send_message(struct stream_client *client) {
+    // sends what's been written to client->out and empties it
+    fflush(client->out);
+    size_t len = ftell(client->out), sent = 0;
+    fseek(client->out, 0, SEEK_SET);
+    if (client->udp) {
+        return sendto(client->fd, client->out_data, len, 0, (struct sockaddr *) &client->peer, sizeof(client->peer)) == (ssize_t) len;
+    }
+    while (sent < len) {
+        ssize_t n = send(client->fd, client->out_data+sent, len-sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+static bool send_frame(struct stream_client *client, struct amc_skeleton *skeleton, struct amc_sample *sample, double received, struct output_options *options) {
+    write_bvh_sample(client->out, skeleton, sample, options);
+    fprintf(client->out, "\n");
+    bool ok = send_message(client);
+
+    client->frames_sent++;
+    if (client->frames_sent > client->latency_capacity) {
+        client->latency_capacity = 2*client->latency_capacity;
+        client->latencies = xrealloc(client->latencies, sizeof(*client->latencies)*client->latency_capacity);
+    }
+    client->latencies[client->frames_sent-1] = now_ms() - received;
+    return ok;
+}
+
+static bool client_open(struct stream_client *client, int fd, bool udp, struct sockaddr_in *peer, struct amc_skeleton *skeleton, float fps, struct output_options *options, bool verbose) {
+    client->fd = fd;
+    client->udp = udp;
+    client->peer = *peer;
+    char host[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &peer->sin_addr, host, sizeof(host));
+    snprintf(client->name, sizeof(client->name), "%s:%u", host, ntohs(peer->sin_port));
+    live_frames_init(&client->frames, skeleton, options->storage, verbose);
+    client->line_len = 0;
+    memset(client->line, 0, sizeof(client->line));
+    client->out_data = NULL;
+    client->out = open_memstream(&client->out_data, &client->out_size);
+    if (!client->out) FAIL("Unable to allocate sufficient memory\n");
+    client->frames_sent = 0;
+    client->latency_capacity = 1024;
+    client->latencies = xmalloc(sizeof(*client->latencies)*client->latency_capacity);
+    if (verbose) printf("Streaming to %s\n", client->name);
+
+    // the frame count isn't known, so it's left out
+    write_bvh_skeleton(client->out, skeleton, options);
+    fprintf(client->out, "MOTION\n");
+    fprintf(client->out, "Frame Time:\t%f\n", 1/fps);
+    return send_message(client);
+}
+
+static void client_close(struct stream_client *client, struct amc_skeleton *skeleton, struct output_options *options, bool verbose) {
+    double started;
+    struct amc_sample *last = live_frames_finish(&client->frames, &started);
+    if (last) send_frame(client, skeleton, last, now_ms(), options);
+
+    if (verbose || client->frames_sent > 0) {
+        size_t n = client->frames_sent;
+        printf("Streamed %u frames to %s, latency p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+               client->frames_sent,
+               client->name,
+               percentile(client->latencies, n, 0.5),
+               percentile(client->latencies, n, 0.99),
+               percentile(client->latencies, n, 1));
+    }
+
+    if (!client->udp) close(client->fd);
+    fclose(client->out);
+    free(client->out_data);
+    free(client->latencies);
+    live_frames_free(&client->frames);
+}
+
+static bool client_receive(struct stream_client *client, const char *data, size_t len, double received, struct amc_skeleton *skeleton, struct output_options *options) {
+    // Splits the data into lines, and sends every frame they complete.
+    // Returns false if the client can't be sent to.
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != '\n') {
+            if (client->line_len == BUFFSIZE-1) FAIL("Line length exceeds internal buffer\n");
+            client->line[client->line_len++] = data[i];
+            continue;
+        }
+        client->line[client->line_len] = '\0';
+        client->line_len = 0;
+        double started;
+        struct amc_sample *complete = live_frames_add_line(&client->frames, client->line, received, &started);
+        if (complete && !send_frame(client, skeleton, complete, received, options)) return false;
+    }
+    return true;
+}
+
+int stream_amc_motion(bool udp, unsigned port, struct amc_skeleton *skeleton, float fps, struct output_options *options, bool verbose) {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    socklen_t addr_len = sizeof(addr);
+    int listener = socket(AF_INET, udp ? SOCK_DGRAM : SOCK_STREAM, 0),
+        yes = 1;
+    if (listener < 0
+        || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes))
+        || bind(listener, (struct sockaddr *) &addr, sizeof(addr))
+        || (!udp && listen(listener, 1))
+        || getsockname(listener, (struct sockaddr *) &addr, &addr_len)) {
+        fprintf(stderr, "Error: unable to listen on %s port %u: %s\n", udp ? "UDP" : "TCP", port, strerror(errno));
+        if (listener >= 0) close(listener);
+        return 1;
+    }
+    printf("Listening on %s port %u\n", udp ? "UDP" : "TCP", ntohs(addr.sin_port));
+    fflush(stdout);
+
+    void (*previous_handler)(int) = signal(SIGINT, stop_streaming);
+    char *buffer = xmalloc(STREAM_READ_SIZE);
+    struct stream_client client;
+    bool connected = false;
+
+    while (is_streaming) {
+        struct pollfd pfd = { .fd = connected && !udp ? client.fd : listener, .events = POLLIN };
+        if (poll(&pfd, 1, STREAM_POLL_MS) <= 0) continue; // timed out or interrupted
+
+        struct sockaddr_in peer;
+        socklen_t peer_len = sizeof(peer);
+        ssize_t n;
+        bool hung_up = false;
+        if (!udp && !connected) {
+            int fd = accept(listener, (struct sockaddr *) &peer, &peer_len);
+            if (fd < 0) continue;
+            // send each line as soon as it's written, rather than waiting to fill a packet
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+            connected = true;
+            if (!client_open(&client, fd, false, &peer, skeleton, fps, options, verbose)) {
+                client_close(&client, skeleton, options, verbose);
+                connected = false;
+            }
+            continue;
+        } else if (udp) {
+            n = recvfrom(listener, buffer, STREAM_READ_SIZE, 0, (struct sockaddr *) &peer, &peer_len);
+            if (n < 0) continue;
+            if (connected && (peer.sin_addr.s_addr != client.peer.sin_addr.s_addr || peer.sin_port != client.peer.sin_port)) {
+                // a new sender takes over
+                client_close(&client, skeleton, options, verbose);
+                connected = false;
+            }
+            if (!connected) {
+                client_open(&client, listener, true, &peer, skeleton, fps, options, verbose);
+                connected = true;
+            }
+        } else {
+            n = recv(client.fd, buffer, STREAM_READ_SIZE, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                client_close(&client, skeleton, options, verbose);
+                connected = false;
+                continue;
+            } else if (n == 0) {
+                // finish off a last line with no newline before closing
+                hung_up = true;
+                buffer[0] = '\n';
+                n = client.line_len > 0;
+            }
+        }
+        double received = now_ms();
+
+        // FAIL() returns here, so bad data only drops its sender
+        jmp_buf handler;
+        if (setjmp(handler)) {
+            fail_handler = NULL;
+            fprintf(stderr, "Error: %s: %s\n", client.name, fail_message);
+            client.frames.pending_done = true; // don't send a frame that failed to parse
+            client_close(&client, skeleton, options, verbose);
+            connected = false;
+            continue;
+        }
+        fail_handler = &handler;
+        bool ok = client_receive(&client, buffer, n, received, skeleton, options);
+        fail_handler = NULL;
+        if (!ok || hung_up) {
+            client_close(&client, skeleton, options, verbose);
+            connected = false;
+        }
+    }
+    if (connected) client_close(&client, skeleton, options, verbose);
+    signal(SIGINT, previous_handler);
+
+    free(buffer);
+    close(listener);
+    return 0;
+}
+
+#else
+
+int stream_amc_motion(bool udp, unsigned port, struct amc_skeleton *skeleton, float fps, struct output_options *options, bool verbose) {
+    fprintf(stderr, "Error: streaming is not supported on Windows\n");
+    return 1;
+}
+
+#endif
@@ -0,0 +1,306 @@
+// Splitting AMC frame lines into words. Frame lines are nearly all of an AMC
+// file, and finding their words a byte at a time (trim(), bifurcate(),
+// strlen()) is a good part of the time spent parsing. Instead, 32 bytes at a
+// time are classified into bitmasks of whitespace, line ends and number
+// characters, with SSE2 or AVX2 where the processor has them, and the words
+// are read off the masks with a few bit operations. The number mask tells
+// which words are plain decimals, which parse_amc_number() then reads without
+// going through strtod().
+//
+// Blocks are read from the start of the line, so the last may take in up to
+// 31 bytes past its end. Buffers handed to the parser are padded for this, see
+// AMC_TOKEN_PADDING.
+//
+// To compare the tokenizers on an AMC file:
+// $ cc -DAMC2BVH_TOKENIZE_BENCH -O2 -I. tokenize.c && ./a.out 01_01.amc
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+#include "amc2bvh.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(AMC2BVH_NO_SIMD)
+#define TOKENIZE_X86
+#include <immintrin.h>
+#endif
+
+struct char_masks {
+    uint32_t space;     // whitespace other than newlines
+    uint32_t end;       // newlines and NULs
+    uint32_t number;    // digits, signs and decimal points
+};
+
+static inline __attribute__((always_inline)) unsigned tokenize_with(char *line, struct amc_tokens *tokens, void (*classify)(const char *, struct char_masks *)) {
+    // the words are NUL-terminated in place
+    char *block = line,
+         *word_start = NULL;
+    unsigned count = 0;
+    bool in_word = false, word_numeric = false;
+    tokens->numeric = 0;
+
+    for (;; block += 32) {
+        struct char_masks m;
+        classify(block, &m);
+        uint32_t end = m.end,
+                 valid = end ? (end & -end) - 1 : ~0u,
+                 word = ~m.space & ~m.end & valid,
+                 previous = word << 1 | in_word,
+                 starts = word & ~previous,
+                 stops = ~word & previous,
+                 other = word & ~m.number;
+
+        // starts and stops alternate, so they're taken in order
+        unsigned from = 0;
+        for (uint32_t events = starts | stops; events; events &= events-1) {
+            unsigned p = __builtin_ctz(events);
+            if (starts >> p & 1) {
+                word_start = block+p;
+                in_word = true;
+                word_numeric = true;
+                from = p;
+            } else {
+                if (other & (uint32_t) ((1ull << p) - (1ull << from))) word_numeric = false;
+                block[p] = '\0';
+                if (count < AMC_MAX_TOKENS) {
+                    tokens->words[count] = word_start;
+                    tokens->lengths[count] = block+p - word_start;
+                    if (word_numeric) tokens->numeric |= 1u << count;
+                }
+                count++;
+                in_word = false;
+            }
+        }
+        if (in_word && (other >> from)) word_numeric = false;
+        if (end) break;
+    }
+    tokens->count = count;
+    return count;
+}
+
+static void classify_scalar(const char *block, struct char_masks *m) {
+    m->space = m->end = m->number = 0;
+    for (int i = 0; i < 32; i++) {
+        unsigned char c = block[i];
+        if (c == '\n' || c == '\0') m->end |= 1u << i;
+        else if (c == ' ' || (c >= '\t' && c <= '\r')) m->space |= 1u << i;
+        else if ((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.') m->number |= 1u << i;
+    }
+}
+
+static unsigned tokenize_scalar(char *line, struct amc_tokens *tokens) {
+    return tokenize_with(line, tokens, classify_scalar);
+}
+
+#ifdef TOKENIZE_X86
+
+__attribute__((target("sse2")))
+static inline void classify_sse2(const char *block, struct char_masks *m) {
+    // \t, \v, \f and \r are 9 to 13, around \n
+    const __m128i tab = _mm_set1_epi8('\t'-1), cr = _mm_set1_epi8('\r'+1),
+                  zero = _mm_set1_epi8('0'-1), nine = _mm_set1_epi8('9'+1);
+    m->space = m->end = m->number = 0;
+    for (int half = 0; half < 2; half++) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (block + 16*half)),
+                newline = _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                end = _mm_or_si128(newline, _mm_cmpeq_epi8(v, _mm_setzero_si128())),
+                space = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                     _mm_andnot_si128(newline, _mm_and_si128(_mm_cmpgt_epi8(v, tab), _mm_cmplt_epi8(v, cr)))),
+                digit = _mm_and_si128(_mm_cmpgt_epi8(v, zero), _mm_cmplt_epi8(v, nine)),
+                number = _mm_or_si128(_mm_or_si128(digit, _mm_cmpeq_epi8(v, _mm_set1_epi8('.'))),
+                                      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('-')), _mm_cmpeq_epi8(v, _mm_set1_epi8('+'))));
+        m->space |= (uint32_t) _mm_movemask_epi8(space) << 16*half;
+        m->end |= (uint32_t) _mm_movemask_epi8(end) << 16*half;
+        m->number |= (uint32_t) _mm_movemask_epi8(number) << 16*half;
+    }
+}
+
+__attribute__((target("sse2")))
+static unsigned tokenize_sse2(char *line, struct amc_tokens *tokens) {
+    return tokenize_with(line, tokens, classify_sse2);
+}
+
+__attribute__((target("avx2")))
+static inline void classify_avx2(const char *block, struct char_masks *m) {
+    const __m256i tab = _mm256_set1_epi8('\t'-1), cr = _mm256_set1_epi8('\r'+1),
+                  zero = _mm256_set1_epi8('0'-1), nine = _mm256_set1_epi8('9'+1);
+    __m256i v = _mm256_loadu_si256((const __m256i *) block),
+            newline = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+            end = _mm256_or_si256(newline, _mm256_cmpeq_epi8(v, _mm256_setzero_si256())),
+            space = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                    _mm256_andnot_si256(newline, _mm256_and_si256(_mm256_cmpgt_epi8(v, tab), _mm256_cmpgt_epi8(cr, v)))),
+            digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, zero), _mm256_cmpgt_epi8(nine, v)),
+            number = _mm256_or_si256(_mm256_or_si256(digit, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('.'))),
+                                     _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('-')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('+'))));
+    m->space = _mm256_movemask_epi8(space);
+    m->end = _mm256_movemask_epi8(end);
+    m->number = _mm256_movemask_epi8(number);
+}
+
+__attribute__((target("avx2")))
+static unsigned tokenize_avx2(char *line, struct amc_tokens *tokens) {
+    return tokenize_with(line, tokens, classify_avx2);
+}
+
+#endif
+
+tokenize_fn amc_select_tokenizer(const char **name) {
+    // the fastest tokenizer this processor supports
+#ifdef TOKENIZE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        if (name) *name = "AVX2";
+        return tokenize_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        if (name) *name = "SSE2";
+        return tokenize_sse2;
+    }
+#endif
+    if (name) *name = "scalar";
+    return tokenize_scalar;
+}
+
+double parse_amc_number(const char *str, unsigned len, bool numeric) {
+    // Equivalent to atof(). Plain decimals with few enough digits, which is
+    // what AMC files are written with, are exactly a whole number divided by
+    // a power of ten that are both exact doubles, so a single division rounds
+    // them correctly. Anything else goes to atof().
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    if (numeric) {
+        const char *c = str, *end = str+len;
+        bool negative = *c == '-';
+        if (*c == '-' || *c == '+') c++;
+        uint64_t mantissa = 0;
+        const char *int_start = c;
+        while (c < end && (unsigned) (*c - '0') < 10) mantissa = 10*mantissa + (*c++ - '0');
+        int int_digits = c - int_start, frac_digits = 0;
+        if (c < end && *c == '.') {
+            const char *frac_start = ++c;
+            while (c < end && (unsigned) (*c - '0') < 10) mantissa = 10*mantissa + (*c++ - '0');
+            frac_digits = c - frac_start;
+        }
+        int digits = int_digits + frac_digits;
+        if (c == end && digits > 0 && digits <= 19 && mantissa <= (1ull << 53) && frac_digits <= 22) {
+            double val = (double) mantissa / powers[frac_digits];
+            return negative ? -val : val;
+        }
+    }
+    return atof(str);
+}
+
+#ifdef AMC2BVH_TOKENIZE_BENCH
+
+#include <stdio.h>
+#include <time.h>
+
+static double bench_seconds(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static double bench(const char *data, size_t len, tokenize_fn tokenize, bool parse_numbers, double *checksum) {
+    // tokenizes every line of the data (and parses its numbers), returning the seconds taken
+    char *copy = calloc(len+1+AMC_TOKEN_PADDING, 1), *line_buffer = calloc(BUFFSIZE+AMC_TOKEN_PADDING, 1);
+    memcpy(copy, data, len+1);
+    double started = bench_seconds(), sum = 0;
+    for (char *line = copy; *line; ) {
+        char *next = strchr(line, '\n');
+        size_t line_len = next ? (size_t) (next+1 - line) : strlen(line);
+        if (line_len >= BUFFSIZE) line_len = BUFFSIZE-1;
+        memcpy(line_buffer, line, line_len); // as parse_amc_motion() reads lines
+        line_buffer[line_len] = '\0';
+        struct amc_tokens tokens;
+        unsigned count = tokenize(line_buffer, &tokens);
+        for (unsigned i = 1; parse_numbers && i < count && i < AMC_MAX_TOKENS; i++) {
+            sum += parse_amc_number(tokens.words[i], tokens.lengths[i], tokens.numeric >> i & 1);
+        }
+        sum += count;
+        line += line_len;
+    }
+    double elapsed = bench_seconds() - started;
+    *checksum = sum;
+    free(copy);
+    free(line_buffer);
+    return elapsed;
+}
+
+static double bench_baseline(const char *data, size_t len, double *checksum) {
+    // what amc_parse_line() did before: trim(), then bifurcate() and atof() on each word
+    char *line_buffer = malloc(BUFFSIZE);
+    double started = bench_seconds(), sum = 0;
+    for (const char *line = data; *line; ) {
+        const char *next = strchr(line, '\n');
+        size_t line_len = next ? (size_t) (next+1 - line) : strlen(line);
+        if (line_len >= BUFFSIZE) line_len = BUFFSIZE-1;
+        memcpy(line_buffer, line, line_len);
+        line_buffer[line_len] = '\0';
+        char *str = line_buffer;
+        while (isspace(*str)) str++;
+        for (int i = strlen(str)-1; i >= 0 && isspace(str[i]); i--) str[i] = '\0';
+        for (unsigned i = 0; str && *str; i++) {
+            char *word = str;
+            str = strchr(str, ' ');
+            if (str) *str++ = '\0';
+            sum += i > 0 ? atof(word) + 1 : 1;
+        }
+        line += line_len;
+    }
+    double elapsed = bench_seconds() - started;
+    *checksum = sum;
+    free(line_buffer);
+    return elapsed;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s FILE.amc\n", argv[0]);
+        return 1;
+    }
+    FILE *f = fopen(argv[1], "rb");
+    if (!f) {
+        perror(argv[1]);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    size_t len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *data = malloc(len+1);
+    len = fread(data, 1, len, f);
+    data[len] = '\0';
+    fclose(f);
+
+    const char *names[3] = { "scalar" };
+    tokenize_fn tokenizers[3] = { tokenize_scalar };
+    int tokenizer_count = 1;
+#ifdef TOKENIZE_X86
+    if (__builtin_cpu_supports("sse2")) names[tokenizer_count] = "SSE2", tokenizers[tokenizer_count++] = tokenize_sse2;
+    if (__builtin_cpu_supports("avx2")) names[tokenizer_count] = "AVX2", tokenizers[tokenizer_count++] = tokenize_avx2;
+#endif
+
+    double checksum, best = 1e9;
+    for (int r = 0; r < 5; r++) {
+        double t = bench_baseline(data, len, &checksum);
+        if (t < best) best = t;
+    }
+    printf("%-24s %7.1f MB/s  (checksum %.6g)\n", "trim/bifurcate/atof", len/best/1e6, checksum);
+    for (int parse = 0; parse < 2; parse++) {
+        for (int t = 0; t < tokenizer_count; t++) {
+            best = 1e9;
+            for (int r = 0; r < 5; r++) {
+                double elapsed = bench(data, len, tokenizers[t], parse, &checksum);
+                if (elapsed < best) best = elapsed;
+            }
+            char label[32];
+            snprintf(label, sizeof(label), "%s%s", names[t], parse ? " + numbers" : "");
+            printf("%-24s %7.1f MB/s  (checksum %.6g)\n", label, len/best/1e6, checksum);
+        }
+    }
+    free(data);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,122 @@
+// Trace output in the Chrome trace event format, which can be opened in
+// Perfetto (https://ui.perfetto.dev) or chrome://tracing. Each span of work
+// becomes a complete ("X") event, tagged with the thread that did it and the
+// range of frames it covered, if any.
+//
+// Events are collected in memory and written out by trace_close(). When
+// tracing is off, each TRACE_BEGIN()/TRACE_END() pair costs a single branch,
+// and building with -DAMC2BVH_NO_TRACE (make TRACE=0) removes them entirely.
+
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include "amc2bvh.h"
+
+#ifndef AMC2BVH_NO_TRACE
+
+struct trace_event {
+    const char *name;
+    double start, duration;     // in microseconds since tracing began
+    unsigned tid;
+    long first_frame, last_frame;
+};
+
+bool trace_enabled = false;
+
+static char *trace_filename;
+static double trace_epoch;
+static struct trace_event *events;
+static size_t event_count, event_capacity;
+static atomic_flag events_lock = ATOMIC_FLAG_INIT;
+static atomic_uint next_tid = 1;
+static _Thread_local unsigned trace_tid;
+
+double trace_now(void) {
+    return now_ms()*1e3 - trace_epoch;
+}
+
+bool trace_open(char *filename) {
+    // the file is created now, so that a bad path is reported before any work
+    FILE *f = fopen(filename, "w");
+    if (!f) return false;
+    fclose(f);
+
+    trace_filename = filename;
+    trace_epoch = now_ms()*1e3;
+    event_count = 0;
+    event_capacity = 1024;
+    events = xmalloc(sizeof(*events)*event_capacity);
+    trace_enabled = true;
+    return true;
+}
+
+void trace_event(const char *name, double start, long first_frame, long last_frame) {
+    // Records a span from `start` (from trace_now()) until now. The name must
+    // be a string literal. Frames are -1 if the span doesn't cover any.
+    double end = trace_now();
+    if (!trace_tid) trace_tid = atomic_fetch_add(&next_tid, 1);
+
+    while (atomic_flag_test_and_set_explicit(&events_lock, memory_order_acquire));
+    if (event_count == event_capacity) {
+        event_capacity *= 2;
+        events = xrealloc(events, sizeof(*events)*event_capacity);
+    }
+    events[event_count++] = (struct trace_event) {
+        .name = name,
+        .start = start,
+        .duration = end - start,
+        .tid = trace_tid,
+        .first_frame = first_frame,
+        .last_frame = last_frame
+    };
+    atomic_flag_clear_explicit(&events_lock, memory_order_release);
+}
+
+int trace_close(void) {
+    // Writes the trace, returning nonzero on failure. Only call this once
+    // every other thread has finished.
+    if (!trace_enabled) return 0;
+    trace_enabled = false;
+
+    FILE *f = fopen(trace_filename, "w");
+    if (!f) {
+        free(events);
+        return 1;
+    }
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"amc2bvh\"}}");
+    for (size_t i = 0; i < event_count; i++) {
+        struct trace_event *e = events+i;
+        fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"amc2bvh\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+                e->name, e->tid, e->start, e->duration);
+        if (e->first_frame >= 0) {
+            fprintf(f, ",\"args\":{\"first_frame\":%ld,\"last_frame\":%ld}", e->first_frame, e->last_frame);
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n]}\n");
+    free(events);
+    return fclose(f) != 0;
+}
+
+#else
+
+// never called, but referenced by code that the compiler removes
+
+double trace_now(void) {
+    return 0;
+}
+
+void trace_event(const char *name, double start, long first_frame, long last_frame) {
+}
+
+bool trace_open(char *filename) {
+    errno = ENOSYS;
+    return false;
+}
+
+int trace_close(void) {
+    return 0;
+}
+
+#endif
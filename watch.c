@@ -0,0 +1,497 @@
+// Watch-directory ingest. New or updated AMC files in a drop directory are
+// paired with their ASF skeleton and converted on a fixed pool of worker
+// threads, once neither file has changed for a while. Parsed skeletons are
+// cached, so a burst of takes for the same subject only parses the ASF once.
+//
+// An AMC file is paired with the ASF file of the same name (walk.asf for
+// walk.amc) or, failing that, with the ASF file named by the part before the
+// first underscore (01.asf for 01_02.amc, as in the CMU database).
+//
+// This relies on inotify and POSIX threads, so it's only available on Linux.
+
+#include <string.h>
+#include <errno.h>
+#include "amc2bvh.h"
+
+#ifdef __linux__
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <signal.h>
+#include <unistd.h>
+
+struct watch_job {
+    char *asf_filename;
+    char *amc_filename;
+    char *output_filename;
+    struct watch_job *next;
+};
+
+struct cached_skeleton {
+    char *asf_filename;             // the key
+    struct timespec mtime;          // when the ASF file was parsed
+    struct amc_skeleton *skeleton;
+};
+
+struct retired_skeleton {
+    struct amc_skeleton *skeleton;
+    struct retired_skeleton *next;
+};
+
+struct pending_file {
+    char *name;         // the key, relative to the watched directory
+    double last_change; // when the file last changed, in ms
+};
+
+struct watch_state {
+    struct watch_options *watch;
+    float fps;
+    struct output_options *options;
+    bool verbose;
+
+    pthread_mutex_t lock;       // protects everything below
+    pthread_cond_t has_work;
+    struct watch_job *queue_head, *queue_tail;
+    bool shutting_down;
+    struct hashmap *skeletons;  // ASF filename -> struct cached_skeleton
+    struct retired_skeleton *retired; // replaced skeletons, possibly still in use
+    struct hashmap *in_flight;  // output filenames of queued or running jobs, as struct pending_file
+    unsigned converted, failed;
+};
+
+static volatile sig_atomic_t is_watching = 1;
+
+static void stop_watching(int sig) {
+    is_watching = 0;
+}
+
+static char *join_path(const char *dir, const char *name, const char *ext) {
+    size_t dir_len = strlen(dir), name_len = strlen(name), ext_len = ext ? strlen(ext) : 0;
+    char *path = xmalloc(dir_len + 1 + name_len + ext_len + 1);
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '/';
+    memcpy(path+dir_len+1, name, name_len);
+    if (ext) memcpy(path+dir_len+1+name_len, ext, ext_len);
+    path[dir_len+1+name_len+ext_len] = '\0';
+    return path;
+}
+
+static bool is_amc(char *name) {
+    return ends_with(name, ".amc") || ends_with(name, ".AMC");
+}
+
+static bool is_asf(char *name) {
+    return ends_with(name, ".asf") || ends_with(name, ".ASF");
+}
+
+static int cached_skeleton_cmp(const void *a, const void *b, void *data) {
+    const struct cached_skeleton *ca = a, *cb = b;
+    return strcmp(ca->asf_filename, cb->asf_filename);
+}
+
+static uint64_t cached_skeleton_hash(const void *item, uint64_t seed0, uint64_t seed1) {
+    const struct cached_skeleton *entry = item;
+    return hashmap_fnv1a(entry->asf_filename, strlen(entry->asf_filename), seed0, seed1);
+}
+
+static void cached_skeleton_free(void *item) {
+    struct cached_skeleton *entry = item;
+    free(entry->asf_filename);
+    amc_skeleton_free(entry->skeleton);
+}
+
+static int pending_file_cmp(const void *a, const void *b, void *data) {
+    const struct pending_file *pa = a, *pb = b;
+    return strcmp(pa->name, pb->name);
+}
+
+static uint64_t pending_file_hash(const void *item, uint64_t seed0, uint64_t seed1) {
+    const struct pending_file *entry = item;
+    return hashmap_fnv1a(entry->name, strlen(entry->name), seed0, seed1);
+}
+
+static void pending_file_free(void *item) {
+    struct pending_file *entry = item;
+    free(entry->name);
+}
+
+static void run_job(struct watch_state *state, struct watch_job *job) {
+    // FAIL() returns here rather than exiting, so that one bad file doesn't
+    // take down the whole pool. Files are closed, but memory is leaked.
+    FILE *volatile asf = NULL,
+         *volatile amc = NULL,
+         *volatile out = NULL;
+    char *tmp_filename = xmalloc(strlen(job->output_filename)+5);
+    sprintf(tmp_filename, "%s.tmp", job->output_filename);
+    double start = now_ms();
+    TRACE_BEGIN(job_span);
+
+    jmp_buf handler;
+    if (setjmp(handler)) {
+        fail_handler = NULL;
+        if (asf) fclose(asf);
+        if (amc) fclose(amc);
+        if (out) fclose(out);
+        remove(tmp_filename);
+        free(tmp_filename);
+        fprintf(stderr, "Error: %s: %s\n", job->amc_filename, fail_message);
+        pthread_mutex_lock(&state->lock);
+        state->failed++;
+        pthread_mutex_unlock(&state->lock);
+        return;
+    }
+    fail_handler = &handler;
+
+    struct stat st;
+    if (stat(job->asf_filename, &st)) FAIL("cannot access '%s': %s\n", job->asf_filename, strerror(errno));
+
+    // Use the cached skeleton if the ASF file hasn't changed since it was
+    // parsed. Parsing happens outside of the lock, so it only blocks jobs that
+    // need the same skeleton, and then only if they race for it.
+    struct cached_skeleton search = { .asf_filename = job->asf_filename }, *cached;
+    struct amc_skeleton *skeleton = NULL;
+    pthread_mutex_lock(&state->lock);
+    cached = hashmap_get(state->skeletons, &search);
+    if (cached && cached->mtime.tv_sec == st.st_mtim.tv_sec && cached->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        skeleton = cached->skeleton;
+    }
+    pthread_mutex_unlock(&state->lock);
+
+    if (!skeleton) {
+        if (!(asf = fopen(job->asf_filename, "r"))) FAIL("cannot access '%s': %s\n", job->asf_filename, strerror(errno));
+        TRACE_BEGIN(asf_span);
+        skeleton = parse_asf_skeleton(asf, false);
+        TRACE_END(asf_span, "parse_asf_skeleton", -1, -1);
+        fclose(asf);
+        asf = NULL;
+        amc_skeleton_apply_options(skeleton, state->options, false);
+
+        struct cached_skeleton entry = {
+            .asf_filename = xstrdup(job->asf_filename),
+            .mtime = st.st_mtim,
+            .skeleton = skeleton
+        };
+        pthread_mutex_lock(&state->lock);
+        struct cached_skeleton *replaced = hashmap_set(state->skeletons, &entry);
+        if (replaced) {
+            // another job may still be using the old skeleton
+            struct retired_skeleton *retired = xmalloc(sizeof(*retired));
+            retired->skeleton = replaced->skeleton;
+            retired->next = state->retired;
+            state->retired = retired;
+            free(replaced->asf_filename);
+        }
+        pthread_mutex_unlock(&state->lock);
+    }
+
+    if (!(amc = fopen(job->amc_filename, "r"))) FAIL("cannot access '%s': %s\n", job->amc_filename, strerror(errno));
+    struct amc_motion *motion = parse_amc_motion(amc, skeleton, state->options->storage, false);
+    fclose(amc);
+    amc = NULL;
+
+    // write to a temporary file so that a half-written BVH is never visible
+    if (!(out = fopen(tmp_filename, "w"))) FAIL("cannot access '%s': %s\n", tmp_filename, strerror(errno));
+    write_bvh_skeleton(out, skeleton, state->options);
+    write_bvh_motion(out, motion, skeleton, state->fps, state->options, NULL);
+    if (fclose(out)) {
+        out = NULL;
+        FAIL("unable to write '%s': %s\n", tmp_filename, strerror(errno));
+    }
+    out = NULL;
+    if (rename(tmp_filename, job->output_filename)) FAIL("unable to write '%s': %s\n", job->output_filename, strerror(errno));
+    fail_handler = NULL;
+    TRACE_END(job_span, "convert_file", 0, (long) motion->sample_count-1);
+
+    if (state->verbose) {
+        printf("Converted %s to %s (%u frames, %.1f ms)\n", job->amc_filename, job->output_filename,
+               motion->sample_count, now_ms() - start);
+    }
+    amc_motion_free(motion);
+    free(tmp_filename);
+
+    pthread_mutex_lock(&state->lock);
+    state->converted++;
+    pthread_mutex_unlock(&state->lock);
+}
+
+static void *worker(void *data) {
+    struct watch_state *state = data;
+
+    while (true) {
+        pthread_mutex_lock(&state->lock);
+        while (!state->queue_head && !state->shutting_down) {
+            pthread_cond_wait(&state->has_work, &state->lock);
+        }
+        struct watch_job *job = state->queue_head;
+        if (!job) { // shutting down, and nothing left to do
+            pthread_mutex_unlock(&state->lock);
+            return NULL;
+        }
+        state->queue_head = job->next;
+        if (!state->queue_head) state->queue_tail = NULL;
+        pthread_mutex_unlock(&state->lock);
+
+        run_job(state, job);
+
+        // a later change to the same file can now be converted
+        pthread_mutex_lock(&state->lock);
+        struct pending_file search = { .name = job->output_filename },
+                            *removed = hashmap_delete(state->in_flight, &search);
+        if (removed) free(removed->name);
+        pthread_mutex_unlock(&state->lock);
+
+        free(job->asf_filename);
+        free(job->amc_filename);
+        free(job->output_filename);
+        free(job);
+    }
+}
+
+static char *find_asf(struct watch_options *watch, char *amc_name) {
+    // returns the path of the ASF file for an AMC file, see asf_stem_for_amc(), or NULL
+    char *amc_stem = file_stem(amc_name), *stem, *path = NULL;
+    for (unsigned choice = 0; !path && (stem = asf_stem_for_amc(amc_stem, choice)); choice++) {
+        struct stat st;
+        path = join_path(watch->directory, stem, ".asf");
+        if (stat(path, &st)) {
+            free(path);
+            path = NULL;
+        }
+        free(stem);
+    }
+    free(amc_stem);
+    return path;
+}
+
+static bool enqueue_job(struct watch_state *state, char *amc_name, char *asf_filename) {
+    // Takes ownership of asf_filename. Returns false if the output is still
+    // being converted, since two jobs writing the same output could leave an
+    // older conversion in place of a newer one; the file is tried again later.
+    char *stem = file_stem(amc_name),
+         *output_filename = join_path(state->watch->output_directory, stem, ".bvh");
+    free(stem);
+
+    pthread_mutex_lock(&state->lock);
+    struct pending_file search = { .name = output_filename };
+    if (hashmap_get(state->in_flight, &search)) {
+        pthread_mutex_unlock(&state->lock);
+        free(output_filename);
+        free(asf_filename);
+        return false;
+    }
+    hashmap_set(state->in_flight, &(struct pending_file) { .name = xstrdup(output_filename) });
+
+    struct watch_job *job = xmalloc(sizeof(*job));
+    job->asf_filename = asf_filename;
+    job->amc_filename = join_path(state->watch->directory, amc_name, NULL);
+    job->output_filename = output_filename;
+    job->next = NULL;
+    if (state->queue_tail) state->queue_tail->next = job;
+    else state->queue_head = job;
+    state->queue_tail = job;
+    pthread_cond_signal(&state->has_work);
+    pthread_mutex_unlock(&state->lock);
+    return true;
+}
+
+struct settle_scan {
+    struct watch_state *state;
+    struct hashmap *pending;
+    double now;
+    char **ready;   // names of settled files
+    size_t ready_count, ready_capacity;
+};
+
+static bool collect_settled(const void *item, void *data) {
+    const struct pending_file *file = item;
+    struct settle_scan *scan = data;
+    if (scan->now - file->last_change < scan->state->watch->settle_ms) return true;
+
+    if (scan->ready_count == scan->ready_capacity) {
+        scan->ready_capacity = scan->ready_capacity ? 2*scan->ready_capacity : 16;
+        scan->ready = xrealloc(scan->ready, sizeof(*scan->ready)*scan->ready_capacity);
+    }
+    scan->ready[scan->ready_count++] = file->name;
+    return true;
+}
+
+static void dispatch_settled(struct watch_state *state, struct hashmap *pending) {
+    struct settle_scan scan = { .state = state, .pending = pending, .now = now_ms() };
+    hashmap_scan(pending, collect_settled, &scan);
+
+    for (size_t i = 0; i < scan.ready_count; i++) {
+        char *name = scan.ready[i];
+        struct pending_file search = { .name = name }, *removed;
+        if (!is_amc(name)) {
+            // a settled skeleton is no longer holding anything up
+            if ((removed = hashmap_delete(pending, &search))) free(removed->name);
+            continue;
+        }
+        char *asf_filename = find_asf(state->watch, name);
+        if (!asf_filename) continue; // wait for the skeleton to show up
+
+        // the skeleton also has to have stopped changing
+        char *asf_name = strrchr(asf_filename, '/')+1;
+        struct pending_file asf_search = { .name = asf_name },
+                            *asf_pending = hashmap_get(pending, &asf_search);
+        if (asf_pending && scan.now - asf_pending->last_change < state->watch->settle_ms) {
+            free(asf_filename);
+            continue;
+        }
+
+        if (!enqueue_job(state, name, asf_filename)) continue;
+        if ((removed = hashmap_delete(pending, &search))) free(removed->name);
+    }
+    free(scan.ready);
+}
+
+static void mark_changed(struct hashmap *pending, char *name, double when) {
+    struct pending_file search = { .name = name },
+                        *existing = hashmap_get(pending, &search);
+    if (existing) {
+        existing->last_change = when;
+    } else {
+        struct pending_file entry = { .name = xstrdup(name), .last_change = when };
+        hashmap_set(pending, &entry);
+    }
+}
+
+static void scan_existing(struct watch_state *state, struct hashmap *pending) {
+    // pick up AMC files that are newer than their output, e.g. ones dropped in
+    // while nothing was watching
+    DIR *dir = opendir(state->watch->directory);
+    if (!dir) return;
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        if (!is_amc(ent->d_name)) continue;
+        char *stem = file_stem(ent->d_name);
+        char *amc_path = join_path(state->watch->directory, ent->d_name, NULL),
+             *out_path = join_path(state->watch->output_directory, stem, ".bvh");
+        struct stat amc_st, out_st;
+        if (!stat(amc_path, &amc_st) && (stat(out_path, &out_st) || out_st.st_mtime < amc_st.st_mtime)) {
+            mark_changed(pending, ent->d_name, now_ms());
+        }
+        free(stem);
+        free(amc_path);
+        free(out_path);
+    }
+    closedir(dir);
+}
+
+int watch_directory(struct watch_options *watch, float fps, struct output_options *options, bool verbose) {
+    int fd = inotify_init1(IN_NONBLOCK);
+    if (fd < 0 || inotify_add_watch(fd, watch->directory, IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO | IN_CREATE) < 0) {
+        fprintf(stderr, "Error: unable to watch '%s': %s\n", watch->directory, strerror(errno));
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+
+    struct watch_state state = {
+        .watch = watch,
+        .fps = fps,
+        .options = options,
+        .verbose = verbose,
+        .queue_head = NULL,
+        .queue_tail = NULL,
+        .shutting_down = false,
+        .retired = NULL,
+        .converted = 0,
+        .failed = 0
+    };
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.has_work, NULL);
+    state.skeletons = hashmap_new_with_allocator(xmalloc, xrealloc, free,
+                                                 sizeof(struct cached_skeleton), 16, 0, 0,
+                                                 cached_skeleton_hash, cached_skeleton_cmp,
+                                                 cached_skeleton_free, NULL);
+    state.in_flight = hashmap_new_with_allocator(xmalloc, xrealloc, free,
+                                                 sizeof(struct pending_file), 16, 0, 0,
+                                                 pending_file_hash, pending_file_cmp,
+                                                 pending_file_free, NULL);
+    struct hashmap *pending = hashmap_new_with_allocator(xmalloc, xrealloc, free,
+                                                         sizeof(struct pending_file), 16, 0, 0,
+                                                         pending_file_hash, pending_file_cmp,
+                                                         pending_file_free, NULL);
+
+    // make do with however many workers start, as long as one does
+    pthread_t *workers = xmalloc(sizeof(*workers)*watch->jobs);
+    unsigned started = 0;
+    int err = 0;
+    for (; started < watch->jobs; started++) {
+        if ((err = pthread_create(&workers[started], NULL, worker, &state))) break;
+    }
+    if (started == 0) {
+        fprintf(stderr, "Error: unable to start any workers: %s\n", strerror(err));
+        is_watching = 0;
+    }
+
+    void (*previous_handler)(int) = signal(SIGINT, stop_watching);
+    if (started) scan_existing(&state, pending);
+    if (verbose && started) printf("Watching %s with %u workers\n", watch->directory, started);
+
+    // events are variable-length, but always aligned like struct inotify_event
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (is_watching) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int poll_ms = watch->settle_ms < 100 ? watch->settle_ms : 100;
+        if (poll(&pfd, 1, poll_ms) > 0) {
+            ssize_t len;
+            bool overflowed = false;
+            while ((len = read(fd, events, sizeof(events))) > 0) {
+                double now = now_ms();
+                for (char *p = events; p < events + len; ) {
+                    struct inotify_event *event = (struct inotify_event *) p;
+                    if (event->mask & IN_Q_OVERFLOW) overflowed = true;
+                    if (event->len > 0 && (is_amc(event->name) || is_asf(event->name))) {
+                        mark_changed(pending, event->name, now);
+                    }
+                    p += sizeof(struct inotify_event) + event->len;
+                }
+            }
+            // events were dropped, so look for files they would have reported
+            if (overflowed) {
+                if (verbose) printf("Missed some changes in %s, rescanning it\n", watch->directory);
+                scan_existing(&state, pending);
+            }
+        }
+        dispatch_settled(&state, pending);
+    }
+    signal(SIGINT, previous_handler);
+
+    // let the workers finish whatever is already queued
+    pthread_mutex_lock(&state.lock);
+    state.shutting_down = true;
+    pthread_cond_broadcast(&state.has_work);
+    pthread_mutex_unlock(&state.lock);
+    for (unsigned i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    printf("Converted %u files, %u failed\n", state.converted, state.failed);
+
+    while (state.retired) {
+        struct retired_skeleton *next = state.retired->next;
+        amc_skeleton_free(state.retired->skeleton);
+        free(state.retired);
+        state.retired = next;
+    }
+    hashmap_free(state.skeletons);
+    hashmap_free(state.in_flight);
+    hashmap_free(pending);
+    pthread_mutex_destroy(&state.lock);
+    pthread_cond_destroy(&state.has_work);
+    free(workers);
+    close(fd);
+    return started == 0 || state.failed > 0;
+}
+
+#else
+
+int watch_directory(struct watch_options *watch, float fps, struct output_options *options, bool verbose) {
+    fprintf(stderr, "Error: watching a directory is only supported on Linux\n");
+    return 1;
+}
+
+#endif